@@ -1,3 +1,4 @@
+import json
 import statistics
 
 def load_values(filename, variables, skip_fields=0):
@@ -39,3 +40,16 @@ def load_values(filename, variables, skip_fields=0):
 	compute_step()
 
 	return sizes, values, yerr
+
+def load_latencies(filenames):
+	"""Loads JSON files with latencies of single operations (written by experiments when given the latency file).
+
+	Returns list of (parameters, latencies) where latencies[engine][operation] contains count, mean, min, p50, p90,
+	p99, p999, max (all in ns) and histogram (list of [upper bound in ns, count] with power of two buckets).
+	"""
+	results = []
+	for filename in filenames:
+		with open(filename) as file:
+			data = json.load(file)
+		results.append((data["parameters"], data["latency_ns"]))
+	return results
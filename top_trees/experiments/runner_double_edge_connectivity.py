@@ -18,7 +18,7 @@ def getM(N):
 
 random.seed(0xDEADBEEF)
 
-program = "bin/experiment_double_edge_connectivity"
+program = "bin/release/experiment_double_edge_connectivity"
 logfile_path  = "experiment_double_edge_connectivity.log" # will create .log output file
 
 ##################
@@ -14,8 +14,9 @@ time_stop_limit      = 3600  # When last step takes longer than X seconds don't
 
 random.seed(0xDEADBEEF)
 
-program = "bin/experiment_edge_weight"
+program = "bin/release/experiment_edge_weight"
 logfile_path  = "experiment_edge_weight.log" # will create .log output file
+latency_path  = None # e.g. "latency_{size}_{random}.json" to store percentiles of single operations from each run
 
 ##################
 
@@ -25,6 +26,8 @@ def execute(params):
 	(size, rnumber) = params
 	# Construct and run command
 	command = [program, rnumber, str(size), str(test_operations)]
+	if latency_path is not None:
+		command.append("latency=" + latency_path.format(size=size, random=rnumber))
 	cmd = subprocess.run(command, stdout=subprocess.PIPE, check=True)
 
 	# Get results
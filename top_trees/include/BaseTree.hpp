@@ -1,5 +1,8 @@
 #include <memory>
 #include <iostream>
+#include <atomic>
+#include <vector>
+#include <functional>
 
 #ifndef BASE_TREE_HPP
 #define BASE_TREE_HPP
@@ -9,7 +12,7 @@ namespace TopTree {
 //------------------------------------------------------------------------------
 
 class VertexData {
-static int v_counter;
+static std::atomic<int> v_counter; // atomic, data could be created from more threads
 public:
 	int index = VertexData::v_counter++;
 	virtual std::ostream& ToString(std::ostream& o) const { return o << "<v" << index << ">"; }
@@ -19,7 +22,7 @@ std::ostream& operator<<(std::ostream& o, const VertexData& v);
 //------------------------------------------------------------------------------
 
 class EdgeData {
-static int e_counter;
+static std::atomic<int> e_counter;
 public:
 	int index = EdgeData::e_counter++;
 	virtual std::ostream& ToString(std::ostream& o) const { return o << "<e" << index << ">"; }
@@ -49,9 +52,64 @@ public:
 	// Shortcut for AddVertex and AddEdge, returns index of the vertex
 	int AddLeaf(int parent, std::shared_ptr<EdgeData> e = NULL, std::shared_ptr<VertexData> v = NULL);
 
+	// Bulk loading (all storage is allocated once before adding):
+
+	/**
+	 * @brief Reserves space for given number of vertices and edges in total.
+	 */
+	void Reserve(int vertices, int edges);
+
+	/**
+	 * @brief Adds count vertices at once.
+	 *
+	 * @param vertex_data Function returning data for the i-th added vertex (default VertexData if not given).
+	 *
+	 * @return Index of the first added vertex (others have consecutive indexes).
+	 */
+	int AddVertices(int count, std::function<std::shared_ptr<VertexData>(int)> vertex_data = NULL);
+
+	/**
+	 * @brief Adds edges between already existing vertices, adjacency of each vertex is allocated only once.
+	 *
+	 * @details Vertex indexes out of range are reported as an error (before any edge is added). Edges are allocated
+	 * densely from the pool of the tree and registered at their endpoints directly (not by AddEdge), they are indexed
+	 * for Cut lazily when it looks for them.
+	 *
+	 * @param edge_data Function returning data for the i-th edge (default EdgeData if not given).
+	 */
+	void AddEdges(const std::vector<std::pair<int, int>>& edges, std::function<std::shared_ptr<EdgeData>(int)> edge_data = NULL);
+
+	/**
+	 * @brief Adds tree (or forest) given by array of parents: i-th new vertex is connected to the parents[i]-th new vertex,
+	 * roots have negative parent.
+	 *
+	 * @param edge_data Function returning data for the edge from the i-th vertex to its parent (default EdgeData if not given).
+	 *
+	 * @return Index of the first added vertex.
+	 */
+	int AddParentArray(const std::vector<int>& parents, std::function<std::shared_ptr<EdgeData>(int)> edge_data = NULL);
+
+	/**
+	 * @brief Reads edge list from the stream and adds its edges (missing vertices are added).
+	 *
+	 * @details Text format contains pairs of vertex indexes separated by whitespaces (lines starting with '#' are
+	 * comments), binary format contains pairs of 32-bit integers. Stream is read in big blocks and parsed in place.
+	 * Malformed input (unexpected characters, odd number of indexes, numbers out of the int range, negative indexes
+	 * or incomplete binary pair) is reported as an error.
+	 *
+	 * @param input Stream to read from (opened in binary mode for the binary format).
+	 * @param binary True for the binary format.
+	 * @param edge_data Function returning data for the i-th read edge (default EdgeData if not given).
+	 *
+	 * @return Number of added edges.
+	 */
+	int LoadEdgeList(std::istream& input, bool binary = false, std::function<std::shared_ptr<EdgeData>(int)> edge_data = NULL);
+
 	// Getters
 	std::shared_ptr<VertexData> GetVertexData(int index);
 	std::shared_ptr<EdgeData> GetEdgeData(int index);
+	// Replaces data of the vertex (default VertexData if NULL), e.g. when its index is reused
+	void SetVertexData(int index, std::shared_ptr<VertexData> v = NULL);
 
 	// Testing functions
 	void PrintRooted(int root);
@@ -1,7 +1,12 @@
 #include <vector>
 #include <list>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
 
 #include "BaseTree.hpp"
+#include "Serialization.hpp"
+#include "ClusterPool.hpp"
 #include "STCluster.hpp"
 #include "TopologyCluster.hpp"
 
@@ -18,11 +23,22 @@ public:
 	struct neighbour {
 		// std::weak_ptr<Vertex> vertex;
 		std::weak_ptr<Edge> edge;
-		std::list<std::shared_ptr<Vertex>>::iterator subvertice_iter; // may be set, it is needed to everytime check the edge->subvertice_edge to test if it is subvertice_edge
+		bool superior; // true if the edge is registered here only because this is the superior vertex of its endpoint
 	};
 
 	std::vector<std::shared_ptr<Vertex> > vertices;
 	std::vector<std::shared_ptr<Edge> > edges;
+	// Edges added by AddEdge(s) are allocated densely from this pool (their allocators keep it alive)
+	std::shared_ptr<ClusterPool> edge_pool = std::make_shared<ClusterPool>();
+	std::shared_ptr<Edge> create_edge(int from, int to, std::shared_ptr<EdgeData> data);
+
+	// Edges by indexes of their endpoints (to find edge for Cut without scanning neighbours of high degree vertices).
+	// Entries are only hints: a found edge is checked to still connect the vertices and missing edges are searched
+	// in neighbours (and added), so trees created by copying or loading need not fill it.
+	std::unordered_map<uint64_t, std::weak_ptr<Edge>> edge_index;
+	void index_edge(int v, int w, std::shared_ptr<Edge> edge);
+	void unindex_edge(int v, int w);
+	std::shared_ptr<Edge> find_edge(int v, int w);
 
 	// Internal functions:
 	std::vector<std::shared_ptr<Vertex> > find_leafs();
@@ -30,6 +46,11 @@ public:
 	void orient_edges_to_root(const std::shared_ptr<Vertex> root, const std::shared_ptr<Vertex> from = NULL);
 
 	void print_rooted_prefix(const std::shared_ptr<Vertex> root, const std::shared_ptr<Vertex> from = NULL, const std::string prefix = "", bool last_child = true) const;
+
+	// Saves/loads all vertices (with subvertices), all current edges and adjacency between them, ids are orders in the file
+	// (first vertices are the same as in the vertices list)
+	void save(std::ostream& o, IDataSerializer& serializer, std::unordered_map<Vertex*, int>& vertex_ids, std::unordered_map<Edge*, int>& edge_ids) const;
+	void load(std::istream& i, IDataSerializer& serializer, std::vector<std::shared_ptr<Vertex>>& all_vertices, std::vector<std::shared_ptr<Edge>>& all_edges);
 };
 
 // Hide data from .hpp file using PIMP idiom
@@ -47,14 +68,15 @@ public:
 	int index;
 
 	// Linkage to the other objects
-	std::list<neighbour> neighbours;
+	// (all lists are flat vectors, removed item is replaced by the last one and its stored index is repaired)
+	std::vector<neighbour> neighbours;
 
 	// Handle
 	// - if degree at least 2: handle is comprees node around this middle vertex
 	// - if leaf: handle is the top most non-rake (base or compress) node having this vertex as one of its endpoints
 
 	// Points to some BaseCluster that has this vertex as one of its endpoints:
-	std::list<std::shared_ptr<STCluster>> base_handles;
+	std::vector<std::shared_ptr<STCluster>> base_handles;
 	// Points to the last STCluster that was found as handle. When this STCluster is no longer a
 	// handle, base_handle is used to recompute it
 	std::shared_ptr<STCluster> last_handle = NULL;
@@ -66,13 +88,19 @@ public:
 
 	// Used in TopologyTopTree
 	std::shared_ptr<Vertex> superior_vertex = NULL;
-	std::list<std::shared_ptr<Vertex>> subvertices;
-	std::list<std::shared_ptr<Vertex>>::iterator superior_vertex_subvertices_iter;
-	std::list<std::shared_ptr<Edge>> subvertice_edges;
+	std::vector<std::shared_ptr<Vertex>> subvertices;
+	int superior_vertex_subvertices_index;
+	std::vector<std::shared_ptr<Edge>> subvertice_edges;
+	// Subvertices with some outer edge in BFS order, new subvertices are added at the first one (may contain removed ones)
+	std::deque<std::weak_ptr<Vertex>> link_slots;
 	std::shared_ptr<TopologyCluster> topology_cluster;
 
-	// Used in TopologyTopTree expose procedure
-	std::vector<std::shared_ptr<SimpleCluster>> expose_clusters;
+	int add_neighbour(std::shared_ptr<Edge> edge, bool superior = false);
+	void remove_neighbour(int index);
+	void add_subvertex(std::shared_ptr<Vertex> subvertex);
+	void remove_subvertex(std::shared_ptr<Vertex> subvertex);
+	void add_subvertice_edge(std::shared_ptr<Edge> edge);
+	void remove_subvertice_edge(std::shared_ptr<Edge> edge);
 
 	void unlink() {
 		neighbours.clear();
@@ -83,8 +111,8 @@ public:
 		superior_vertex = NULL;
 		subvertices.clear();
 		subvertice_edges.clear();
+		link_slots.clear();
 		topology_cluster = NULL;
-		expose_clusters.clear();
 
 		deleted = true;
 	}
@@ -115,15 +143,15 @@ public:
 
 	// Linkage to the other objects
 	std::shared_ptr<Vertex> from;
-	std::list<neighbour>::iterator from_iter;
-	std::list<neighbour>::iterator superior_from_iter;
+	int from_index;
+	int superior_from_index;
 	std::shared_ptr<Vertex> to;
-	std::list<neighbour>::iterator to_iter;
-	std::list<neighbour>::iterator superior_to_iter;
+	int to_index;
+	int superior_to_index;
 
 	// Used in TopologyTopTree
 	bool subvertice_edge = false;
-	std::list<std::shared_ptr<Edge>>::iterator subvertice_edges_iterator;
+	int subvertice_edges_index;
 
 	void unlink() {
 		from = NULL;
@@ -136,16 +164,16 @@ public:
 // Edges in TopologyTree
 // a) normal edge
 //     - from / to = real vertex to which this edge points
-//     - from_iter / to_iter = iter in the neighbours list
-//     - superior_from_iter / superior_to_iter = iterator to the superior vertex's neighbours list
+//     - from_index / to_index = index in the neighbours list
+//     - superior_from_index / superior_to_index = index in the superior vertex's neighbours list
 //     - subvertice_edge = false
-//     - subvertice_edges_iterator = NULL
+//     - subvertice_edges_index = not used
 // b) subvertice edge
 //     - from / to = real vertex to which this edge points
-//     - from_iter / to_iter = iter in the neighbours list
-//     - superior_from_iter / superior_to_iter = NULL
+//     - from_index / to_index = index in the neighbours list
+//     - superior_from_index / superior_to_index = not used
 //     - subvertice_edge = true
-//     - subvertice_edges_iterator = iter in the superior vertex's subvertice_edges list
+//     - subvertice_edges_index = index in the superior vertex's subvertice_edges list
 
 }
 
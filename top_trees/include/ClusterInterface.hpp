@@ -1,6 +1,7 @@
 #include <memory>
 
 #include "BaseTreeInternal.hpp"
+#include "UserFunctions.hpp"
 
 #ifndef CLUSTER_INTERFACE_HPP
 #define CLUSTER_INTERFACE_HPP
@@ -11,8 +12,6 @@ struct ClusterData {
 	virtual ~ClusterData() {}
 };
 
-extern std::shared_ptr<ClusterData> InitClusterData();
-
 /**
  * Generic cluster interface returned from Top Trees methods. Its only public accessible field is shared_pointer to the ClusterData object.
  */
@@ -20,13 +19,23 @@ class ICluster {
 friend class TopologyCluster;
 friend class TopologyTopTree;
 public:
-	std::shared_ptr<ClusterData> data = InitClusterData();
+	ICluster(IUserFunctions* functions): data{functions->InitClusterData()}, functions{functions} {}
+
+	std::shared_ptr<ClusterData> data;
+
+	/**
+	 * @brief Returns data of this cluster casted to the user type (without any runtime check).
+	 */
+	template<class T>
+	T* getData() const { return static_cast<T*>(data.get()); }
 
-	int getLeftBoundary() { return (boundary_left->superior_vertex != NULL ? boundary_left->superior_vertex->index : boundary_left->index); }
-	int getRightBoundary() { return (boundary_right->superior_vertex != NULL ? boundary_right->superior_vertex->index : boundary_right->index); }
+	int getLeftBoundary() const { return (boundary_left->superior_vertex != NULL ? boundary_left->superior_vertex->index : boundary_left->index); }
+	int getRightBoundary() const { return (boundary_right->superior_vertex != NULL ? boundary_right->superior_vertex->index : boundary_right->index); }
 
 	virtual std::ostream& ToString(std::ostream& o) const = 0;
 protected:
+	IUserFunctions* functions; // owned by the top tree
+
 	std::shared_ptr<BaseTree::Internal::Vertex> boundary_left;
 	std::shared_ptr<BaseTree::Internal::Vertex> boundary_right;
 };
@@ -39,11 +48,11 @@ std::ostream& operator<<(std::ostream& o, const ICluster& v);
  *
  * @return bool
  */
-inline bool isLeftRake(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster> right, std::shared_ptr<ICluster> parent) {
-	int l = right->getLeftBoundary();
-	int r = right->getRightBoundary();
-	int pl = parent->getLeftBoundary();
-	int pr = parent->getRightBoundary();
+inline bool isLeftRake(const ICluster& left, const ICluster& right, const ICluster& parent) {
+	int l = right.getLeftBoundary();
+	int r = right.getRightBoundary();
+	int pl = parent.getLeftBoundary();
+	int pr = parent.getRightBoundary();
 	return ((l == pl && r == pr) || (l == pr && r == pl));
 }
 
@@ -52,11 +61,11 @@ inline bool isLeftRake(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster>
  *
  * @return bool
  */
-inline bool isRightRake(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster> right, std::shared_ptr<ICluster> parent) {
-	int l = left->getLeftBoundary();
-	int r = left->getRightBoundary();
-	int pl = parent->getLeftBoundary();
-	int pr = parent->getRightBoundary();
+inline bool isRightRake(const ICluster& left, const ICluster& right, const ICluster& parent) {
+	int l = left.getLeftBoundary();
+	int r = left.getRightBoundary();
+	int pl = parent.getLeftBoundary();
+	int pr = parent.getRightBoundary();
 	return ((l == pl && r == pr) || (l == pr && r == pl));
 }
 
@@ -65,10 +74,15 @@ inline bool isRightRake(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster
  *
  * @return bool
  */
-inline bool isCompress(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster> right, std::shared_ptr<ICluster> parent) {
+inline bool isCompress(const ICluster& left, const ICluster& right, const ICluster& parent) {
 	return (!isLeftRake(left, right, parent) && !isRightRake(left, right, parent));
 }
 
+// Variants for shared pointers:
+inline bool isLeftRake(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster> right, std::shared_ptr<ICluster> parent) { return isLeftRake(*left, *right, *parent); }
+inline bool isRightRake(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster> right, std::shared_ptr<ICluster> parent) { return isRightRake(*left, *right, *parent); }
+inline bool isCompress(std::shared_ptr<ICluster> left, std::shared_ptr<ICluster> right, std::shared_ptr<ICluster> parent) { return isCompress(*left, *right, *parent); }
+
 }
 
 #endif // CLUSTER_INTERFACE_HPP
@@ -0,0 +1,70 @@
+#include <memory>
+#include <vector>
+#include <cstddef>
+
+#ifndef CLUSTER_POOL_HPP
+#define CLUSTER_POOL_HPP
+
+namespace TopTree {
+
+/**
+ * Slab allocator for clusters of one top tree (or edges of one base tree). Memory is taken in big blocks and freed chunks are kept in free lists
+ * (one for each size class), so clusters are stored densely and splaying/splicing does not call malloc at all.
+ *
+ * Blocks are never returned to the system while the pool exists: the memory of freed clusters is only reused for new
+ * clusters, so the pool keeps the peak size of the tree. It exists until the owning top tree and all clusters allocated
+ * from it (e.g. returned to the user by Expose) are destroyed.
+ *
+ * It is not thread safe, it is used only under the owning top tree (or base tree). It must be created by std::make_shared.
+ */
+class ClusterPool: public std::enable_shared_from_this<ClusterPool> {
+public:
+	ClusterPool() {}
+	~ClusterPool();
+
+	void* allocate(size_t size);
+	void deallocate(void* p, size_t size);
+
+	size_t allocated_chunks() const { return chunks_in_use; }
+private:
+	static const size_t granularity = alignof(std::max_align_t);
+	static const size_t block_size = 64*1024;
+	static const size_t max_chunk_size = 1024; // bigger allocations go directly to the operator new
+
+	struct free_chunk {
+		free_chunk* next;
+	};
+
+	std::vector<free_chunk*> free_lists; // indexed by size class
+	std::vector<char*> blocks;
+	char* current = NULL;
+	size_t remaining = 0;
+	size_t chunks_in_use = 0;
+};
+
+/**
+ * Standard allocator over the ClusterPool, used by std::allocate_shared for clusters. Control block of every cluster
+ * holds a copy of it, so the pool stays alive while any of its clusters exists (also after the top tree is destroyed).
+ */
+template<class T>
+class PoolAllocator {
+public:
+	typedef T value_type;
+
+	PoolAllocator(std::shared_ptr<ClusterPool> pool): pool{pool} {}
+	template<class U>
+	PoolAllocator(const PoolAllocator<U>& other): pool{other.pool} {}
+
+	T* allocate(size_t n) { return static_cast<T*>(pool->allocate(n * sizeof(T))); }
+	void deallocate(T* p, size_t n) { pool->deallocate(p, n * sizeof(T)); }
+
+	std::shared_ptr<ClusterPool> pool;
+};
+template<class T, class U>
+bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool == b.pool; }
+template<class T, class U>
+bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool != b.pool; }
+
+}
+
+#endif // CLUSTER_POOL_HPP
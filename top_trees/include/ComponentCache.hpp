@@ -0,0 +1,65 @@
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#ifndef COMPONENT_CACHE_HPP
+#define COMPONENT_CACHE_HPP
+
+#include "TopTreeInterface.hpp"
+
+namespace TopTree {
+
+/**
+ * Wrapper of any ITopTree that caches component labels of vertices, so repeated connectivity queries between updates
+ * are answered in O(1) instead of climbing to the root by ITopTree::FindRoot.
+ *
+ * Every label belongs to one root cluster and it is valid while this root is known to be the root of the component.
+ * Link and Cut invalidate only labels of both affected components, vertices of them get new labels lazily (by one
+ * FindRoot) when they are queried again. Expose and the following Restore restructure only the components of the
+ * exposed vertices, so they invalidate only labels of these components as well.
+ *
+ * All modifications of the tree must go through the wrapper (or be followed by Invalidate).
+ */
+class ComponentCache {
+public:
+	ComponentCache(std::shared_ptr<ITopTree> top_tree): top_tree{top_tree} {}
+
+	/**
+	 * @brief Returns label of the component of given vertex, vertices have the same label iff they are connected.
+	 *
+	 * @details Labels are not stable: after the component is changed (or after Expose) its vertices get new labels.
+	 */
+	uint64_t ComponentId(int v);
+
+	/**
+	 * @brief Returns true if given vertices are in the same tree (O(1) when both labels are cached).
+	 */
+	bool Connected(int v, int w);
+
+	// Operations of the wrapped tree (as in the ITopTree), they keep the cache valid
+	std::shared_ptr<ICluster> Link(int v, int w, std::shared_ptr<EdgeData> edge_data);
+	std::shared_ptr<EdgeData> Cut(int v, int w);
+	std::shared_ptr<ICluster> Expose(int v, int w);
+	void Restore();
+
+	/**
+	 * @brief Forgets all labels (needed after the wrapped tree was modified directly).
+	 */
+	void Invalidate();
+private:
+	std::shared_ptr<ITopTree> top_tree;
+	bool exposed = false;
+	int exposed_v, exposed_w; // valid if exposed
+
+	uint64_t next_label = 1; // labels are never reused, 0 = no label
+	std::vector<uint64_t> vertex_labels;
+	std::unordered_map<uint64_t, ICluster*> label_roots; // valid labels (root is NULL for isolated vertex without cluster)
+	std::unordered_map<ICluster*, uint64_t> root_labels;
+
+	void invalidate_component(int v);
+};
+
+}
+
+#endif // COMPONENT_CACHE_HPP
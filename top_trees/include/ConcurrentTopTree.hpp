@@ -0,0 +1,83 @@
+#include <memory>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+
+#ifndef CONCURRENT_TOP_TREE_HPP
+#define CONCURRENT_TOP_TREE_HPP
+
+#include "TopologyTopTree.hpp"
+
+namespace TopTree {
+
+/**
+ * Wrapper of the TopologyTopTree for the use from more threads: any number of readers may run path and connectivity
+ * queries at once, updates are done by one writer at a time (and wait for the running queries).
+ *
+ * Queries use TopologyTopTree::QueryPath which does not modify the tree, so they only need a shared lock. Each update
+ * restores the tree before it releases the exclusive lock, so readers always see the tree without any expose. Waiting
+ * writer stops new readers from entering, so it is not starved by a continuous stream of queries.
+ *
+ * User functions are called from the reader threads too, so CopyClusterData, Join and Split must not modify shared
+ * state (Create and Destroy are called only by the writer). The wrapped tree must not be used directly.
+ */
+class ConcurrentTopTree {
+public:
+	ConcurrentTopTree(std::shared_ptr<TopologyTopTree> top_tree): top_tree{top_tree} {}
+
+	// Readers:
+
+	/**
+	 * @brief Returns cluster with data of the path between given vertices (see TopologyTopTree::QueryPath).
+	 *
+	 * @return Shared pointer to the cluster owned by the caller or NULL if the path does not exist.
+	 */
+	std::shared_ptr<ICluster> QueryPath(int v, int w) const;
+
+	/**
+	 * @brief Returns true if given vertices are in the same tree.
+	 */
+	bool Connected(int v, int w) const;
+
+	// Writer:
+
+	/**
+	 * @brief Links given vertices by a new edge.
+	 *
+	 * @return True if the edge was added (false if they were already connected).
+	 */
+	bool Link(int v, int w, std::shared_ptr<EdgeData> edge_data);
+
+	/**
+	 * @brief Cuts the edge between given vertices.
+	 *
+	 * @return EdgeData of the removed edge or NULL if there is no such edge.
+	 */
+	std::shared_ptr<EdgeData> Cut(int v, int w);
+
+	/**
+	 * @brief Applies cuts and then links at once (see ITopTree::BatchUpdate).
+	 *
+	 * @return Number of successfully applied operations.
+	 */
+	int BatchUpdate(const std::vector<std::pair<int, int>>& cuts, const std::vector<LinkUpdate>& links);
+
+	/**
+	 * @brief Exposes path between given vertices and calls given function on its cluster to modify its data (e.g.
+	 * add lazy value), the tree is restored afterwards.
+	 *
+	 * @return False if the path does not exist (the function is not called then).
+	 */
+	bool UpdatePath(int v, int w, std::function<void(std::shared_ptr<ICluster>)> update);
+private:
+	std::shared_ptr<TopologyTopTree> top_tree;
+	mutable std::shared_timed_mutex mutex;
+	mutable std::mutex writer_gate; // held by the writer while it waits for the lock and updates
+
+	std::shared_lock<std::shared_timed_mutex> read_lock() const;
+};
+
+}
+
+#endif // CONCURRENT_TOP_TREE_HPP
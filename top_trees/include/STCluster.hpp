@@ -8,6 +8,7 @@ class STCluster;
 }
 
 #include "ClusterInterface.hpp"
+#include "ClusterPool.hpp"
 #include "BaseTreeInternal.hpp"
 #include "UserFunctions.hpp"
 
@@ -19,8 +20,17 @@ friend class BaseCluster;
 friend class CompressCluster;
 friend class RakeCluster;
 public:
+	STCluster(IUserFunctions* functions, ClusterPool* pool): ICluster(functions), pool{pool} {}
+
 	virtual std::ostream& ToString(std::ostream& o) const = 0;
 protected:
+	ClusterPool* pool; // pool of the top tree (kept alive by the allocator of this cluster)
+
+	template<class T>
+	static std::shared_ptr<T> allocate(IUserFunctions* functions, ClusterPool* pool) {
+		return std::allocate_shared<T>(PoolAllocator<T>(pool->shared_from_this()), functions, pool);
+	}
+
 	std::shared_ptr<BaseTree::Internal::Vertex> common_vertex;
 
 	std::shared_ptr<STCluster> parent = NULL;
@@ -29,10 +39,10 @@ protected:
 	std::shared_ptr<STCluster> left_foster = NULL;
 	std::shared_ptr<STCluster> right_foster = NULL;
 
-	void set_left_child(std::shared_ptr<STCluster> child);
-	void set_right_child(std::shared_ptr<STCluster> child);
-	void set_left_foster(std::shared_ptr<STCluster> child);
-	void set_right_foster(std::shared_ptr<STCluster> child);
+	void set_left_child(const std::shared_ptr<STCluster>& child);
+	void set_right_child(const std::shared_ptr<STCluster>& child);
+	void set_left_foster(const std::shared_ptr<STCluster>& child);
+	void set_right_foster(const std::shared_ptr<STCluster>& child);
 
 	std::list<std::shared_ptr<STCluster>>::iterator root_clusters_iterator;
 	bool is_splitted = true; // Initially clusters are in state that they need do_join method (which is called during construction)
@@ -59,15 +69,18 @@ std::ostream& operator<<(std::ostream& o, const STCluster& v);
 class BaseCluster : public STCluster {
 friend class STTopTree;
 public:
+	BaseCluster(IUserFunctions* functions, ClusterPool* pool): STCluster(functions, pool) {}
+
 	virtual std::ostream& ToString(std::ostream& o) const;
-	static std::shared_ptr<BaseCluster> construct(std::shared_ptr<BaseTree::Internal::Edge> edge);
+	static std::shared_ptr<BaseCluster> construct(std::shared_ptr<BaseTree::Internal::Edge> edge, IUserFunctions* functions, ClusterPool* pool);
 protected:
 
 	std::shared_ptr<BaseTree::Internal::Edge> edge;
 
 	bool handles_registered = false;
-	std::list<std::shared_ptr<STCluster>>::iterator boundary_left_handles_iterator;
-	std::list<std::shared_ptr<STCluster>>::iterator boundary_right_handles_iterator;
+	int from_handles_index; // index in the edge->from->base_handles
+	int to_handles_index; // index in the edge->to->base_handles
+	static void remove_base_handle(std::shared_ptr<BaseTree::Internal::Vertex> v, int index);
 
 	virtual bool isBase() { return true; }
 	virtual void do_join();
@@ -86,6 +99,8 @@ protected:
 class RakeCluster : public STCluster {
 friend class STTopTree;
 public:
+	RakeCluster(IUserFunctions* functions, ClusterPool* pool): STCluster(functions, pool) {}
+
 	virtual std::ostream& ToString(std::ostream& o) const;
 	static std::shared_ptr<RakeCluster> construct(std::shared_ptr<STCluster> rake_from, std::shared_ptr<STCluster> rake_to, bool virtual_cluster = false);
 protected:
@@ -107,6 +122,8 @@ protected:
 class CompressCluster : public STCluster {
 friend class STTopTree;
 public:
+	CompressCluster(IUserFunctions* functions, ClusterPool* pool): STCluster(functions, pool) {}
+
 	virtual std::ostream& ToString(std::ostream& o) const;
 	static std::shared_ptr<CompressCluster> construct(std::shared_ptr<STCluster> left, std::shared_ptr<STCluster> right);
 protected:
@@ -10,8 +10,8 @@ namespace TopTree {
 
 class STTopTree: public ITopTree {
 public:
-	STTopTree();
-	STTopTree(std::shared_ptr<BaseTree> baseTree); // Construct from underlying tree
+	STTopTree(std::shared_ptr<IUserFunctions> functions);
+	STTopTree(std::shared_ptr<IUserFunctions> functions, std::shared_ptr<BaseTree> baseTree); // Construct from underlying tree
 	~STTopTree();
 
 	void InitFromBaseTree(std::shared_ptr<BaseTree> baseTree);
@@ -20,8 +20,12 @@ public:
 	std::shared_ptr<ICluster> Expose(int v, int w);
 	std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr<EdgeData>> Cut(int v, int w);
 	std::shared_ptr<ICluster> Link(int v, int w, std::shared_ptr<EdgeData> edge_data);
+	bool Connected(int v, int w) const;
+	std::shared_ptr<ICluster> FindRoot(int v) const;
 	void Restore();
 	std::pair<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>> SplitRoot(std::shared_ptr<ICluster> root);
+	void Save(const std::string& path, IDataSerializer& serializer);
+	void Load(const std::string& path, IDataSerializer& serializer);
 private:
 	class Internal;
 	std::unique_ptr<Internal> internal;
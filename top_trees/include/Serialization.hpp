@@ -0,0 +1,124 @@
+#include <memory>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <climits>
+
+#ifndef SERIALIZATION_HPP
+#define SERIALIZATION_HPP
+
+#include "BaseTree.hpp"
+
+namespace TopTree {
+
+class ICluster;
+
+/**
+ * Saves and loads user data for ITopTree::Save and ITopTree::Load. Top trees write only their own structure, everything
+ * stored in VertexData, EdgeData and ClusterData is written by this interface.
+ *
+ * All vertex data are saved (and loaded) before all edge data and these before all cluster data, so the serializer may
+ * remember already written edges (e.g. when cluster data points to some edge, write only its order).
+ */
+class IDataSerializer {
+public:
+	virtual ~IDataSerializer() {}
+
+	virtual void SaveVertexData(std::ostream& o, const std::shared_ptr<VertexData>& data) = 0;
+	virtual std::shared_ptr<VertexData> LoadVertexData(std::istream& i) = 0;
+
+	virtual void SaveEdgeData(std::ostream& o, const std::shared_ptr<EdgeData>& data) = 0;
+	virtual std::shared_ptr<EdgeData> LoadEdgeData(std::istream& i) = 0;
+
+	virtual void SaveClusterData(std::ostream& o, const ICluster& cluster) = 0;
+	virtual void LoadClusterData(std::istream& i, ICluster& cluster) = 0;
+};
+
+// Helper functions for the binary format (values are stored in the native byte order):
+
+// Truncated or corrupted file is an error, nothing read from it is used unchecked
+inline void readError(const char* reason) {
+	std::cerr << "ERROR: Corrupted top tree file (" << reason << ")" << std::endl;
+	exit(1);
+}
+
+template<class T>
+inline void writeValue(std::ostream& o, const T& value) {
+	o.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+inline T readValue(std::istream& i) {
+	T value;
+	i.read(reinterpret_cast<char*>(&value), sizeof(T));
+	if (!i) readError("unexpected end of file");
+	return value;
+}
+
+// Reads count of some items (at most limit, so corrupted count does not allocate huge arrays)
+inline int32_t readCount(std::istream& i, int64_t limit) {
+	int32_t count = readValue<int32_t>(i);
+	if (count < 0 || count > limit) readError("count out of range");
+	return count;
+}
+
+// Reads id of one of the size items, -1 means no item and it is accepted only if optional
+inline int32_t readId(std::istream& i, size_t size, bool optional = true) {
+	int32_t id = readValue<int32_t>(i);
+	if (id < (optional ? -1 : 0) || id >= (int64_t) size) readError("id out of range");
+	return id;
+}
+
+// Bytes left in the stream, every saved item takes at least one (so it bounds all counts)
+inline int64_t remainingBytes(std::istream& i) {
+	auto position = i.tellg();
+	if (position < 0) return INT32_MAX; // stream without positions, counts are limited by their type only
+	i.seekg(0, std::ios::end);
+	auto end = i.tellg();
+	i.seekg(position);
+	return end - position;
+}
+
+inline void writeString(std::ostream& o, const std::string& s) {
+	writeValue<uint32_t>(o, s.size());
+	o.write(s.data(), s.size());
+}
+
+inline std::string readString(std::istream& i) {
+	uint32_t size = readValue<uint32_t>(i);
+	// Read by blocks, so corrupted size fails at the end of the file instead of allocating it at once
+	std::string s;
+	while (s.size() < size) {
+		size_t block = std::min<size_t>(size - s.size(), 4096);
+		s.resize(s.size() + block);
+		i.read(&s[s.size() - block], block);
+		if (!i) readError("unexpected end of file");
+	}
+	return s;
+}
+
+// File starts with magic number, version and the engine that saved it
+enum class SerializedEngine: int32_t { ST = 1, Topology = 2 };
+const int32_t serialization_version = 3; // increased with every change of the format
+
+inline void writeHeader(std::ostream& o, SerializedEngine engine) {
+	writeValue<uint32_t>(o, 0x45455254); // "TREE"
+	writeValue<int32_t>(o, serialization_version);
+	writeValue<SerializedEngine>(o, engine);
+}
+
+inline void readHeader(std::istream& i, SerializedEngine engine) {
+	uint32_t magic = readValue<uint32_t>(i);
+	int32_t version = readValue<int32_t>(i);
+	SerializedEngine saved_engine = readValue<SerializedEngine>(i);
+	if (!i || magic != 0x45455254 || version != serialization_version || saved_engine != engine) {
+		std::cerr << "ERROR: File is not a top tree saved by the same engine" << std::endl;
+		exit(1);
+	}
+}
+
+}
+
+#endif // SERIALIZATION_HPP
@@ -0,0 +1,78 @@
+#include <memory>
+#include <vector>
+#include <functional>
+
+#ifndef SHARDED_TOP_TREE_HPP
+#define SHARDED_TOP_TREE_HPP
+
+#include "TopTreeInterface.hpp"
+
+namespace TopTree {
+
+/**
+ * Forest split into more independent top trees (shards). Every tree of the forest lives whole in one shard, so operations
+ * on different shards could be done in parallel. Vertices have global indexes, the front end maps them to the shards.
+ *
+ * Link of vertices from different shards moves the smaller tree into the shard of the bigger one (its edges are cut in
+ * the old shard and linked in the new one, EdgeData are kept). Old copies of moved vertices stay isolated in the old
+ * shard and their indexes are reused by vertices added there later, so moving trees back and forth does not grow the
+ * shards. Cut does not move anything.
+ *
+ * The structure itself is not thread safe, parallelism is inside the Apply method.
+ */
+class ShardedTopTree {
+public:
+	/**
+	 * @param make_top_tree Function creating an empty top tree for one shard.
+	 * @param shards Number of shards.
+	 * @param threads Number of threads used by Apply (including the calling one), 0 means number of hardware threads.
+	 * Workers are started once here and sleep between the Apply calls.
+	 */
+	ShardedTopTree(std::function<std::shared_ptr<ITopTree>()> make_top_tree, unsigned int shards, unsigned int threads = 0);
+	~ShardedTopTree();
+
+	/**
+	 * @brief Adds isolated vertex into the shard with the least vertices.
+	 *
+	 * @return Global index of the vertex.
+	 */
+	int AddVertex(std::shared_ptr<VertexData> data = NULL);
+
+	// Operations with global indexes (as in the ITopTree, Cut returns only EdgeData of the removed edge)
+	std::shared_ptr<ICluster> Expose(int v, int w);
+	std::shared_ptr<EdgeData> Cut(int v, int w);
+	std::shared_ptr<ICluster> Link(int v, int w, std::shared_ptr<EdgeData> edge_data);
+	bool Connected(int v, int w) const; // vertices in different shards are never connected
+
+	struct Operation {
+		enum Type { LINK, CUT, EXPOSE } type;
+		int v;
+		int w;
+		std::shared_ptr<EdgeData> edge_data; // only for LINK
+	};
+
+	/**
+	 * @brief Applies operations in parallel, operations of one shard are done in the given order.
+	 *
+	 * @details Operations are queued by the shard of their vertices. Worker threads start with their own shards and then
+	 * take (steal) queues of other shards which are not processed yet. Links between shards (moving a tree) are queued
+	 * too and done together after the queues, only later operations on the shards of these links wait for them.
+	 *
+	 * @param operations Operations to apply.
+	 * @param callback Called for every EXPOSE operation with its index and the exposed cluster (NULL if there is no
+	 * path), the cluster is valid only during the callback. It may be called from more threads at once (for different shards).
+	 *
+	 * @return Number of successful links and cuts.
+	 */
+	int Apply(const std::vector<Operation>& operations, std::function<void(size_t, std::shared_ptr<ICluster>)> callback = NULL);
+
+	// Index of the shard where the vertex is now
+	int GetShard(int v) const;
+private:
+	class Internal;
+	std::unique_ptr<Internal> internal;
+};
+
+}
+
+#endif // SHARDED_TOP_TREE_HPP
@@ -0,0 +1,51 @@
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+
+#ifndef STATISTICS_HPP
+#define STATISTICS_HPP
+
+namespace TopTree {
+
+/**
+ * Counters of hot paths of both engines, they show whether a slow operation was caused by deep splaying, big rejoin
+ * fan-out or by allocations. Counting is compiled only with TOP_TREE_STATS defined (make STATS=1), otherwise
+ * TOP_TREE_COUNT is empty and all counters stay zero.
+ *
+ * Counters are global for all top trees (relaxed atomics, so they could be incremented from more threads).
+ */
+struct Statistics {
+	// Both engines
+	std::atomic<uint64_t> exposes{0};
+	std::atomic<uint64_t> joins{0}; // do_join calls that joined a cluster
+	std::atomic<uint64_t> splits{0}; // do_split calls that splitted a cluster
+
+	// STTopTree
+	std::atomic<uint64_t> rotations{0}; // rotate_left and rotate_right
+	std::atomic<uint64_t> splices{0};
+	std::atomic<uint64_t> get_handle_calls{0};
+	std::atomic<uint64_t> get_handle_climbs{0}; // steps up from the last handle
+
+	// TopologyTopTree
+	std::atomic<uint64_t> update_rounds{0}; // rounds of update_clusters
+	std::atomic<uint64_t> update_list_items{0}; // sum of sizes of delete, change and abandon lists over all rounds
+	std::atomic<uint64_t> simple_clusters{0}; // SimpleClusters used for edge clusters and Expose
+	std::atomic<uint64_t> simple_cluster_allocations{0}; // of them newly allocated (the others were recycled)
+
+	void Reset();
+	void Print(std::ostream& o) const;
+};
+
+extern Statistics statistics;
+
+#ifdef TOP_TREE_STATS
+	const bool statistics_enabled = true;
+	#define TOP_TREE_COUNT(counter, n) TopTree::statistics.counter.fetch_add(n, std::memory_order_relaxed)
+#else
+	const bool statistics_enabled = false;
+	#define TOP_TREE_COUNT(counter, n) ((void) 0)
+#endif
+
+}
+
+#endif // STATISTICS_HPP
@@ -0,0 +1,52 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstddef>
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+namespace TopTree {
+
+/**
+ * Fixed group of worker threads started once and reused for many parallel steps, so short steps (e.g. levels of the
+ * construction or batches of shard updates) do not pay for starting and joining threads every time.
+ *
+ * Workers sleep on a condition variable between the runs. The calling thread takes part in every run too, so the pool
+ * of size 1 has no workers and runs everything in the calling thread.
+ *
+ * Run is called only from one thread at a time (the owner of the pool).
+ */
+class ThreadPool {
+public:
+	ThreadPool(unsigned int threads); // threads including the calling one (threads - 1 workers are started)
+	~ThreadPool();
+
+	unsigned int size() const { return workers.size() + 1; }
+
+	// Runs f(0), ..., f(tasks - 1) on the workers and the calling thread, returns when all of them are finished
+	void run(size_t tasks, const std::function<void(size_t)>& f);
+private:
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+	bool stopping = false;
+	size_t generation = 0; // number of the current run (workers wait for the next one)
+	size_t running = 0; // workers that did not finish the current run yet
+
+	const std::function<void(size_t)>* job = NULL;
+	size_t job_tasks = 0;
+	std::atomic<size_t> next_task{0};
+
+	void work();
+	void take_tasks(const std::function<void(size_t)>& f, size_t tasks);
+};
+
+}
+
+#endif // THREAD_POOL_HPP
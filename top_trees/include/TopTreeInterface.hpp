@@ -1,13 +1,27 @@
 #include <memory>
 #include <vector>
+#include <string>
+#include <tuple>
+#include <functional>
+#include <algorithm>
 
 #ifndef TOP_TREE_INTERFACE_HPP
 #define TOP_TREE_INTERFACE_HPP
 
 #include "ClusterInterface.hpp"
 #include "BaseTree.hpp"
+#include "Serialization.hpp"
 
 namespace TopTree {
+/**
+ * One link for the ITopTree::BatchUpdate (parameters are the same as for the ITopTree::Link).
+ */
+struct LinkUpdate {
+	int v;
+	int w;
+	std::shared_ptr<EdgeData> edge_data;
+};
+
 /**
  * Generic interface for all Top Trees implementations. It provides basic operations (Cut, Join and Expose).
  */
@@ -58,6 +72,29 @@ public:
 	 */
 	virtual std::shared_ptr<ICluster> Link(int v, int w, std::shared_ptr<EdgeData> edge_data) = 0;
 
+	/**
+	 * @brief Returns true if given vertices are in the same tree.
+	 *
+	 * @details Roots of both vertices are compared (as by FindRoot). TopologyTopTree only follows parent pointers, it is
+	 * O(log n) and safe for concurrent readers. STTopTree splays clusters of the vertices below their roots (user Join
+	 * and Split are called), it is amortized O(log n) as its other operations. Use ComponentCache for many queries
+	 * between updates. Every vertex is connected with itself.
+	 */
+	virtual bool Connected(int v, int w) const = 0;
+
+	/**
+	 * @brief Returns root cluster of the top tree containing given vertex (roots are never changed by it).
+	 *
+	 * @details Two vertices are in the same tree iff they have the same root, so the pointer could be used as an identifier
+	 * of the component until the next Expose, Link, Cut or BatchUpdate. It costs as Connected: O(log n) for
+	 * TopologyTopTree, amortized O(log n) for STTopTree which splays below the root (not while some Expose is not
+	 * restored, then it only climbs to the root).
+	 *
+	 * @return shared_ptr to the root cluster or NULL for the vertex without edges that has no cluster (isolated vertex
+	 * may also be its own single vertex tree, it depends on the engine).
+	 */
+	virtual std::shared_ptr<ICluster> FindRoot(int v) const = 0;
+
 	/**
 	 * @brief Restore the top tree to normalized shape after previous operation.
 	 *
@@ -66,7 +103,92 @@ public:
 	 */
 	virtual void Restore() = 0;
 
+	/**
+	 * @brief Restore after expose whose cluster data were only read (not modified).
+	 *
+	 * @details Implementations may skip pushing of the data down to the original clusters, by default it is the Restore.
+	 */
+	virtual void RestoreReadOnly() { Restore(); }
+
+	/**
+	 * @brief Answers many read-only path queries.
+	 *
+	 * @details Duplicate paths (also with swapped endpoints) are exposed once. TopologyTopTree orders the queries by
+	 * positions of their endpoints in the hierarchy and between two queries joins back only clusters which the next
+	 * one does not split, so upper parts of root paths shared by the queries are splitted and joined once for the whole
+	 * batch. The default (used by STTopTree) is a loop of Expose and RestoreReadOnly. Callback gets index of the query in
+	 * the given vector and exposed root cluster (or NULL when the path does not exist), same paths get the same cluster.
+	 * Callback must not modify the cluster data and must not call other operations of the top tree.
+	 *
+	 * @param paths Pairs of indexes of endpoints (as for the Expose).
+	 * @param callback Function called once for every query.
+	 */
+	virtual void QueryPaths(const std::vector<std::pair<int, int>>& paths, std::function<void(size_t, std::shared_ptr<ICluster>)> callback) {
+		Restore();
+
+		// Sort queries by their endpoints to find the same paths (path v-w is the same as w-v)
+		std::vector<std::pair<std::pair<int, int>, size_t>> queries;
+		queries.reserve(paths.size());
+		for (size_t i = 0; i < paths.size(); i++) {
+			auto p = paths[i];
+			if (p.first > p.second) std::swap(p.first, p.second);
+			queries.push_back(std::make_pair(p, i));
+		}
+		std::sort(queries.begin(), queries.end());
+
+		for (size_t i = 0; i < queries.size(); i++) {
+			auto cluster = Expose(queries[i].first.first, queries[i].first.second);
+			// Same paths get the same cluster
+			size_t j = i;
+			for (; j < queries.size() && queries[j].first == queries[i].first; j++) callback(queries[j].second, cluster);
+			i = j - 1;
+			RestoreReadOnly();
+		}
+	}
+
+	/**
+	 * @brief Applies many cuts and links (firstly all cuts, then all links).
+	 *
+	 * @details TopologyTopTree changes all edges between vertices without subvertices at once and repairs the
+	 * hierarchy above them in one pass for the cuts and one for the links, so clusters touched by more updates are
+	 * splitted and rebuilt only once (updates which have to change subvertices are applied separately after the pass).
+	 * The default is a plain loop. Links are checked against the forest after the cuts: cuts of vertices not linked by
+	 * an edge and links of vertices in the same tree (also through earlier links of the batch) are skipped.
+	 *
+	 * @param cuts Pairs of indexes of vertices (as for the Cut) whose edges will be cut.
+	 * @param links Links to add (as for the Link).
+	 *
+	 * @return number of applied updates.
+	 */
+	virtual int BatchUpdate(const std::vector<std::pair<int, int>>& cuts, const std::vector<LinkUpdate>& links) {
+		int applied = 0;
+		for (auto &c: cuts) if (std::get<2>(Cut(c.first, c.second)) != NULL) applied++;
+		for (auto &l: links) if (Link(l.v, l.w, l.edge_data) != NULL) applied++;
+		return applied;
+	}
+
 	virtual std::pair<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>> SplitRoot(std::shared_ptr<ICluster> root) = 0;
+
+	/**
+	 * @brief Saves the whole forest into binary file, so it could be loaded without building it again.
+	 *
+	 * @details Tree is restored before saving. User data are written by the given serializer.
+	 *
+	 * @param path Path to the file (it is overwritten).
+	 * @param serializer Writer of user VertexData, EdgeData and ClusterData.
+	 */
+	virtual void Save(const std::string& path, IDataSerializer& serializer) = 0;
+
+	/**
+	 * @brief Loads forest saved by the same engine, it is used instead of InitFromBaseTree.
+	 *
+	 * @details Vertices have the same indexes as in the saved tree, the top tree must be empty (created without base
+	 * tree). Clusters are restored as they were saved (nothing is joined again). Truncated or corrupted file is an error.
+	 *
+	 * @param path Path to the file.
+	 * @param serializer Reader of user VertexData, EdgeData and ClusterData (the same that saved them).
+	 */
+	virtual void Load(const std::string& path, IDataSerializer& serializer) = 0;
 };
 
 }
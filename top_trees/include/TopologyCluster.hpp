@@ -1,5 +1,8 @@
 #include <memory>
 #include <vector>
+#include <atomic>
+#include <iostream>
+#include <cstdlib>
 
 #ifndef TOPOLOGY_CLUSTER_HPP
 #define TOPOLOGY_CLUSTER_HPP
@@ -7,19 +10,21 @@
 namespace TopTree {
 class TopologyCluster;
 class SimpleCluster;
+class SimpleClusterPool;
 }
 
 #include "ClusterInterface.hpp"
 #include "BaseTreeInternal.hpp"
+#include "ClusterPool.hpp"
 
 namespace TopTree {
 class TopologyCluster : public ICluster, public std::enable_shared_from_this<TopologyCluster> {
 friend class TopologyTopTree;
 friend class SimpleCluster;
 public:
-	static int global_index;
+	static std::atomic<int> global_index;
 
-	TopologyCluster();
+	TopologyCluster(IUserFunctions* functions, SimpleClusterPool* simple_pool = NULL);
 
 	virtual std::ostream& ToString(std::ostream& o) const;
 protected:
@@ -28,6 +33,44 @@ protected:
 		std::shared_ptr<TopologyCluster> cluster;
 	};
 
+	// Outer edges stored inline without allocation. Cluster has at most three of them (vertices with higher degree are
+	// splitted into subvertices), one more place is left as a reserve.
+	class outer_edges_list {
+	public:
+		static const size_t capacity = 4;
+
+		neighbour* begin() { return items; }
+		neighbour* end() { return items + count; }
+		const neighbour* begin() const { return items; }
+		const neighbour* end() const { return items + count; }
+		size_t size() const { return count; }
+		neighbour& operator[](size_t i) { return items[i]; }
+
+		void push_back(const neighbour& n) {
+			if (count == capacity) {
+				std::cerr << "ERROR: Topology cluster has more than " << capacity << " outer edges" << std::endl;
+				exit(1);
+			}
+			items[count++] = n;
+		}
+		void erase(neighbour* it) {
+			for (; it + 1 < end(); it++) *it = std::move(*(it + 1));
+			items[--count] = neighbour();
+		}
+		void clear() { resize(0); }
+		void resize(size_t n) {
+			if (n > capacity) {
+				std::cerr << "ERROR: Topology cluster has more than " << capacity << " outer edges" << std::endl;
+				exit(1);
+			}
+			for (size_t i = n; i < count; i++) items[i] = neighbour(); // release pointers
+			count = n;
+		}
+	private:
+		neighbour items[capacity];
+		size_t count = 0;
+	};
+
 	int index;
 
 	bool is_top_cluster = true; // if it contains at least one edge (and is therefore valid top cluster)
@@ -43,12 +86,14 @@ protected:
 	// Vertex if it is the base topology cluster
 	std::shared_ptr<BaseTree::Internal::Vertex> vertex;
 
-	std::vector<neighbour> outer_edges;
+	outer_edges_list outer_edges;
 	int outer_edges_count = 0;
+	int level_index = -1; // position in its level during construction
 
 	// Data of corresponding clusters in the top tree:
 	std::shared_ptr<ICluster> edge_cluster;
 	std::shared_ptr<ICluster> combined_edge_cluster;
+	SimpleClusterPool* simple_pool; // owned by the top tree, NULL for temporary copies of clusters
 
 	void set_first_child(std::shared_ptr<TopologyCluster> child);
 	void set_second_child(std::shared_ptr<TopologyCluster> child);
@@ -60,12 +105,16 @@ protected:
 	bool listed_in_abandon_list = false;
 	bool listed_in_recompute_list = false;
 
-	void do_split(std::vector<std::shared_ptr<TopologyCluster>>* splitted_clusters = NULL);
+	// read_only: do not Destroy edge clusters into EdgeData (used on temporary copies of clusters)
+	void do_split(std::vector<std::shared_ptr<TopologyCluster>>* splitted_clusters = NULL, bool read_only = false);
 	void do_join();
 
 	bool is_external_boundary_vertex(std::shared_ptr<BaseTree::Internal::Vertex> v);
 
-	void calculate_outer_edges(bool check_neighbours = false);
+	void calculate_outer_edges();
+	// Points outer edges of neighbours to this cluster (adds edges they miss), call it when all changed clusters of the
+	// level have their outer edges calculated (neighbours not calculated yet could hold stale edges)
+	void update_neighbours();
 	void remove_all_outer_edges();
 
 	void unlink();
@@ -85,9 +134,14 @@ std::ostream& operator<<(std::ostream& o, const TopologyCluster& v);
 
 class SimpleCluster: public ICluster, public std::enable_shared_from_this<SimpleCluster> {
 friend class TopologyTopTree;
+friend class SimpleClusterPool;
 public:
+	SimpleCluster(IUserFunctions* functions): ICluster(functions) {}
+
 	std::ostream& ToString(std::ostream& o) const { return o; }
-	static std::shared_ptr<SimpleCluster> construct(std::shared_ptr<ICluster> first, std::shared_ptr<ICluster> second);
+	// Takes cluster from the pool (or allocates new one when the pool is NULL), always with data in its initial state
+	static std::shared_ptr<SimpleCluster> create(IUserFunctions* functions, SimpleClusterPool* pool);
+	static std::shared_ptr<SimpleCluster> construct(std::shared_ptr<ICluster> first, std::shared_ptr<ICluster> second, IUserFunctions* functions, SimpleClusterPool* pool = NULL);
 protected:
 	std::shared_ptr<BaseTree::Internal::Edge> edge = NULL;
 
@@ -101,6 +155,26 @@ protected:
 	void unlink(bool recursive = false);
 };
 
+/**
+ * Recycles SimpleClusters of one top tree (edge clusters of joins and temporary clusters of Expose) together with their
+ * ClusterData, which is reset by ResetClusterData. New clusters are allocated from the ClusterPool, so Link, Cut and
+ * Expose do not call malloc for them.
+ *
+ * It is not thread safe, read-only queries (which could run concurrently) allocate their clusters directly.
+ */
+class SimpleClusterPool {
+public:
+	SimpleClusterPool(IUserFunctions* functions): functions{functions} {}
+
+	std::shared_ptr<SimpleCluster> get();
+	// Keeps the cluster for later use if nobody else holds it
+	void put(std::shared_ptr<SimpleCluster>& cluster);
+private:
+	IUserFunctions* functions; // owned by the top tree
+	std::shared_ptr<ClusterPool> memory = std::make_shared<ClusterPool>();
+	std::vector<std::shared_ptr<SimpleCluster>> free_clusters;
+};
+
 }
 
 #endif // TOPOLOGY_CLUSTER_HPP
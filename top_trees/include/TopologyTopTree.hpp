@@ -11,18 +11,51 @@ namespace TopTree {
 
 class TopologyTopTree: public ITopTree {
 public:
-	TopologyTopTree();
-	TopologyTopTree(std::shared_ptr<BaseTree> baseTree); // Construct from underlying tree
+	TopologyTopTree(std::shared_ptr<IUserFunctions> functions);
+	TopologyTopTree(std::shared_ptr<IUserFunctions> functions, std::shared_ptr<BaseTree> baseTree); // Construct from underlying tree
 	~TopologyTopTree();
 
 	void InitFromBaseTree(std::shared_ptr<BaseTree> baseTree);
 
+	/**
+	 * @brief Sets number of threads used by InitFromBaseTree for construction of levels of topology trees.
+	 *
+	 * @details Shape of constructed trees does not depend on the number of threads. User functions are still called
+	 * only from the calling thread. Threads are started once for all levels and small trees are constructed without
+	 * them.
+	 *
+	 * @param threads Number of threads, 0 means number of hardware threads (default).
+	 */
+	void SetConstructionThreads(unsigned int threads);
+
 	// User operations (documented in the ITopTree interface)
 	std::shared_ptr<ICluster> Expose(int v, int w);
 	std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr<EdgeData>> Cut(int v, int w);
 	std::shared_ptr<ICluster> Link(int v, int w, std::shared_ptr<EdgeData> edge_data);
+	bool Connected(int v, int w) const;
+	std::shared_ptr<ICluster> FindRoot(int v) const;
 	void Restore();
+	void RestoreReadOnly();
+	void QueryPaths(const std::vector<std::pair<int, int>>& paths, std::function<void(size_t, std::shared_ptr<ICluster>)> callback);
+	int BatchUpdate(const std::vector<std::pair<int, int>>& cuts, const std::vector<LinkUpdate>& links);
 	std::pair<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>> SplitRoot(std::shared_ptr<ICluster> root);
+	void Save(const std::string& path, IDataSerializer& serializer);
+	void Load(const std::string& path, IDataSerializer& serializer);
+
+	/**
+	 * @brief Returns cluster with data of the path between given vertices without modifying the top tree.
+	 *
+	 * @details Clusters on the paths from both vertices to the root are copied and the expose is done on the copies,
+	 * so the tree (including EdgeData) is only read and queries could run from more threads at once (if there is no
+	 * concurrent modification and user functions do not modify shared state). Returned cluster is owned by the caller,
+	 * no Restore is needed. It must not be called while some Expose is not restored.
+	 *
+	 * @param v Index of the first vertex.
+	 * @param w Index of the second vertex.
+	 *
+	 * @return Shared pointer to the cluster of the path or NULL if vertices are not in the same tree.
+	 */
+	std::shared_ptr<ICluster> QueryPath(int v, int w) const;
 
 	// Return roots of the top trees
 	// std::vector<std::shared_ptr<Cluster> > GetTopTrees();
@@ -33,6 +66,13 @@ public:
 private:
 	class Internal;
 	std::unique_ptr<Internal> internal;
+
+	// Tests check internal invariants through it (defined only by the tests)
+	friend struct TopologyTopTreeTest;
+
+	// Number of subvertice edges on the longest path between two subvertices of given vertex (0 if it is not splitted),
+	// trees of subvertices must stay balanced
+	int SubvertexTreeDiameter(int v) const;
 };
 
 }
@@ -3,23 +3,72 @@
 #ifndef USER_FUNCTIONS_HPP
 #define USER_FUNCTIONS_HPP
 
-#include "TopTreeInterface.hpp"
+#include "BaseTree.hpp"
 
 namespace TopTree {
 
+class ICluster;
+struct ClusterData;
+
 // USER DEFINED FUNCTIONS:
 
-// Joining and splitting of compress/rake clusters:
-extern void Join(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent);
-extern void Split(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent);
+/**
+ * Interface through which the top trees call user defined functions. Every top tree gets one instance in its constructor
+ * and all its clusters keep a raw pointer to it, so more top trees with different user functions could live in one binary.
+ *
+ * Do not implement it by hand, use PolicyFunctions<Policy> below.
+ */
+class IUserFunctions {
+public:
+	virtual ~IUserFunctions() {}
+
+	// Joining and splitting of compress/rake clusters:
+	virtual void Join(ICluster& leftChild, ICluster& rightChild, ICluster& parent) = 0;
+	virtual void Split(ICluster& leftChild, ICluster& rightChild, ICluster& parent) = 0;
+
+	// Creating and destroying Base clusters:
+	virtual void Create(ICluster& cluster, const std::shared_ptr<EdgeData>& edge) = 0;
+	virtual void Destroy(ICluster& cluster, const std::shared_ptr<EdgeData>& edge) = 0;
+
+	virtual void CopyClusterData(ICluster& from, ICluster& to) = 0;
+
+	virtual std::shared_ptr<ClusterData> InitClusterData() = 0;
+	// Returns data created by InitClusterData to its initial state (used for recycled clusters, must not allocate)
+	virtual void ResetClusterData(ClusterData& data) = 0;
+};
+
+/**
+ * Adapter from user policy to the IUserFunctions. Policy is a class with type ClusterData (derived from TopTree::ClusterData)
+ * and methods Join, Split, Create, Destroy and CopyClusterData with the same parameters as in the IUserFunctions.
+ * ClusterData must be default constructible and move assignable, it is reset by assigning Policy::ClusterData().
+ *
+ * Methods may be static (stateless policy) or members of the policy instance stored here, so each top tree may get its
+ * own policy object with its own state (e.g. pointer to the structure using the top tree) and no global state is needed.
+ *
+ * The policy could access its cluster data by ICluster::getData<Policy::ClusterData>() without RTTI.
+ *
+ * Dispatch is dynamic: the top trees and their clusters are not templated by the policy, so every Join, Split, Create,
+ * Destroy and CopyClusterData is one virtual call through IUserFunctions.
+ */
+template<class Policy>
+class PolicyFunctions final : public IUserFunctions {
+public:
+	PolicyFunctions(Policy policy = Policy()): policy{policy} {}
+
+	void Join(ICluster& leftChild, ICluster& rightChild, ICluster& parent) { policy.Join(leftChild, rightChild, parent); }
+	void Split(ICluster& leftChild, ICluster& rightChild, ICluster& parent) { policy.Split(leftChild, rightChild, parent); }
+
+	void Create(ICluster& cluster, const std::shared_ptr<EdgeData>& edge) { policy.Create(cluster, edge); }
+	void Destroy(ICluster& cluster, const std::shared_ptr<EdgeData>& edge) { policy.Destroy(cluster, edge); }
+
+	void CopyClusterData(ICluster& from, ICluster& to) { policy.CopyClusterData(from, to); }
 
-// Creating and destroying Base clusters:
-extern void Create(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge);
-extern void Destroy(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge);
+	std::shared_ptr<ClusterData> InitClusterData() { return std::make_shared<typename Policy::ClusterData>(); }
+	void ResetClusterData(ClusterData& data) { static_cast<typename Policy::ClusterData&>(data) = typename Policy::ClusterData(); }
 
-extern void CopyClusterData(std::shared_ptr<ICluster> from, std::shared_ptr<ICluster> to);
+	Policy policy;
+};
 
-extern std::shared_ptr<ClusterData> InitClusterData();
 // END OF USER DEFINED FUNCTIONS
 }
 
@@ -2,6 +2,7 @@
 #include <string>
 #include <algorithm>
 #include <sstream>
+#include <functional>
 
 #include "TopTreeInterface.hpp"
 
@@ -276,21 +277,10 @@ struct MyClusterData: public TopTree::ClusterData {
 ////////////////////////////////////////////////////////////////////////////////
 
 class DoubleConnectivity {
-friend void TopTree::Join(std::shared_ptr<TopTree::ICluster> leftChild, std::shared_ptr<TopTree::ICluster> rightChild, std::shared_ptr<TopTree::ICluster> parent);
-friend void TopTree::Split(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent);
-friend void TopTree::Create(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge);
-friend void TopTree::Destroy(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge);
-friend void TopTree::CopyClusterData(std::shared_ptr<ICluster> from, std::shared_ptr<ICluster> to);
+friend struct DoubleConnectivityPolicy;
 public:
-	static DoubleConnectivity *dc;
-
-	DoubleConnectivity(std::shared_ptr<TopTree::ITopTree> top_tree, bool set_quick_expose = false) {
-		quick_expose = set_quick_expose;
-		TT = top_tree;
-		base_tree = std::make_shared<TopTree::BaseTree>();
-		TT->InitFromBaseTree(base_tree); // empty for now
-		dc = this;
-	}
+	// Top tree is created by the given function with user functions bound to this instance
+	DoubleConnectivity(std::function<std::shared_ptr<TopTree::ITopTree>(std::shared_ptr<TopTree::IUserFunctions>)> make_top_tree, bool set_quick_expose = false);
 
 	// Decide if v and w are c-2-edge connected on level 0
 	bool Double_edge_connected(int v, int w) {
@@ -305,7 +295,7 @@ public:
 		auto cluster = TT->Expose(vv, ww);
 		bool result = false;
 		if (cluster != NULL) {
-			auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
+			auto data = cluster->getData<MyClusterData>();
 			#ifdef DEBUG
 				std::cerr << "data cover is " << data->cover << std::endl;
 			#endif
@@ -369,7 +359,7 @@ public:
 			//unregister_at_vertices(edge);
 			return;
 		}
-		auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
+		auto data = cluster->getData<MyClusterData>();
 
 		// 2. Delete edge
 		if (data->edge != NULL) {
@@ -389,9 +379,9 @@ public:
 				unregister_at_vertices(edge);
 				return;
 			}
-			data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
+			data = cluster->getData<MyClusterData>();
 		}
-		internal_uncover(cluster, edge->level);
+		internal_uncover(cluster.get(), edge->level);
 
 		// If was nontree edge
 		if (data->edge == NULL) unregister_at_vertices(edge);
@@ -499,14 +489,14 @@ private:
 			#endif
 		}
 
-		internal_cover(cluster, i, edge);
+		internal_cover(cluster.get(), i, edge);
 	}
 
 	// For all e in v...w: if c(e)<=i, set c(e)=-1 (lazy propagate down)
 	/*void uncover(int vv, int ww, int i) {
 		auto cluster = TT->Expose(vv, ww);
 
-		internal_uncover(cluster, i);
+		internal_uncover(cluster.get(), i);
 	}*/
 
 	void register_at_vertices(std::shared_ptr<MyEdgeData> edge) {
@@ -544,7 +534,7 @@ private:
 	}
 
 	// INTERNAL:
-	void internal_cover(std::shared_ptr<TopTree::ICluster> cluster, int i, std::shared_ptr<MyEdgeData> edge) {
+	void internal_cover(TopTree::ICluster* cluster, int i, std::shared_ptr<MyEdgeData> edge) {
 		if (cluster == NULL) {
 			#ifdef DISPLAY_ERRORS
 				std::cerr << "ERROR: No cluster for internal cover" << std::endl;
@@ -552,7 +542,7 @@ private:
 			return;
 		}
 
-		auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
+		auto data = cluster->getData<MyClusterData>();
 		#ifdef DEBUG
 			std::cerr << "* Internal cover " << i << " for edge ";
 			if (edge != NULL) std::cerr << *edge;
@@ -592,7 +582,7 @@ private:
 		#endif
 	} // COMPLETE
 
-	void internal_uncover(std::shared_ptr<TopTree::ICluster> cluster, int i) {
+	void internal_uncover(TopTree::ICluster* cluster, int i) {
 		if (cluster == NULL) {
 			#ifdef DISPLAY_ERRORS
 				std::cerr << "ERROR: No cluster for internal uncover" << std::endl;
@@ -600,7 +590,7 @@ private:
 			return;
 		}
 
-		auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
+		auto data = cluster->getData<MyClusterData>();
 		#ifdef DEBUG
 			std::cerr << "* Internal uncover " << i << " at cluster " << cluster->getLeftBoundary() << "-" << cluster->getRightBoundary() << " with cover " << data->cover  << std::endl;
 		#endif
@@ -637,12 +627,12 @@ private:
 	} // COMPLETE
 
 
-	void clean(std::shared_ptr<TopTree::ICluster> leftChild, std::shared_ptr<TopTree::ICluster> rightChild, std::shared_ptr<TopTree::ICluster> parent) {
+	void clean(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
 		// Part of the Split is an Clean method
-		auto data = std::dynamic_pointer_cast<MyClusterData>(parent->data);
+		auto data = parent.getData<MyClusterData>();
 
 		#ifdef DEBUG_VERBOSE
-			std::cerr << "Clean of cluster " << parent->getLeftBoundary() << "-" << parent->getRightBoundary() << " joined in step " << data->join_step;
+			std::cerr << "Clean of cluster " << parent.getLeftBoundary() << "-" << parent.getRightBoundary() << " joined in step " << data->join_step;
 		#endif
 
 		// For each path child A of C call Uncover(A, cover_limit) and Cover(A, cover_set, cover_edge_set)
@@ -651,23 +641,23 @@ private:
 				std::cerr << " - left rake" << std::endl;
 			#endif
 			// Only the right is a path child
-			internal_uncover(rightChild, data->cover_limit);
-			internal_cover(rightChild, data->cover_set, data->cover_edge_set);
+			internal_uncover(&rightChild, data->cover_limit);
+			internal_cover(&rightChild, data->cover_set, data->cover_edge_set);
 		} else if (isRightRake(leftChild, rightChild, parent)) {
 			#ifdef DEBUG_VERBOSE
 				std::cerr << " - right rake" << std::endl;
 			#endif
 			// Only the left is a path child
-			internal_uncover(leftChild, data->cover_limit);
-			internal_cover(leftChild, data->cover_set, data->cover_edge_set);
+			internal_uncover(&leftChild, data->cover_limit);
+			internal_cover(&leftChild, data->cover_set, data->cover_edge_set);
 		} else {
 			#ifdef DEBUG_VERBOSE
 				std::cerr << " - compress" << std::endl;
 			#endif
-			internal_uncover(leftChild, data->cover_limit);
-			internal_cover(leftChild, data->cover_set, data->cover_edge_set);
-			internal_uncover(rightChild, data->cover_limit);
-			internal_cover(rightChild, data->cover_set, data->cover_edge_set);
+			internal_uncover(&leftChild, data->cover_limit);
+			internal_cover(&leftChild, data->cover_set, data->cover_edge_set);
+			internal_uncover(&rightChild, data->cover_limit);
+			internal_cover(&rightChild, data->cover_set, data->cover_edge_set);
 		}
 
 		data->cover_set = -1;
@@ -686,7 +676,7 @@ private:
 			#endif
 			return;
 		}
-		auto dataC = std::dynamic_pointer_cast<MyClusterData>(clusterC->data);
+		auto dataC = clusterC->getData<MyClusterData>();
 
 		std::shared_ptr<MyEdgeData> last_edge = NULL;
 
@@ -709,22 +699,22 @@ private:
 					#endif
 					return;
 				}
-				auto dataD = std::dynamic_pointer_cast<MyClusterData>(clusterD->data);
+				auto dataD = clusterD->getData<MyClusterData>();
 				if ((dataD->get_size(edge->from, -1, i+1) + 2) > N/(1<<(i+1))) {
-					internal_cover(clusterD, i, edge);
+					internal_cover(clusterD.get(), i, edge);
 					break;
 				} else {
 					unregister_at_vertices(edge);
 					edge->level = i+1;
 					register_at_vertices(edge);
-					internal_cover(clusterD, i+1, edge);
+					internal_cover(clusterD.get(), i+1, edge);
 				}
 				clusterC = TT->Expose(vv, ww);
 				if (clusterC == NULL) {
 					std::cerr << "Recover " << i << " of path " << vv << "-" << ww << " - clusterC is NULL" << std::endl;
 					return;
 				}
-				dataC = std::dynamic_pointer_cast<MyClusterData>(clusterC->data);
+				dataC = clusterC->getData<MyClusterData>();
 			}
 			if (u == uu) break;
 			else u = uu; //end of the u=w run
@@ -745,7 +735,7 @@ private:
 				#endif
 			}
 
-			clean(childs.first, childs.second, cluster);
+			clean(*childs.first, *childs.second, *cluster);
 			int common = childs.first->getLeftBoundary();
 			if (common != childs.second->getLeftBoundary() && common != childs.second->getRightBoundary()) common = childs.first->getRightBoundary();
 
@@ -759,8 +749,8 @@ private:
 				std::swap(A, B);
 			}
 
-			auto data_a = std::dynamic_pointer_cast<MyClusterData>(A->data);
-			//auto data_b = std::dynamic_pointer_cast<MyClusterData>(B->data);
+			auto data_a = A->getData<MyClusterData>();
+			//auto data_b = B->getData<MyClusterData>();
 
 			// If A is a nonpath child and ... or A is a path cluster and ...
 			if (isLeftRake(A, B, cluster) && data_a->get_nonpath_incident(a, i) > 0) return find(a, A, i); // A is nonpath child
@@ -783,7 +773,7 @@ private:
 			#endif
 			return;
 		}
-		auto data = std::dynamic_pointer_cast<MyClusterData>(edgeCluster->data);
+		auto data = edgeCluster->getData<MyClusterData>();
 
 		if (data->edge == NULL) {
 			std::cerr << "Edge cluster " << vv << "-" << ww << " does not have underlying edge" << std::endl;
@@ -835,287 +825,291 @@ private:
 	}
 
 };
-DoubleConnectivity* DoubleConnectivity::dc = NULL;
-
 
 ////////////////////////////////////////////////////////////////////////////////
 
-// Merge
-void TopTree::Join(std::shared_ptr<TopTree::ICluster> leftChild, std::shared_ptr<TopTree::ICluster> rightChild, std::shared_ptr<TopTree::ICluster> parent) {
-	auto data = std::dynamic_pointer_cast<MyClusterData>(parent->data);
-	auto left_data = std::dynamic_pointer_cast<MyClusterData>(leftChild->data);
-	auto right_data = std::dynamic_pointer_cast<MyClusterData>(rightChild->data);
+struct DoubleConnectivityPolicy {
+	typedef MyClusterData ClusterData;
 
-	auto dc = DoubleConnectivity::dc;
+	DoubleConnectivityPolicy(DoubleConnectivity* dc = NULL): dc{dc} {}
+	DoubleConnectivity* dc; // structure whose top tree calls this policy
 
-	#ifdef DEBUG
-		std::cerr << "JOIN " << dc->join_counter <<  " of cluster " << leftChild->getLeftBoundary()  << "-" << leftChild->getRightBoundary() << "(" << left_data->cover << ")"
-		<< " and " << rightChild->getLeftBoundary()  << "-" << rightChild->getRightBoundary() << "(" << right_data->cover << ")"
-		<< " into " << parent->getLeftBoundary()  << "-" << parent->getRightBoundary() << std::endl;
-	#endif
+	// Merge
+	void Join(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
+		auto data = parent.getData<MyClusterData>();
+		auto left_data = leftChild.getData<MyClusterData>();
+		auto right_data = rightChild.getData<MyClusterData>();
 
-	// HOTFIX FIXUP
-	/*
-	if ((leftChild->getLeftBoundary() != left_data->endpoint_a && leftChild->getLeftBoundary() != left_data->endpoint_b)
-		|| (leftChild->getRightBoundary() != left_data->endpoint_a && leftChild->getRightBoundary() != left_data->endpoint_b)) {
-			left_data->endpoint_a = leftChild->getLeftBoundary();
-			left_data->endpoint_b = leftChild->getRightBoundary();
-		}
+		#ifdef DEBUG
+			std::cerr << "JOIN " << dc->join_counter <<  " of cluster " << leftChild.getLeftBoundary()  << "-" << leftChild.getRightBoundary() << "(" << left_data->cover << ")"
+			<< " and " << rightChild.getLeftBoundary()  << "-" << rightChild.getRightBoundary() << "(" << right_data->cover << ")"
+			<< " into " << parent.getLeftBoundary()  << "-" << parent.getRightBoundary() << std::endl;
+		#endif
 
-	// HOTFIX FIXUP
-	if ((rightChild->getLeftBoundary() != right_data->endpoint_a && rightChild->getLeftBoundary() != right_data->endpoint_b)
-		|| (rightChild->getRightBoundary() != right_data->endpoint_a && rightChild->getRightBoundary() != right_data->endpoint_b)) {
-			right_data->endpoint_a = rightChild->getLeftBoundary();
-			right_data->endpoint_b = rightChild->getRightBoundary();
-		}
-	*/
+		// HOTFIX FIXUP
+		/*
+		if ((leftChild.getLeftBoundary() != left_data->endpoint_a && leftChild.getLeftBoundary() != left_data->endpoint_b)
+			|| (leftChild.getRightBoundary() != left_data->endpoint_a && leftChild.getRightBoundary() != left_data->endpoint_b)) {
+				left_data->endpoint_a = leftChild.getLeftBoundary();
+				left_data->endpoint_b = leftChild.getRightBoundary();
+			}
 
-	/*
-	std::cerr << "PARENT JOIN: " << parent->getLeftBoundary() << "-" << parent->getRightBoundary() << std::endl;
-
-	std::cerr << "Left: " << leftChild->getLeftBoundary() << "-" << leftChild->getRightBoundary() << std::endl;
-	std::cerr << "Left: " << left_data->endpoint_a << "-" << left_data->endpoint_b << std::endl;
-
-	std::cerr << "Right: " << rightChild->getLeftBoundary() << "-" << rightChild->getRightBoundary() << std::endl;
-	std::cerr << "Right: " << right_data->endpoint_a << "-" << right_data->endpoint_b << std::endl;
-	*/
-
-	/////////////////////////////////////////////////////////
-	// Init endpoints in the new cluster - O(1) computations:
-	data->endpoint_a = parent->getLeftBoundary();
-	data->endpoint_b = parent->getRightBoundary();
-
-	data->join_step = dc->join_counter++;
-
-	// Find path child minimizing cover
-	if (isLeftRake(leftChild, rightChild, parent)) {
-		data->cover = right_data->cover;
-		data->cover_edge = right_data->cover_edge;
-		data->edge = right_data->edge; // copy the underlying edge if only from one child
-	} else if (isRightRake(leftChild, rightChild, parent)) {
-		data->cover = left_data->cover;
-		data->cover_edge = left_data->cover_edge;
-		data->edge = left_data->edge; // copy the underlying edge if only from one child
-	} else {
-		if (left_data->cover < right_data->cover) {
+		// HOTFIX FIXUP
+		if ((rightChild.getLeftBoundary() != right_data->endpoint_a && rightChild.getLeftBoundary() != right_data->endpoint_b)
+			|| (rightChild.getRightBoundary() != right_data->endpoint_a && rightChild.getRightBoundary() != right_data->endpoint_b)) {
+				right_data->endpoint_a = rightChild.getLeftBoundary();
+				right_data->endpoint_b = rightChild.getRightBoundary();
+			}
+		*/
+
+		/*
+		std::cerr << "PARENT JOIN: " << parent.getLeftBoundary() << "-" << parent.getRightBoundary() << std::endl;
+
+		std::cerr << "Left: " << leftChild.getLeftBoundary() << "-" << leftChild.getRightBoundary() << std::endl;
+		std::cerr << "Left: " << left_data->endpoint_a << "-" << left_data->endpoint_b << std::endl;
+
+		std::cerr << "Right: " << rightChild.getLeftBoundary() << "-" << rightChild.getRightBoundary() << std::endl;
+		std::cerr << "Right: " << right_data->endpoint_a << "-" << right_data->endpoint_b << std::endl;
+		*/
+
+		/////////////////////////////////////////////////////////
+		// Init endpoints in the new cluster - O(1) computations:
+		data->endpoint_a = parent.getLeftBoundary();
+		data->endpoint_b = parent.getRightBoundary();
+
+		data->join_step = dc->join_counter++;
+
+		// Find path child minimizing cover
+		if (isLeftRake(leftChild, rightChild, parent)) {
+			data->cover = right_data->cover;
+			data->cover_edge = right_data->cover_edge;
+			data->edge = right_data->edge; // copy the underlying edge if only from one child
+		} else if (isRightRake(leftChild, rightChild, parent)) {
 			data->cover = left_data->cover;
 			data->cover_edge = left_data->cover_edge;
+			data->edge = left_data->edge; // copy the underlying edge if only from one child
 		} else {
-			data->cover = right_data->cover;
-			data->cover_edge = right_data->cover_edge;
+			if (left_data->cover < right_data->cover) {
+				data->cover = left_data->cover;
+				data->cover_edge = left_data->cover_edge;
+			} else {
+				data->cover = right_data->cover;
+				data->cover_edge = right_data->cover_edge;
+			}
 		}
-	}
-	data->cover_set = -1;
-	data->cover_limit = -1;
-	data->cover_edge_set = NULL;
+		data->cover_set = -1;
+		data->cover_limit = -1;
+		data->cover_edge_set = NULL;
 
-	///////////////////////////////////////////////////
-	// Time consuming computations in O(log^2 N) below:
+		///////////////////////////////////////////////////
+		// Time consuming computations in O(log^2 N) below:
 
-	if (dc->quick_expose && dc->quick_expose_running) return; // skip slow computations below
+		if (dc->quick_expose && dc->quick_expose_running) return; // skip slow computations below
 
-	int common = leftChild->getLeftBoundary();
-	if (common != rightChild->getLeftBoundary() && common != rightChild->getRightBoundary()) common = leftChild->getRightBoundary();
+		int common = leftChild.getLeftBoundary();
+		if (common != rightChild.getLeftBoundary() && common != rightChild.getRightBoundary()) common = leftChild.getRightBoundary();
 
-	int other_left = (leftChild->getLeftBoundary() == common ? leftChild->getRightBoundary() : leftChild->getLeftBoundary());
-	int other_right = (rightChild->getLeftBoundary() == common ? rightChild->getRightBoundary() : rightChild->getLeftBoundary());
+		int other_left = (leftChild.getLeftBoundary() == common ? leftChild.getRightBoundary() : leftChild.getLeftBoundary());
+		int other_right = (rightChild.getLeftBoundary() == common ? rightChild.getRightBoundary() : rightChild.getLeftBoundary());
 
-	// A) Computation of nonpath_size[a][j] for a in {a,b} and j in 0...max_l
-	if (isCompress(leftChild, rightChild, parent)) {
+		// A) Computation of nonpath_size[a][j] for a in {a,b} and j in 0...max_l
+		if (isCompress(leftChild, rightChild, parent)) {
 
-		// Because we don't know which one of endpoint will be used compute for both a and c - figure 1(3)
-		// For other vertex from leftChild
-		int other = other_left;
-		for (int j = 0; j <= dc->max_l; j++) {
-			int size = left_data->get_size(other, j, j);
-			int incident = left_data->get_size(other, j, j);
-			if (left_data->cover >= j) {
-				size += dc->get_size(common, j) + right_data->get_nonpath_size(common, j);
-				incident += dc->get_incident(common, j) + right_data->get_nonpath_incident(common, j);
+			// Because we don't know which one of endpoint will be used compute for both a and c - figure 1(3)
+			// For other vertex from leftChild
+			int other = other_left;
+			for (int j = 0; j <= dc->max_l; j++) {
+				int size = left_data->get_size(other, j, j);
+				int incident = left_data->get_size(other, j, j);
+				if (left_data->cover >= j) {
+					size += dc->get_size(common, j) + right_data->get_nonpath_size(common, j);
+					incident += dc->get_incident(common, j) + right_data->get_nonpath_incident(common, j);
+				}
+				data->set_nonpath_size(other, j, size);
+				data->set_nonpath_incident(other, j, incident);
 			}
-			data->set_nonpath_size(other, j, size);
-			data->set_nonpath_incident(other, j, incident);
-		}
 
-		// For oher vertex from rightChild
-		other = other_right;
-		for (int j = 0; j <= dc->max_l; j++) {
-			int size = right_data->get_size(other, j, j);
-			int incident = right_data->get_size(other, j, j);
-			if (left_data->cover >= j) {
-				size += dc->get_size(common, j) + right_data->get_nonpath_size(common, j);
-				incident += dc->get_incident(common, j) + right_data->get_nonpath_incident(common, j);
+			// For oher vertex from rightChild
+			other = other_right;
+			for (int j = 0; j <= dc->max_l; j++) {
+				int size = right_data->get_size(other, j, j);
+				int incident = right_data->get_size(other, j, j);
+				if (left_data->cover >= j) {
+					size += dc->get_size(common, j) + right_data->get_nonpath_size(common, j);
+					incident += dc->get_incident(common, j) + right_data->get_nonpath_incident(common, j);
+				}
+				data->set_nonpath_size(other, j, size);
+				data->set_nonpath_incident(other, j, incident);
 			}
-			data->set_nonpath_size(other, j, size);
-			data->set_nonpath_incident(other, j, incident);
-		}
-	} else {
-		// Some rake, not interesting which - figure 1(4)
-		for (int j = 0; j <= dc->max_l; j++) {
-			data->set_nonpath_size(common, j,
-				left_data->get_nonpath_size(common, j) + right_data->get_nonpath_size(common, j)
-			);
-			data->set_nonpath_incident(common, j,
-				left_data->get_nonpath_incident(common, j) + right_data->get_nonpath_incident(common, j)
-			);
-		}
-	}
-
-	// B) Computation of path size[a][i][j] for i,j in -1...max_l
-	if (isLeftRake(leftChild, rightChild, parent)) {
-		// left {common} is raked on the right one {common,other_right} - set for common and other_right
-		for (int i = -1; i <= dc->max_l; i++) {
-			for (int j = -1; j <= dc->max_l; j++) {
-				data->set_size(common, i, j,
-					left_data->get_nonpath_size(common, j) + right_data->get_size(common, i, j)
+		} else {
+			// Some rake, not interesting which - figure 1(4)
+			for (int j = 0; j <= dc->max_l; j++) {
+				data->set_nonpath_size(common, j,
+					left_data->get_nonpath_size(common, j) + right_data->get_nonpath_size(common, j)
 				);
-				data->set_incident(common, i, j,
-					left_data->get_nonpath_incident(common, j) + right_data->get_incident(common, i, j)
+				data->set_nonpath_incident(common, j,
+					left_data->get_nonpath_incident(common, j) + right_data->get_nonpath_incident(common, j)
 				);
-
-				int size = right_data->get_size(other_right, i, j);
-				int incident = right_data->get_incident(other_right, i, j);
-				if (right_data->cover >= i) {
-					size += left_data->get_nonpath_size(other_left, j);
-					incident += left_data->get_nonpath_incident(other_left, j);
-				}
-				data->set_size(other_right, i, j, size);
-				data->set_incident(other_right, i, j, incident);
 			}
 		}
-	} else if (isRightRake(leftChild, rightChild, parent)) {
-		// right {common} is raked on the left one {common,other_left} - set for common and other_left
-		for (int i = -1; i <= dc->max_l; i++) {
-			for (int j = -1; j <= dc->max_l; j++) {
-				data->set_size(common, i, j,
-					right_data->get_nonpath_size(common, j) + left_data->get_size(common, i, j)
-				);
-				data->set_incident(common, i, j,
-					right_data->get_nonpath_incident(common, j) + left_data->get_incident(common, i, j)
-				);
 
-				int size = left_data->get_size(other_left, i, j);
-				int incident = left_data->get_incident(other_left, i, j);
-				if (left_data->cover >= i) {
-					size += right_data->get_nonpath_size(other_right, j);
-					incident += right_data->get_nonpath_incident(other_right, j);
+		// B) Computation of path size[a][i][j] for i,j in -1...max_l
+		if (isLeftRake(leftChild, rightChild, parent)) {
+			// left {common} is raked on the right one {common,other_right} - set for common and other_right
+			for (int i = -1; i <= dc->max_l; i++) {
+				for (int j = -1; j <= dc->max_l; j++) {
+					data->set_size(common, i, j,
+						left_data->get_nonpath_size(common, j) + right_data->get_size(common, i, j)
+					);
+					data->set_incident(common, i, j,
+						left_data->get_nonpath_incident(common, j) + right_data->get_incident(common, i, j)
+					);
+
+					int size = right_data->get_size(other_right, i, j);
+					int incident = right_data->get_incident(other_right, i, j);
+					if (right_data->cover >= i) {
+						size += left_data->get_nonpath_size(other_left, j);
+						incident += left_data->get_nonpath_incident(other_left, j);
+					}
+					data->set_size(other_right, i, j, size);
+					data->set_incident(other_right, i, j, incident);
 				}
-				data->set_size(other_left, i, j, size);
-				data->set_incident(other_left, i, j, incident);
 			}
-		}
-	} else { // Compress
-		for (int i = -1; i <= dc->max_l; i++) {
-			for (int j = -1; j <= dc->max_l; j++) {
-				// for other_left
-				int size = left_data->get_size(other_left, i, j);
-				int incident = left_data->get_incident(other_left, i, j);
-				if (left_data->cover >= i) {
-					size += dc->get_size(common, j) + right_data->get_size(common, i, j);
-					incident += dc->get_incident(common, j) + right_data->get_incident(common, i, j);
+		} else if (isRightRake(leftChild, rightChild, parent)) {
+			// right {common} is raked on the left one {common,other_left} - set for common and other_left
+			for (int i = -1; i <= dc->max_l; i++) {
+				for (int j = -1; j <= dc->max_l; j++) {
+					data->set_size(common, i, j,
+						right_data->get_nonpath_size(common, j) + left_data->get_size(common, i, j)
+					);
+					data->set_incident(common, i, j,
+						right_data->get_nonpath_incident(common, j) + left_data->get_incident(common, i, j)
+					);
+
+					int size = left_data->get_size(other_left, i, j);
+					int incident = left_data->get_incident(other_left, i, j);
+					if (left_data->cover >= i) {
+						size += right_data->get_nonpath_size(other_right, j);
+						incident += right_data->get_nonpath_incident(other_right, j);
+					}
+					data->set_size(other_left, i, j, size);
+					data->set_incident(other_left, i, j, incident);
 				}
-				data->set_size(other_left, i, j, size);
-				data->set_incident(other_left, i, j, incident);
-
-				// for other_right
-				size = right_data->get_size(other_right, i, j);
-				incident = right_data->get_incident(other_right, i, j);
-				if (right_data->cover >= i) {
-					size += dc->get_size(common, j) + left_data->get_size(common, i, j);
-					incident += dc->get_incident(common, j) + left_data->get_incident(common, i, j);
+			}
+		} else { // Compress
+			for (int i = -1; i <= dc->max_l; i++) {
+				for (int j = -1; j <= dc->max_l; j++) {
+					// for other_left
+					int size = left_data->get_size(other_left, i, j);
+					int incident = left_data->get_incident(other_left, i, j);
+					if (left_data->cover >= i) {
+						size += dc->get_size(common, j) + right_data->get_size(common, i, j);
+						incident += dc->get_incident(common, j) + right_data->get_incident(common, i, j);
+					}
+					data->set_size(other_left, i, j, size);
+					data->set_incident(other_left, i, j, incident);
+
+					// for other_right
+					size = right_data->get_size(other_right, i, j);
+					incident = right_data->get_incident(other_right, i, j);
+					if (right_data->cover >= i) {
+						size += dc->get_size(common, j) + left_data->get_size(common, i, j);
+						incident += dc->get_incident(common, j) + left_data->get_incident(common, i, j);
+					}
+					data->set_size(other_right, i, j, size);
+					data->set_incident(other_right, i, j, incident);
 				}
-				data->set_size(other_right, i, j, size);
-				data->set_incident(other_right, i, j, incident);
 			}
 		}
-	}
 
-	#ifdef DEBUG
-		std::cerr << "JOIN result: cover " << data->cover << std::endl;
-	#endif
-} // COMPLETE
-void TopTree::Split(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent) {
-	DoubleConnectivity::dc->clean(leftChild, rightChild, parent);
-	// delete C - not needed, it will be deleted by TopTrees structure
-} // COMPLETE
-
-// Creating and destroying Base clusters:
-void TopTree::Create(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge) {
-	auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
-	auto edge_data = std::dynamic_pointer_cast<MyEdgeData>(edge);
-
-	#ifdef DEBUG
-		std::cerr << "Creating cluster for edge " << edge_data->from << "-" << edge_data->to << " with cover " << edge_data->cover << std::endl;
-	#endif
-
-	data->endpoint_a = cluster->getLeftBoundary();
-	data->endpoint_b = cluster->getRightBoundary();
-
-	data->edge = edge_data;
-
-	data->cover = edge_data->cover;
-
-	// Backup (or defaults) from underlying edge
-	data->cover = edge_data->cover;
-	data->cover_edge = edge_data->cover_edge;
-} // COMPLETE
-void TopTree::Destroy(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge) {
-	auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
-	auto edge_data = std::dynamic_pointer_cast<MyEdgeData>(edge);
-
-	#ifdef DEBUG
-		std::cerr << "Destroying cluster for edge " << edge_data->from << "-" << edge_data->to << " with cover " << data->cover << std::endl;
-	#endif
-
-	// Backup into cluster
-	edge_data->cover = data->cover;
-	edge_data->cover_edge = data->cover_edge;
-} // COMPLETE
-
-std::shared_ptr<TopTree::ClusterData> TopTree::InitClusterData() {
-	return std::make_shared<MyClusterData>();
-}
+		#ifdef DEBUG
+			std::cerr << "JOIN result: cover " << data->cover << std::endl;
+		#endif
+	} // COMPLETE
+	void Split(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
+		dc->clean(leftChild, rightChild, parent);
+		// delete C - not needed, it will be deleted by TopTrees structure
+	} // COMPLETE
 
-void TopTree::CopyClusterData(std::shared_ptr<ICluster> from, std::shared_ptr<ICluster> to) {
-	#ifdef DEBUG
-		//std::cerr << "COPY from cluster " << from->getLeftBoundary()  << "-" << from->getRightBoundary()
-		//<< " to " << to->getLeftBoundary()  << "-" << to->getRightBoundary() << std::endl;
-		std::cerr << "COPY from cluster " << from << " to " << to << std::endl;
-	#endif
+	// Creating and destroying Base clusters:
+	void Create(TopTree::ICluster& cluster, const std::shared_ptr<TopTree::EdgeData>& edge) {
+		auto data = cluster.getData<MyClusterData>();
+		auto edge_data = std::static_pointer_cast<MyEdgeData>(edge);
 
-	auto fromData = std::dynamic_pointer_cast<MyClusterData>(from->data);
-	auto toData = std::dynamic_pointer_cast<MyClusterData>(to->data);
+		#ifdef DEBUG
+			std::cerr << "Creating cluster for edge " << edge_data->from << "-" << edge_data->to << " with cover " << edge_data->cover << std::endl;
+		#endif
 
-	toData->join_step = fromData->join_step;
+		data->endpoint_a = cluster.getLeftBoundary();
+		data->endpoint_b = cluster.getRightBoundary();
 
-	toData->cover = fromData->cover;
-	toData->cover_limit = fromData->cover_limit;
-	toData->cover_set = fromData->cover_set;
+		data->edge = edge_data;
 
-	toData->edge = fromData->edge;
-	toData->cover_edge = fromData->cover_edge;
-	toData->cover_edge_set = fromData->cover_edge_set;
+		data->cover = edge_data->cover;
 
-	toData->endpoint_a = fromData->endpoint_a;
-	toData->endpoint_b = fromData->endpoint_b;
+		// Backup (or defaults) from underlying edge
+		data->cover = edge_data->cover;
+		data->cover_edge = edge_data->cover_edge;
+	} // COMPLETE
+	void Destroy(TopTree::ICluster& cluster, const std::shared_ptr<TopTree::EdgeData>& edge) {
+		auto data = cluster.getData<MyClusterData>();
+		auto edge_data = std::static_pointer_cast<MyEdgeData>(edge);
+
+		#ifdef DEBUG
+			std::cerr << "Destroying cluster for edge " << edge_data->from << "-" << edge_data->to << " with cover " << data->cover << std::endl;
+		#endif
+
+		// Backup into cluster
+		edge_data->cover = data->cover;
+		edge_data->cover_edge = data->cover_edge;
+	} // COMPLETE
+
+	void CopyClusterData(TopTree::ICluster& from, TopTree::ICluster& to) {
+		#ifdef DEBUG
+			//std::cerr << "COPY from cluster " << from.getLeftBoundary()  << "-" << from.getRightBoundary()
+			//<< " to " << to.getLeftBoundary()  << "-" << to.getRightBoundary() << std::endl;
+			std::cerr << "COPY from cluster " << &from << " to " << &to << std::endl;
+		#endif
+
+		auto fromData = from.getData<MyClusterData>();
+		auto toData = to.getData<MyClusterData>();
+
+		toData->join_step = fromData->join_step;
+
+		toData->cover = fromData->cover;
+		toData->cover_limit = fromData->cover_limit;
+		toData->cover_set = fromData->cover_set;
 
-	auto dc = DoubleConnectivity::dc;
+		toData->edge = fromData->edge;
+		toData->cover_edge = fromData->cover_edge;
+		toData->cover_edge_set = fromData->cover_edge_set;
 
-	if (dc->quick_expose && dc->quick_expose_running) return; // skip slow computations below
+		toData->endpoint_a = fromData->endpoint_a;
+		toData->endpoint_b = fromData->endpoint_b;
 
-	auto a = toData->endpoint_a;
-	auto b = toData->endpoint_b;
+		if (dc->quick_expose && dc->quick_expose_running) return; // skip slow computations below
 
-	for (int i = 0; i <= dc->max_l; i++) {
-		for (int j = 0; j <= dc->max_l; j++) {
-			toData->set_size(a, i, j, fromData->get_size(a, i, j));
-			toData->set_size(b, i, j, fromData->get_size(b, i, j));
-			toData->set_incident(a, i, j, fromData->get_incident(a, i, j));
-			toData->set_incident(b, i, j, fromData->get_incident(b, i, j));
+		auto a = toData->endpoint_a;
+		auto b = toData->endpoint_b;
+
+		for (int i = 0; i <= dc->max_l; i++) {
+			for (int j = 0; j <= dc->max_l; j++) {
+				toData->set_size(a, i, j, fromData->get_size(a, i, j));
+				toData->set_size(b, i, j, fromData->get_size(b, i, j));
+				toData->set_incident(a, i, j, fromData->get_incident(a, i, j));
+				toData->set_incident(b, i, j, fromData->get_incident(b, i, j));
+			}
+			toData->set_nonpath_size(a, i, fromData->get_nonpath_size(a, i));
+			toData->set_nonpath_size(b, i, fromData->get_nonpath_size(b, i));
+			toData->set_nonpath_incident(a, i, fromData->get_nonpath_incident(a, i));
+			toData->set_nonpath_incident(b, i, fromData->get_nonpath_incident(b, i));
 		}
-		toData->set_nonpath_size(a, i, fromData->get_nonpath_size(a, i));
-		toData->set_nonpath_size(b, i, fromData->get_nonpath_size(b, i));
-		toData->set_nonpath_incident(a, i, fromData->get_nonpath_incident(a, i));
-		toData->set_nonpath_incident(b, i, fromData->get_nonpath_incident(b, i));
 	}
+};
+
+inline DoubleConnectivity::DoubleConnectivity(std::function<std::shared_ptr<TopTree::ITopTree>(std::shared_ptr<TopTree::IUserFunctions>)> make_top_tree, bool set_quick_expose) {
+	quick_expose = set_quick_expose;
+	TT = make_top_tree(std::make_shared<TopTree::PolicyFunctions<DoubleConnectivityPolicy>>(DoubleConnectivityPolicy(this)));
+	base_tree = std::make_shared<TopTree::BaseTree>();
+	TT->InitFromBaseTree(base_tree); // empty for now
 }
@@ -1,6 +1,8 @@
 #include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <unordered_map>
 
 #include "TopTreeInterface.hpp"
 
@@ -33,6 +35,129 @@ struct MyClusterData: public TopTree::ClusterData {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct MaximumEdgeWeightPolicy {
+	typedef MyClusterData ClusterData;
+
+	static void Join(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
+		auto left_data = leftChild.getData<MyClusterData>();
+		auto right_data = rightChild.getData<MyClusterData>();
+		auto parent_data = parent.getData<MyClusterData>();
+
+		if (isLeftRake(leftChild, rightChild, parent)) {
+			parent_data->w_max = right_data->w_max;
+			parent_data->w_max_edge = right_data->w_max_edge;
+		} else if (isRightRake(leftChild, rightChild, parent)) {
+			parent_data->w_max = left_data->w_max;
+			parent_data->w_max_edge = left_data->w_max_edge;
+		} else {
+			if (left_data->w_max > right_data->w_max) {
+				parent_data->w_max = left_data->w_max;
+				parent_data->w_max_edge = left_data->w_max_edge;
+			} else {
+				parent_data->w_max = right_data->w_max;
+				parent_data->w_max_edge = right_data->w_max_edge;
+			}
+		}
+		// There is no extra weight yet
+		parent_data->w_extra = 0;
+	}
+	static void Split(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
+		auto left_data = leftChild.getData<MyClusterData>();
+		auto right_data = rightChild.getData<MyClusterData>();
+		auto parent_data = parent.getData<MyClusterData>();
+
+		// Distribute w_extra to childs
+		if (isLeftRake(leftChild, rightChild, parent)) {
+			right_data->w_extra += parent_data->w_extra;
+			right_data->w_max += parent_data->w_extra;
+		} else if (isRightRake(leftChild, rightChild, parent)) {
+			left_data->w_extra += parent_data->w_extra;
+			left_data->w_max += parent_data->w_extra;
+		} else {
+			// Left
+			left_data->w_extra += parent_data->w_extra;
+			left_data->w_max += parent_data->w_extra;
+			// Right
+			right_data->w_extra += parent_data->w_extra;
+			right_data->w_max += parent_data->w_extra;
+		}
+	}
+
+	// Creating and destroying Base clusters:
+	static void Create(TopTree::ICluster& cluster, const std::shared_ptr<TopTree::EdgeData>& edge) {
+		auto data = cluster.getData<MyClusterData>();
+		auto edge_data = std::static_pointer_cast<MyEdgeData>(edge);
+		data->w_max = edge_data->weight;
+		data->w_max_edge = edge_data;
+		data->w_extra = 0;
+	}
+	static void Destroy(TopTree::ICluster& cluster, const std::shared_ptr<TopTree::EdgeData>& edge) {
+		auto data = cluster.getData<MyClusterData>();
+		auto edge_data = static_cast<MyEdgeData*>(edge.get());
+		edge_data->weight = data->w_max;
+	}
+
+	static void CopyClusterData(TopTree::ICluster& from, TopTree::ICluster& to) {
+		auto fromData = from.getData<MyClusterData>();
+		auto toData = to.getData<MyClusterData>();
+
+		toData->w_max = fromData->w_max;
+		toData->w_max_edge = fromData->w_max_edge;
+		toData->w_extra = fromData->w_extra;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Used for saving and loading of the whole top tree (edges in cluster data are stored as order of the edge in the file)
+class MaximumEdgeWeightSerializer: public TopTree::IDataSerializer {
+public:
+	void SaveVertexData(std::ostream& o, const std::shared_ptr<TopTree::VertexData>& data) {
+		TopTree::writeString(o, static_cast<MyVertexData*>(data.get())->label);
+	}
+	std::shared_ptr<TopTree::VertexData> LoadVertexData(std::istream& i) {
+		loaded_vertices.push_back(std::make_shared<MyVertexData>(TopTree::readString(i)));
+		return loaded_vertices.back();
+	}
+
+	void SaveEdgeData(std::ostream& o, const std::shared_ptr<TopTree::EdgeData>& data) {
+		auto edge_data = static_cast<MyEdgeData*>(data.get());
+		TopTree::writeValue<int>(o, edge_data->index);
+		TopTree::writeValue<int>(o, edge_data->weight);
+		TopTree::writeString(o, edge_data->label);
+		int id = edge_ids.size();
+		edge_ids[edge_data] = id;
+	}
+	std::shared_ptr<TopTree::EdgeData> LoadEdgeData(std::istream& i) {
+		int index = TopTree::readValue<int>(i);
+		int weight = TopTree::readValue<int>(i);
+		loaded_edges.push_back(std::make_shared<MyEdgeData>(index, weight, TopTree::readString(i)));
+		return loaded_edges.back();
+	}
+
+	void SaveClusterData(std::ostream& o, const TopTree::ICluster& cluster) {
+		auto data = cluster.getData<MyClusterData>();
+		TopTree::writeValue<int>(o, data->w_max);
+		TopTree::writeValue<int>(o, data->w_extra);
+		auto it = edge_ids.find(data->w_max_edge.get());
+		TopTree::writeValue<int>(o, (it == edge_ids.end() ? -1 : it->second));
+	}
+	void LoadClusterData(std::istream& i, TopTree::ICluster& cluster) {
+		auto data = cluster.getData<MyClusterData>();
+		data->w_max = TopTree::readValue<int>(i);
+		data->w_extra = TopTree::readValue<int>(i);
+		int edge = TopTree::readId(i, loaded_edges.size());
+		data->w_max_edge = (edge < 0 ? NULL : loaded_edges[edge]);
+	}
+
+	std::vector<std::shared_ptr<MyVertexData>> loaded_vertices;
+	std::vector<std::shared_ptr<MyEdgeData>> loaded_edges;
+private:
+	std::unordered_map<MyEdgeData*, int> edge_ids;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 class MaximumEdgeWeight {
 public:
 	MaximumEdgeWeight(TopTree::ITopTree *top_tree): top_tree{top_tree}, base_tree{std::make_shared<TopTree::BaseTree>()} {}
@@ -75,13 +200,29 @@ public:
 		initialized = true;
 	}
 
+	// Save initialized tree / load it instead of adding vertices, edges and initialization
+	void save(const std::string& path) {
+		MaximumEdgeWeightSerializer serializer;
+		top_tree->Save(path, serializer);
+	}
+	void load(const std::string& path) {
+		MaximumEdgeWeightSerializer serializer;
+		top_tree->Load(path, serializer);
+		for (auto v: serializer.loaded_vertices) vertices.push_back(vertex{v->label, (int) vertices.size()});
+		for (auto e: serializer.loaded_edges) {
+			if (e->index >= (int) edges.size()) edges.resize(e->index + 1, edge{-1, -1, 0});
+			edges[e->index].weight = e->weight;
+		}
+		initialized = true;
+	}
+
 	// Functions that could be used after initialization:
 
 	bool add_weight_on_path(int a, int b, int extra_weight) {
 		auto cluster = top_tree->Expose(vertices[a].index, vertices[b].index);
 		if (cluster == NULL) return false;
 
-		auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
+		auto data = cluster->getData<MyClusterData>();
 		data->w_extra += extra_weight;
 		data->w_max += extra_weight;
 		return true;
@@ -96,9 +237,22 @@ public:
 		auto cluster = top_tree->Expose(vertices[a].index, vertices[b].index);
 		if (cluster == NULL) return max_weight_result{false, 0, 0};
 
-		auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
-		auto edge = std::dynamic_pointer_cast<MyEdgeData>(data->w_max_edge);
-		return max_weight_result{true, data->w_max, edge->index};
+		auto data = cluster->getData<MyClusterData>();
+		return max_weight_result{true, data->w_max, data->w_max_edge->index};
+	}
+	std::vector<max_weight_result> get_max_weight_on_paths(const std::vector<std::pair<int, int>>& paths) {
+		std::vector<std::pair<int, int>> queries;
+		for (auto p: paths) queries.push_back(std::make_pair(vertices[p.first].index, vertices[p.second].index));
+
+		std::vector<max_weight_result> results(paths.size());
+		top_tree->QueryPaths(queries, [&](size_t i, std::shared_ptr<TopTree::ICluster> cluster) {
+			if (cluster == NULL) results[i] = max_weight_result{false, 0, 0};
+			else {
+				auto data = cluster->getData<MyClusterData>();
+				results[i] = max_weight_result{true, data->w_max, data->w_max_edge->index};
+			}
+		});
+		return results;
 	}
 
 private:
@@ -119,77 +273,3 @@ private:
 	std::vector<vertex> vertices;
 	std::vector<edge> edges;
 };
-
-////////////////////////////////////////////////////////////////////////////////
-
-void TopTree::Join(std::shared_ptr<TopTree::ICluster> leftChild, std::shared_ptr<TopTree::ICluster> rightChild, std::shared_ptr<TopTree::ICluster> parent) {
-	auto left_data = std::dynamic_pointer_cast<MyClusterData>(leftChild->data);
-	auto right_data = std::dynamic_pointer_cast<MyClusterData>(rightChild->data);
-	auto parent_data = std::dynamic_pointer_cast<MyClusterData>(parent->data);
-
-	if (isLeftRake(leftChild, rightChild, parent)) {
-		parent_data->w_max = right_data->w_max;
-		parent_data->w_max_edge = right_data->w_max_edge;
-	} else if (isRightRake(leftChild, rightChild, parent)) {
-		parent_data->w_max = left_data->w_max;
-		parent_data->w_max_edge = left_data->w_max_edge;
-	} else {
-		if (left_data->w_max > right_data->w_max) {
-			parent_data->w_max = left_data->w_max;
-			parent_data->w_max_edge = left_data->w_max_edge;
-		} else {
-			parent_data->w_max = right_data->w_max;
-			parent_data->w_max_edge = right_data->w_max_edge;
-		}
-	}
-	// There is no extra weight yet
-	parent_data->w_extra = 0;
-}
-void TopTree::Split(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent) {
-	auto left_data = std::dynamic_pointer_cast<MyClusterData>(leftChild->data);
-	auto right_data = std::dynamic_pointer_cast<MyClusterData>(rightChild->data);
-	auto parent_data = std::dynamic_pointer_cast<MyClusterData>(parent->data);
-
-	// Distribute w_extra to childs
-	if (isLeftRake(leftChild, rightChild, parent)) {
-		right_data->w_extra += parent_data->w_extra;
-		right_data->w_max += parent_data->w_extra;
-	} else if (isRightRake(leftChild, rightChild, parent)) {
-		left_data->w_extra += parent_data->w_extra;
-		left_data->w_max += parent_data->w_extra;
-	} else {
-		// Left
-		left_data->w_extra += parent_data->w_extra;
-		left_data->w_max += parent_data->w_extra;
-		// Right
-		right_data->w_extra += parent_data->w_extra;
-		right_data->w_max += parent_data->w_extra;
-	}
-}
-
-// Creating and destroying Base clusters:
-void TopTree::Create(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge) {
-	auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
-	auto edge_data = std::dynamic_pointer_cast<MyEdgeData>(edge);
-	data->w_max = edge_data->weight;
-	data->w_max_edge = edge_data;
-	data->w_extra = 0;
-}
-void TopTree::Destroy(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge) {
-	auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
-	auto edge_data = std::dynamic_pointer_cast<MyEdgeData>(edge);
-	edge_data->weight = data->w_max;
-}
-
-void TopTree::CopyClusterData(std::shared_ptr<ICluster> from, std::shared_ptr<ICluster> to) {
-	auto fromData = std::dynamic_pointer_cast<MyClusterData>(from->data);
-	auto toData = std::dynamic_pointer_cast<MyClusterData>(to->data);
-
-	toData->w_max = fromData->w_max;
-	toData->w_max_edge = fromData->w_max_edge;
-	toData->w_extra = fromData->w_extra;
-}
-
-std::shared_ptr<TopTree::ClusterData> TopTree::InitClusterData() {
-	return std::make_shared<MyClusterData>();
-}
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+
+#ifndef EXPERIMENTS_LATENCY_HPP
+#define EXPERIMENTS_LATENCY_HPP
+
+/**
+ * Records wall clock latency of single operations (measured by the steady clock) grouped by engine and operation type.
+ * Every sample is kept, so the percentiles are exact. Results are written as JSON (read by experiments/common.py).
+ *
+ * Usage:
+ *   auto start = LatencyRecorder::now();
+ *   worker->add_edge(...);
+ *   recorder.record("ST", "link", start);
+ */
+class LatencyRecorder {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	static clock::time_point now() { return clock::now(); }
+
+	void record(const std::string& engine, const std::string& operation, clock::time_point start) {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now() - start).count();
+		samples[engine][operation].push_back(ns);
+	}
+
+	// Additional values written into the JSON (e.g. seed and size of the experiment)
+	void set(const std::string& key, double value) { parameters[key] = value; }
+
+	struct summary {
+		size_t count = 0;
+		double mean = 0;
+		int64_t min = 0, p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0;
+		std::vector<std::pair<int64_t, size_t>> histogram; // (upper bound of the bucket in ns, count), buckets are powers of two
+	};
+
+	static summary summarize(std::vector<int64_t> values) {
+		summary s;
+		if (values.empty()) return s;
+		std::sort(values.begin(), values.end());
+		s.count = values.size();
+		for (auto v: values) s.mean += v;
+		s.mean /= values.size();
+		s.min = values.front();
+		s.max = values.back();
+		s.p50 = percentile(values, 0.5);
+		s.p90 = percentile(values, 0.9);
+		s.p99 = percentile(values, 0.99);
+		s.p999 = percentile(values, 0.999);
+
+		int64_t bound = 1;
+		for (auto v: values) {
+			while (v > bound) bound *= 2;
+			if (s.histogram.empty() || s.histogram.back().first != bound) s.histogram.push_back(std::make_pair(bound, 0));
+			s.histogram.back().second++;
+		}
+		return s;
+	}
+
+	void write_json(std::ostream& o) const {
+		o << "{" << std::endl << "\t\"parameters\": {";
+		bool first = true;
+		for (auto &p: parameters) {
+			o << (first ? "" : ",") << std::endl << "\t\t\"" << p.first << "\": " << p.second;
+			first = false;
+		}
+		o << std::endl << "\t}," << std::endl << "\t\"latency_ns\": {";
+		bool first_engine = true;
+		for (auto &engine: samples) {
+			o << (first_engine ? "" : ",") << std::endl << "\t\t\"" << engine.first << "\": {";
+			first_engine = false;
+			bool first_operation = true;
+			for (auto &operation: engine.second) {
+				auto s = summarize(operation.second);
+				o << (first_operation ? "" : ",") << std::endl << "\t\t\t\"" << operation.first << "\": {"
+					<< "\"count\": " << s.count << ", \"mean\": " << s.mean << ", \"min\": " << s.min
+					<< ", \"p50\": " << s.p50 << ", \"p90\": " << s.p90 << ", \"p99\": " << s.p99
+					<< ", \"p999\": " << s.p999 << ", \"max\": " << s.max << ", \"histogram\": [";
+				for (size_t i = 0; i < s.histogram.size(); i++) {
+					o << (i > 0 ? ", " : "") << "[" << s.histogram[i].first << ", " << s.histogram[i].second << "]";
+				}
+				o << "]}";
+				first_operation = false;
+			}
+			o << std::endl << "\t\t}";
+		}
+		o << std::endl << "\t}" << std::endl << "}" << std::endl;
+	}
+
+	void write_json(const std::string& path) const {
+		std::ofstream o(path);
+		write_json(o);
+		if (!o) {
+			std::cerr << "ERROR: Cannot write latencies into " << path << std::endl;
+			exit(1);
+		}
+	}
+private:
+	// Nearest rank percentile of sorted values
+	static int64_t percentile(const std::vector<int64_t>& sorted, double p) {
+		size_t rank = (size_t) std::ceil(p * sorted.size());
+		if (rank < 1) rank = 1;
+		return sorted[std::min(rank, sorted.size()) - 1];
+	}
+
+	std::map<std::string, std::map<std::string, std::vector<int64_t>>> samples; // engine -> operation -> ns
+	std::map<std::string, double> parameters;
+};
+
+#endif // EXPERIMENTS_LATENCY_HPP
@@ -0,0 +1,106 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+
+#ifndef EXPERIMENTS_WORKLOADS_HPP
+#define EXPERIMENTS_WORKLOADS_HPP
+
+// Generators of trees for experiments. All of them return parent array of a tree on n vertices rooted in 0
+// (parent[0] = -1) and use rand(), so they are deterministic for the seed given to srand().
+
+// Random recursive tree: parent of i is uniformly chosen from 0..i-1 (logarithmic depth)
+inline std::vector<int> random_recursive_tree(int n) {
+	std::vector<int> parent(n, -1);
+	for (int i = 1; i < n; i++) parent[i] = rand() % i;
+	return parent;
+}
+
+// Path 0-1-2-...-(n-1)
+inline std::vector<int> path_tree(int n) {
+	std::vector<int> parent(n, -1);
+	for (int i = 1; i < n; i++) parent[i] = i - 1;
+	return parent;
+}
+
+// Spine of even vertices 0-2-4-..., every odd vertex is a leg of the previous spine vertex
+inline std::vector<int> caterpillar_tree(int n) {
+	std::vector<int> parent(n, -1);
+	for (int i = 1; i < n; i++) parent[i] = (i % 2 == 1 ? i - 1 : i - 2);
+	return parent;
+}
+
+// Hubs 0..hubs-1 connected into a path, all other vertices are leaves of a random hub (huge degrees)
+inline std::vector<int> star_tree(int n, int hubs = 1) {
+	hubs = std::max(1, std::min(hubs, n));
+	std::vector<int> parent(n, -1);
+	for (int i = 1; i < hubs; i++) parent[i] = i - 1;
+	for (int i = hubs; i < n; i++) parent[i] = rand() % hubs;
+	return parent;
+}
+
+// Complete binary tree in the heap order
+inline std::vector<int> binary_tree(int n) {
+	std::vector<int> parent(n, -1);
+	for (int i = 1; i < n; i++) parent[i] = (i - 1) / 2;
+	return parent;
+}
+
+// Preferential attachment: parent is chosen with probability proportional to its degree (few vertices with high degree)
+inline std::vector<int> preferential_attachment_tree(int n) {
+	std::vector<int> parent(n, -1);
+	std::vector<int> endpoints; // every vertex is there once for each its edge
+	endpoints.reserve(2 * n);
+	for (int i = 1; i < n; i++) {
+		parent[i] = (i == 1 ? 0 : endpoints[rand() % endpoints.size()]);
+		endpoints.push_back(i);
+		endpoints.push_back(parent[i]);
+	}
+	return parent;
+}
+
+/**
+ * @brief Generates tree by its name: random, path, caterpillar, star[:hubs], binary or preferential.
+ */
+inline std::vector<int> generate_tree(const std::string& type, int n) {
+	if (type == "random") return random_recursive_tree(n);
+	if (type == "path") return path_tree(n);
+	if (type == "caterpillar") return caterpillar_tree(n);
+	if (type == "star") return star_tree(n);
+	if (type.compare(0, 5, "star:") == 0) return star_tree(n, atoi(type.c_str() + 5));
+	if (type == "binary") return binary_tree(n);
+	if (type == "preferential") return preferential_attachment_tree(n);
+	std::cerr << "ERROR: Unknown type of tree " << type << std::endl;
+	exit(1);
+}
+
+/**
+ * Samples vertices 0..n-1 with Zipfian distribution (probability of the k-th most popular vertex is proportional to
+ * 1/k^s), popularity order of vertices is a random permutation. Used for skewed locality of queries.
+ */
+class ZipfSampler {
+public:
+	ZipfSampler(int n, double s): cdf(n), vertices(n) {
+		double sum = 0;
+		for (int k = 0; k < n; k++) {
+			sum += 1.0 / std::pow(k + 1, s);
+			cdf[k] = sum;
+			vertices[k] = k;
+		}
+		for (auto &c: cdf) c /= sum;
+		for (int k = n - 1; k > 0; k--) std::swap(vertices[k], vertices[rand() % (k + 1)]);
+	}
+
+	int operator()() {
+		double u = (double) rand() / ((double) RAND_MAX + 1);
+		size_t k = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+		return vertices[std::min(k, vertices.size() - 1)];
+	}
+private:
+	std::vector<double> cdf;
+	std::vector<int> vertices;
+};
+
+#endif // EXPERIMENTS_WORKLOADS_HPP
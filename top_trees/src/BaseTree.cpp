@@ -3,6 +3,11 @@
 #include <memory>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <climits>
+#include <cctype>
 
 #include "BaseTreeInternal.hpp"
 
@@ -11,8 +16,8 @@ namespace TopTree {
 std::ostream& operator<<(std::ostream& o, const VertexData& v) { return v.ToString(o); }
 std::ostream& operator<<(std::ostream& o, const EdgeData& e) { return e.ToString(o); }
 
-int VertexData::v_counter = 0;
-int EdgeData::e_counter = 0;
+std::atomic<int> VertexData::v_counter{0};
+std::atomic<int> EdgeData::e_counter{0};
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -36,13 +41,8 @@ int BaseTree::AddVertex(std::shared_ptr<VertexData> v) {
 int BaseTree::AddEdge(int from, int to, std::shared_ptr<EdgeData> e) {
 	if (e == NULL) e = std::make_shared<EdgeData>();
 	int i = internal->edges.size();
-	auto vertex_from = internal->vertices[from];
-	auto vertex_to = internal->vertices[to];
-
-	auto edge = std::make_shared<Internal::Edge>(vertex_from, vertex_to, e);
-	edge->register_at_vertices();
-
-	internal->edges.push_back(edge);
+	auto edge = internal->create_edge(from, to, e);
+	internal->index_edge(from, to, edge);
 	return i;
 }
 
@@ -52,34 +52,447 @@ int BaseTree::AddLeaf(int parent, std::shared_ptr<EdgeData> e, std::shared_ptr<V
 	return vi;
 }
 
+void BaseTree::Reserve(int vertices, int edges) {
+	internal->vertices.reserve(vertices);
+	internal->edges.reserve(edges);
+}
+
+int BaseTree::AddVertices(int count, std::function<std::shared_ptr<VertexData>(int)> vertex_data) {
+	int first = internal->vertices.size();
+	internal->vertices.reserve(first + count);
+	for (int i = 0; i < count; i++) AddVertex(vertex_data != NULL ? vertex_data(i) : NULL);
+	return first;
+}
+
+void BaseTree::AddEdges(const std::vector<std::pair<int, int>>& edges, std::function<std::shared_ptr<EdgeData>(int)> edge_data) {
+	// 1. Allocate adjacency of all vertices at once
+	int n = internal->vertices.size();
+	std::vector<int> degrees(n, 0);
+	for (size_t i = 0; i < edges.size(); i++) {
+		auto &e = edges[i];
+		if (e.first < 0 || e.first >= n || e.second < 0 || e.second >= n) {
+			std::cerr << "ERROR: Edge " << i << " (" << e.first << "-" << e.second << ") has vertex out of range 0-" << n - 1 << std::endl;
+			exit(1);
+		}
+		degrees[e.first]++;
+		degrees[e.second]++;
+	}
+	for (size_t i = 0; i < degrees.size(); i++) {
+		if (degrees[i] > 0) internal->vertices[i]->neighbours.reserve(internal->vertices[i]->neighbours.size() + degrees[i]);
+	}
+	internal->edges.reserve(internal->edges.size() + edges.size());
+
+	// 2. Create edges and register them at their endpoints (edge_index is filled lazily by find_edge, Cut of a few
+	// edges does not need hashing of all of them)
+	for (size_t i = 0; i < edges.size(); i++) {
+		auto data = (edge_data != NULL ? edge_data(i) : std::shared_ptr<EdgeData>());
+		internal->create_edge(edges[i].first, edges[i].second, data != NULL ? data : std::make_shared<EdgeData>());
+	}
+}
+
+int BaseTree::AddParentArray(const std::vector<int>& parents, std::function<std::shared_ptr<EdgeData>(int)> edge_data) {
+	int first = AddVertices(parents.size());
+
+	std::vector<std::pair<int, int>> edges;
+	std::vector<int> edge_vertices; // to give edge data by the vertex
+	edges.reserve(parents.size());
+	for (size_t i = 0; i < parents.size(); i++) {
+		if (parents[i] < 0) continue;
+		edges.push_back(std::make_pair(first + i, first + parents[i]));
+		edge_vertices.push_back(i);
+	}
+	if (edge_data != NULL) AddEdges(edges, [&](int i) { return edge_data(edge_vertices[i]); });
+	else AddEdges(edges);
+	return first;
+}
+
+namespace {
+// Reads unsigned integers from text stream by big blocks (without formatted input of the stream)
+class EdgeListReader {
+public:
+	EdgeListReader(std::istream& input): input{input}, buffer(1 << 16) {}
+
+	// Returns false at the end of the stream, malformed values are fatal errors
+	bool read(int& value) {
+		int c = skip();
+		if (c == EOF) return false;
+		if (c < '0' || c > '9') error("unexpected " + describe(c));
+		value = 0;
+		while (c >= '0' && c <= '9') {
+			if (value > (INT_MAX - (c - '0')) / 10) error("too big number");
+			value = value*10 + (c - '0');
+			position++;
+			c = peek();
+		}
+		if (c != EOF && c != '#' && !is_space(c)) error("unexpected " + describe(c) + " after number");
+		return true;
+	}
+
+	[[noreturn]] void error(const std::string& message) const {
+		std::cerr << "ERROR: Cannot read edge list at line " << line << ": " << message << std::endl;
+		exit(1);
+	}
+private:
+	std::istream& input;
+	std::vector<char> buffer;
+	size_t position = 0;
+	size_t size = 0;
+	int line = 1;
+
+	static bool is_space(int c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+	static std::string describe(int c) { return (isprint(c) ? "character '" + std::string(1, (char) c) + "'" : "byte " + std::to_string(c)); }
+
+	int peek() {
+		if (position == size) {
+			input.read(buffer.data(), buffer.size());
+			size = input.gcount();
+			position = 0;
+			if (size == 0) return EOF;
+		}
+		return (unsigned char) buffer[position]; // (byte 0xFF must not look like EOF)
+	}
+	// Skips whitespaces and comments, returns the next character
+	int skip() {
+		int c;
+		while ((c = peek()) != EOF) {
+			if (c == '#') {
+				while ((c = peek()) != EOF && c != '\n') position++;
+			} else if (is_space(c)) {
+				if (c == '\n') line++;
+				position++;
+			} else break;
+		}
+		return c;
+	}
+};
+}
+
+int BaseTree::LoadEdgeList(std::istream& input, bool binary, std::function<std::shared_ptr<EdgeData>(int)> edge_data) {
+	// 1. Read all pairs
+	std::vector<std::pair<int, int>> edges;
+	int max_vertex = -1;
+	if (binary) {
+		std::vector<int32_t> block(1 << 14);
+		while (input) {
+			input.read(reinterpret_cast<char*>(block.data()), block.size() * sizeof(int32_t));
+			if (input.gcount() % (2*sizeof(int32_t)) != 0) {
+				std::cerr << "ERROR: Cannot read edge list: " << input.gcount() % (2*sizeof(int32_t)) << " bytes after the last whole pair" << std::endl;
+				exit(1);
+			}
+			size_t count = input.gcount() / (2*sizeof(int32_t));
+			for (size_t i = 0; i < count; i++) {
+				if (block[2*i] < 0 || block[2*i + 1] < 0) {
+					std::cerr << "ERROR: Cannot read edge list: edge " << edges.size() << " has negative vertex" << std::endl;
+					exit(1);
+				}
+				edges.push_back(std::make_pair(block[2*i], block[2*i + 1]));
+				max_vertex = std::max(max_vertex, std::max(block[2*i], block[2*i + 1]));
+			}
+		}
+	} else {
+		EdgeListReader reader(input);
+		int from, to;
+		while (reader.read(from)) {
+			if (!reader.read(to)) reader.error("odd number of vertex indexes");
+			edges.push_back(std::make_pair(from, to));
+			max_vertex = std::max(max_vertex, std::max(from, to));
+		}
+	}
+
+	// 2. Add missing vertices and all edges
+	if (max_vertex >= (int) internal->vertices.size()) AddVertices(max_vertex + 1 - internal->vertices.size());
+	AddEdges(edges, edge_data);
+	return edges.size();
+}
+
+std::shared_ptr<VertexData> BaseTree::GetVertexData(int index) {
+	return internal->vertices[index]->data;
+}
+
+std::shared_ptr<EdgeData> BaseTree::GetEdgeData(int index) {
+	return internal->edges[index]->data;
+}
+
+void BaseTree::SetVertexData(int index, std::shared_ptr<VertexData> v) {
+	if (v == NULL) v = std::make_shared<VertexData>();
+	internal->vertices[index]->data = v;
+}
+
 void BaseTree::PrintRooted(int root) {
 	internal->print_rooted_prefix(internal->vertices[root]);
 	//internal->orient_edges_to_root(internal->vertices[root]);
 }
 
-void BaseTree::Internal::Edge::register_at_vertices() {
-	from->neighbours.push_back(Internal::neighbour{shared_from_this()});
-	from_iter = std::prev(from->neighbours.end());
+std::shared_ptr<BaseTree::Internal::Edge> BaseTree::Internal::create_edge(int from, int to, std::shared_ptr<EdgeData> data) {
+	auto edge = std::allocate_shared<Edge>(PoolAllocator<Edge>(edge_pool), vertices[from], vertices[to], std::move(data));
+	edge->register_at_vertices();
+	edges.push_back(edge);
+	return edge;
+}
 
-	to->neighbours.push_back(Internal::neighbour{shared_from_this()});
-	to_iter = std::prev(to->neighbours.end());
+void BaseTree::Internal::Edge::register_at_vertices() {
+	from_index = from->add_neighbour(shared_from_this());
+	to_index = to->add_neighbour(shared_from_this());
 
 	from->degree++;
 	to->degree++;
 
 	// Superior vertices
 	if (from->superior_vertex != NULL && !subvertice_edge) {
-		from->superior_vertex->neighbours.push_back(Internal::neighbour{shared_from_this()});
-		superior_from_iter = std::prev(from->superior_vertex->neighbours.end());
+		superior_from_index = from->superior_vertex->add_neighbour(shared_from_this(), true);
 		from->superior_vertex->degree++;
 	}
 	if (to->superior_vertex != NULL && !subvertice_edge) {
-		to->superior_vertex->neighbours.push_back(Internal::neighbour{shared_from_this()});
-		superior_to_iter = std::prev(to->superior_vertex->neighbours.end());
+		superior_to_index = to->superior_vertex->add_neighbour(shared_from_this(), true);
 		to->superior_vertex->degree++;
 	}
 }
 
+int BaseTree::Internal::Vertex::add_neighbour(std::shared_ptr<Edge> edge, bool superior) {
+	neighbours.push_back(neighbour{edge, superior});
+	return neighbours.size() - 1;
+}
+void BaseTree::Internal::Vertex::remove_neighbour(int index) {
+	neighbours[index] = neighbours.back();
+	neighbours.pop_back();
+	if (index == (int) neighbours.size()) return;
+
+	// Repair index of the moved edge
+	if (auto ee = neighbours[index].edge.lock()) {
+		if (!neighbours[index].superior) {
+			if (ee->from.get() == this) ee->from_index = index;
+			else ee->to_index = index;
+		} else {
+			if (ee->from->superior_vertex.get() == this) ee->superior_from_index = index;
+			else ee->superior_to_index = index;
+		}
+	}
+}
+
+void BaseTree::Internal::Vertex::add_subvertex(std::shared_ptr<Vertex> subvertex) {
+	subvertex->superior_vertex_subvertices_index = subvertices.size();
+	subvertices.push_back(subvertex);
+}
+void BaseTree::Internal::Vertex::remove_subvertex(std::shared_ptr<Vertex> subvertex) {
+	int index = subvertex->superior_vertex_subvertices_index;
+	subvertices[index] = subvertices.back();
+	subvertices.pop_back();
+	if (index < (int) subvertices.size()) subvertices[index]->superior_vertex_subvertices_index = index;
+}
+
+void BaseTree::Internal::Vertex::add_subvertice_edge(std::shared_ptr<Edge> edge) {
+	edge->subvertice_edges_index = subvertice_edges.size();
+	subvertice_edges.push_back(edge);
+}
+void BaseTree::Internal::Vertex::remove_subvertice_edge(std::shared_ptr<Edge> edge) {
+	int index = edge->subvertice_edges_index;
+	subvertice_edges[index] = subvertice_edges.back();
+	subvertice_edges.pop_back();
+	if (index < (int) subvertice_edges.size()) subvertice_edges[index]->subvertice_edges_index = index;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Edge index
+
+static uint64_t edge_key(int v, int w) {
+	if (v > w) std::swap(v, w);
+	return ((uint64_t) (uint32_t) v << 32) | (uint32_t) w;
+}
+
+void BaseTree::Internal::index_edge(int v, int w, std::shared_ptr<Edge> edge) {
+	edge_index[edge_key(v, w)] = edge;
+}
+
+void BaseTree::Internal::unindex_edge(int v, int w) {
+	edge_index.erase(edge_key(v, w));
+}
+
+std::shared_ptr<BaseTree::Internal::Edge> BaseTree::Internal::find_edge(int v, int w) {
+	auto vertex_v = vertices[v];
+	auto vertex_w = vertices[w];
+	// Edge connects the vertices (or their subvertices)
+	auto connects = [&](const std::shared_ptr<Edge>& edge) {
+		if (edge == NULL || edge->from == NULL || edge->to == NULL) return false;
+		auto from = Vertex::get_superior(edge->from);
+		auto to = Vertex::get_superior(edge->to);
+		return (from == vertex_v && to == vertex_w) || (from == vertex_w && to == vertex_v);
+	};
+
+	auto it = edge_index.find(edge_key(v, w));
+	if (it != edge_index.end()) {
+		auto edge = it->second.lock();
+		if (connects(edge)) return edge;
+		edge_index.erase(it);
+	}
+
+	// Not indexed, scan neighbours of the vertex with lower degree
+	auto& neighbours = (vertex_v->neighbours.size() <= vertex_w->neighbours.size() ? vertex_v : vertex_w)->neighbours;
+	for (auto &n: neighbours) {
+		auto edge = n.edge.lock();
+		if (connects(edge)) {
+			index_edge(v, w, edge);
+			return edge;
+		}
+	}
+	return NULL;
+}
+
+void BaseTree::Internal::save(std::ostream& o, IDataSerializer& serializer, std::unordered_map<Vertex*, int>& vertex_ids, std::unordered_map<Edge*, int>& edge_ids) const {
+	// 1. Number all vertices and edges
+	std::vector<std::shared_ptr<Vertex>> all_vertices(vertices);
+	for (auto &v: vertices) all_vertices.insert(all_vertices.end(), v->subvertices.begin(), v->subvertices.end());
+	for (size_t i = 0; i < all_vertices.size(); i++) vertex_ids[all_vertices[i].get()] = i;
+
+	std::vector<std::shared_ptr<Edge>> all_edges;
+	auto add_edge = [&](const std::shared_ptr<Edge>& e) {
+		if (e == NULL || edge_ids.find(e.get()) != edge_ids.end()) return;
+		edge_ids[e.get()] = all_edges.size();
+		all_edges.push_back(e);
+	};
+	for (auto &v: all_vertices) {
+		for (auto &n: v->neighbours) add_edge(n.edge.lock());
+		for (auto &e: v->subvertice_edges) add_edge(e);
+	}
+
+	// 2. User data (vertex data of subvertices and edge data of subvertice edges are internal)
+	writeValue<int32_t>(o, vertices.size());
+	for (auto &v: vertices) serializer.SaveVertexData(o, v->data);
+
+	std::unordered_map<EdgeData*, int> data_ids;
+	std::vector<std::shared_ptr<EdgeData>> edge_data;
+	for (auto &e: all_edges) {
+		if (e->subvertice_edge || data_ids.find(e->data.get()) != data_ids.end()) continue;
+		data_ids[e->data.get()] = edge_data.size();
+		edge_data.push_back(e->data);
+	}
+	writeValue<int32_t>(o, edge_data.size());
+	for (auto &d: edge_data) serializer.SaveEdgeData(o, d);
+
+	// 3. Vertices and edges
+	auto vertex_id = [&vertex_ids](const std::shared_ptr<Vertex>& v) { return (v == NULL ? -1 : vertex_ids[v.get()]); };
+	writeValue<int32_t>(o, all_vertices.size());
+	for (auto &v: all_vertices) {
+		writeValue<int32_t>(o, v->index);
+		writeValue<int32_t>(o, v->degree);
+		writeValue<int32_t>(o, vertex_id(v->superior_vertex));
+		writeValue<int32_t>(o, v->superior_vertex_subvertices_index);
+	}
+	writeValue<int32_t>(o, all_edges.size());
+	for (auto &e: all_edges) {
+		writeValue<int32_t>(o, vertex_id(e->from));
+		writeValue<int32_t>(o, vertex_id(e->to));
+		writeValue<int32_t>(o, e->subvertice_edge ? -1 : data_ids[e->data.get()]);
+		writeValue<int32_t>(o, e->from_index);
+		writeValue<int32_t>(o, e->to_index);
+		writeValue<int32_t>(o, e->superior_from_index);
+		writeValue<int32_t>(o, e->superior_to_index);
+		writeValue<int32_t>(o, e->subvertice_edges_index);
+	}
+
+	// 4. Adjacency
+	for (auto &v: all_vertices) {
+		writeValue<int32_t>(o, v->neighbours.size());
+		for (auto &n: v->neighbours) {
+			writeValue<int32_t>(o, edge_ids[n.edge.lock().get()]);
+			writeValue<bool>(o, n.superior);
+		}
+		writeValue<int32_t>(o, v->subvertices.size());
+		for (auto &s: v->subvertices) writeValue<int32_t>(o, vertex_id(s));
+		writeValue<int32_t>(o, v->subvertice_edges.size());
+		for (auto &e: v->subvertice_edges) writeValue<int32_t>(o, edge_ids[e.get()]);
+		// (only subvertices that still exist, so the loaded tree adds new subvertices at the same places)
+		std::vector<int> link_slots;
+		for (auto &w: v->link_slots) if (auto s = w.lock()) if (s->superior_vertex == v) link_slots.push_back(vertex_id(s));
+		writeValue<int32_t>(o, link_slots.size());
+		for (int id: link_slots) writeValue<int32_t>(o, id);
+	}
+}
+
+void BaseTree::Internal::load(std::istream& i, IDataSerializer& serializer, std::vector<std::shared_ptr<Vertex>>& all_vertices, std::vector<std::shared_ptr<Edge>>& all_edges) {
+	// Counts are bounded by the rest of the file (or by the counts read before) and ids by the counts, so a corrupted
+	// file is reported instead of allocating huge arrays or indexing out of them
+
+	// 1. User data
+	std::vector<std::shared_ptr<VertexData>> vertex_data(readCount(i, remainingBytes(i)));
+	for (auto &d: vertex_data) d = serializer.LoadVertexData(i);
+	std::vector<std::shared_ptr<EdgeData>> edge_data(readCount(i, remainingBytes(i)));
+	for (auto &d: edge_data) d = serializer.LoadEdgeData(i);
+
+	// 2. Vertices and edges
+	all_vertices.resize(readCount(i, remainingBytes(i) / (4 * sizeof(int32_t))));
+	if (all_vertices.size() < vertex_data.size()) readError("fewer vertices than vertex data");
+	std::vector<int> superior_ids(all_vertices.size());
+	for (size_t j = 0; j < all_vertices.size(); j++) {
+		auto v = std::make_shared<Vertex>(j < vertex_data.size() ? vertex_data[j] : std::make_shared<VertexData>());
+		v->index = readValue<int32_t>(i);
+		v->degree = readValue<int32_t>(i);
+		superior_ids[j] = readId(i, all_vertices.size());
+		v->superior_vertex_subvertices_index = readValue<int32_t>(i);
+		if (v->degree < 0) readError("negative degree");
+		if (j < vertex_data.size() && (v->index != (int) j || superior_ids[j] >= 0)) readError("wrong vertex");
+		all_vertices[j] = v;
+	}
+	for (size_t j = 0; j < all_vertices.size(); j++) {
+		if (superior_ids[j] >= (int) vertex_data.size() || (superior_ids[j] < 0 && j >= vertex_data.size())) readError("wrong superior vertex");
+		if (superior_ids[j] >= 0) all_vertices[j]->superior_vertex = all_vertices[superior_ids[j]];
+		if (superior_ids[j] >= 0 && all_vertices[j]->index != all_vertices[superior_ids[j]]->index) readError("wrong subvertex index");
+	}
+
+	all_edges.resize(readCount(i, remainingBytes(i) / (8 * sizeof(int32_t))));
+	for (auto &e: all_edges) {
+		auto from = all_vertices[readId(i, all_vertices.size(), false)];
+		auto to = all_vertices[readId(i, all_vertices.size(), false)];
+		int data_id = readId(i, edge_data.size());
+		e = std::make_shared<Edge>(from, to, data_id >= 0 ? edge_data[data_id] : std::make_shared<EdgeData>());
+		e->subvertice_edge = (data_id < 0);
+		e->from_index = readValue<int32_t>(i);
+		e->to_index = readValue<int32_t>(i);
+		e->superior_from_index = readValue<int32_t>(i);
+		e->superior_to_index = readValue<int32_t>(i);
+		e->subvertice_edges_index = readValue<int32_t>(i);
+	}
+
+	// 3. Adjacency
+	for (auto &v: all_vertices) {
+		v->neighbours.resize(readCount(i, 2 * all_edges.size()));
+		for (auto &n: v->neighbours) {
+			n.edge = all_edges[readId(i, all_edges.size(), false)];
+			n.superior = readValue<bool>(i);
+		}
+		v->subvertices.resize(readCount(i, all_vertices.size()));
+		for (auto &s: v->subvertices) s = all_vertices[readId(i, all_vertices.size(), false)];
+		v->subvertice_edges.resize(readCount(i, all_edges.size()));
+		for (auto &e: v->subvertice_edges) e = all_edges[readId(i, all_edges.size(), false)];
+		int link_slots = readCount(i, all_vertices.size());
+		for (int j = 0; j < link_slots; j++) v->link_slots.push_back(all_vertices[readId(i, all_vertices.size(), false)]);
+	}
+
+	// 4. Indexes stored in vertices and edges must point back to them (the tree repairs them when removing items)
+	auto neighbour_at = [](const std::shared_ptr<Vertex>& v, int index, const std::shared_ptr<Edge>& e, bool superior) {
+		if (index < 0 || index >= (int) v->neighbours.size() || v->neighbours[index].superior != superior || v->neighbours[index].edge.lock() != e) readError("wrong neighbour index");
+	};
+	for (auto &v: all_vertices) {
+		auto &s = v->superior_vertex;
+		int index = v->superior_vertex_subvertices_index;
+		if (s != NULL && (index < 0 || index >= (int) s->subvertices.size() || s->subvertices[index] != v)) readError("wrong subvertex index");
+	}
+	for (auto &e: all_edges) {
+		neighbour_at(e->from, e->from_index, e, false);
+		neighbour_at(e->to, e->to_index, e, false);
+		if (e->subvertice_edge) {
+			auto &s = e->from->superior_vertex;
+			int index = e->subvertice_edges_index;
+			if (s == NULL || index < 0 || index >= (int) s->subvertice_edges.size() || s->subvertice_edges[index] != e) readError("wrong subvertice edge index");
+		} else {
+			if (e->from->superior_vertex != NULL) neighbour_at(e->from->superior_vertex, e->superior_from_index, e, true);
+			if (e->to->superior_vertex != NULL) neighbour_at(e->to->superior_vertex, e->superior_to_index, e, true);
+		}
+	}
+
+	vertices.assign(all_vertices.begin(), all_vertices.begin() + vertex_data.size());
+	edges = all_edges;
+}
+
 void BaseTree::Internal::print_rooted_prefix(const std::shared_ptr<Vertex> root, const std::shared_ptr<Vertex> from, const std::string prefix, bool last_child) const {
 	std::cout << prefix << "|-" << *root->data << std::endl;
 	int size = root->neighbours.size();
@@ -0,0 +1,55 @@
+#include <new>
+#include <cassert>
+
+#include "ClusterPool.hpp"
+
+namespace TopTree {
+
+ClusterPool::~ClusterPool() {
+	assert(chunks_in_use == 0); // allocators of all chunks hold the pool
+	for (auto block: blocks) ::operator delete(block);
+	blocks.clear();
+}
+
+void* ClusterPool::allocate(size_t size) {
+	if (size > max_chunk_size) return ::operator new(size);
+
+	size_t size_class = (size + granularity - 1) / granularity;
+	chunks_in_use++;
+
+	// 1. Reuse freed chunk of the same size class
+	if (size_class < free_lists.size() && free_lists[size_class] != NULL) {
+		auto chunk = free_lists[size_class];
+		free_lists[size_class] = chunk->next;
+		return chunk;
+	}
+
+	// 2. Take new chunk from the current block
+	size_t chunk_size = size_class * granularity;
+	if (remaining < chunk_size) {
+		current = static_cast<char*>(::operator new(block_size));
+		remaining = block_size;
+		blocks.push_back(current);
+	}
+	void* chunk = current;
+	current += chunk_size;
+	remaining -= chunk_size;
+	return chunk;
+}
+
+void ClusterPool::deallocate(void* p, size_t size) {
+	if (size > max_chunk_size) {
+		::operator delete(p);
+		return;
+	}
+
+	size_t size_class = (size + granularity - 1) / granularity;
+	chunks_in_use--;
+
+	if (size_class >= free_lists.size()) free_lists.resize(size_class + 1, NULL);
+	auto chunk = static_cast<free_chunk*>(p);
+	chunk->next = free_lists[size_class];
+	free_lists[size_class] = chunk;
+}
+
+}
@@ -0,0 +1,76 @@
+#include "ComponentCache.hpp"
+
+namespace TopTree {
+
+uint64_t ComponentCache::ComponentId(int v) {
+	if (v >= (int) vertex_labels.size()) vertex_labels.resize(v + 1, 0);
+
+	// 1. Cached label (O(1))
+	uint64_t label = vertex_labels[v];
+	if (label != 0 && label_roots.find(label) != label_roots.end()) return label;
+
+	// 2. Find the root and get its label (or the new one)
+	auto root = top_tree->FindRoot(v);
+	auto it = (root != NULL ? root_labels.find(root.get()) : root_labels.end());
+	if (it != root_labels.end()) label = it->second;
+	else {
+		label = next_label++;
+		label_roots[label] = root.get();
+		if (root != NULL) root_labels[root.get()] = label;
+	}
+	vertex_labels[v] = label;
+	return label;
+}
+
+bool ComponentCache::Connected(int v, int w) {
+	if (v == w) return true;
+	return ComponentId(v) == ComponentId(w);
+}
+
+void ComponentCache::invalidate_component(int v) {
+	// Current label of the component (its vertices may have the old ones but they are invalid already)
+	uint64_t label = ComponentId(v);
+	auto it = label_roots.find(label);
+	if (it->second != NULL) root_labels.erase(it->second);
+	label_roots.erase(it);
+}
+
+std::shared_ptr<ICluster> ComponentCache::Link(int v, int w, std::shared_ptr<EdgeData> edge_data) {
+	Restore(); // the roots must not change by restoring inside the Link
+	invalidate_component(v);
+	invalidate_component(w);
+	return top_tree->Link(v, w, edge_data);
+}
+
+std::shared_ptr<EdgeData> ComponentCache::Cut(int v, int w) {
+	Restore();
+	invalidate_component(v);
+	invalidate_component(w);
+	return std::get<2>(top_tree->Cut(v, w));
+}
+
+std::shared_ptr<ICluster> ComponentCache::Expose(int v, int w) {
+	Restore();
+	invalidate_component(v);
+	invalidate_component(w);
+	exposed = true;
+	exposed_v = v;
+	exposed_w = w;
+	return top_tree->Expose(v, w);
+}
+
+void ComponentCache::Restore() {
+	if (!exposed) return;
+	top_tree->Restore();
+	// Labels given while exposed belong to roots of the exposed tree
+	invalidate_component(exposed_v);
+	invalidate_component(exposed_w);
+	exposed = false;
+}
+
+void ComponentCache::Invalidate() {
+	label_roots.clear();
+	root_labels.clear();
+}
+
+}
@@ -0,0 +1,56 @@
+#include <mutex>
+#include <shared_mutex>
+
+#include "ConcurrentTopTree.hpp"
+
+namespace TopTree {
+
+std::shared_lock<std::shared_timed_mutex> ConcurrentTopTree::read_lock() const {
+	std::lock_guard<std::mutex> gate(writer_gate); // wait for the pending writer
+	return std::shared_lock<std::shared_timed_mutex>(mutex);
+}
+
+std::shared_ptr<ICluster> ConcurrentTopTree::QueryPath(int v, int w) const {
+	auto lock = read_lock();
+	return top_tree->QueryPath(v, w);
+}
+
+bool ConcurrentTopTree::Connected(int v, int w) const {
+	auto lock = read_lock();
+	return top_tree->Connected(v, w);
+}
+
+bool ConcurrentTopTree::Link(int v, int w, std::shared_ptr<EdgeData> edge_data) {
+	std::lock_guard<std::mutex> gate(writer_gate);
+	std::lock_guard<std::shared_timed_mutex> lock(mutex);
+	bool linked = (top_tree->Link(v, w, edge_data) != NULL);
+	top_tree->Restore();
+	return linked;
+}
+
+std::shared_ptr<EdgeData> ConcurrentTopTree::Cut(int v, int w) {
+	std::lock_guard<std::mutex> gate(writer_gate);
+	std::lock_guard<std::shared_timed_mutex> lock(mutex);
+	auto edge_data = std::get<2>(top_tree->Cut(v, w));
+	top_tree->Restore();
+	return edge_data;
+}
+
+int ConcurrentTopTree::BatchUpdate(const std::vector<std::pair<int, int>>& cuts, const std::vector<LinkUpdate>& links) {
+	std::lock_guard<std::mutex> gate(writer_gate);
+	std::lock_guard<std::shared_timed_mutex> lock(mutex);
+	int applied = top_tree->BatchUpdate(cuts, links);
+	top_tree->Restore();
+	return applied;
+}
+
+bool ConcurrentTopTree::UpdatePath(int v, int w, std::function<void(std::shared_ptr<ICluster>)> update) {
+	std::lock_guard<std::mutex> gate(writer_gate);
+	std::lock_guard<std::shared_timed_mutex> lock(mutex);
+	auto cluster = top_tree->Expose(v, w);
+	if (cluster != NULL) update(cluster);
+	top_tree->Restore();
+	return (cluster != NULL);
+}
+
+}
@@ -1,23 +1,24 @@
 #include "STCluster.hpp"
+#include "Statistics.hpp"
 
 //#define DEBUG
 
 namespace TopTree {
 std::ostream& operator<<(std::ostream& o, const STCluster& c) { return c.ToString(o); }
 
-void STCluster::set_left_child(std::shared_ptr<STCluster> child) {
+void STCluster::set_left_child(const std::shared_ptr<STCluster>& child) {
 	left_child = child;
 	if (child != NULL) child->parent = shared_from_this();
 }
-void STCluster::set_right_child(std::shared_ptr<STCluster> child) {
+void STCluster::set_right_child(const std::shared_ptr<STCluster>& child) {
 	right_child = child;
 	if (child != NULL) child->parent = shared_from_this();
 }
-void STCluster::set_left_foster(std::shared_ptr<STCluster> child) {
+void STCluster::set_left_foster(const std::shared_ptr<STCluster>& child) {
 	left_foster = child;
 	if (child != NULL) child->parent = shared_from_this();
 }
-void STCluster::set_right_foster(std::shared_ptr<STCluster> child) {
+void STCluster::set_right_foster(const std::shared_ptr<STCluster>& child) {
 	right_foster = child;
 	if (child != NULL) child->parent = shared_from_this();
 }
@@ -30,8 +31,8 @@ void STCluster::unlink() {
 	right_child = NULL;
 }
 
-std::shared_ptr<BaseCluster> BaseCluster::construct(std::shared_ptr<BaseTree::Internal::Edge> edge) {
-	auto cluster = std::make_shared<BaseCluster>();
+std::shared_ptr<BaseCluster> BaseCluster::construct(std::shared_ptr<BaseTree::Internal::Edge> edge, IUserFunctions* functions, ClusterPool* pool) {
+	auto cluster = allocate<BaseCluster>(functions, pool);
 
 	cluster->edge = edge;
 	cluster->do_join();
@@ -40,6 +41,7 @@ std::shared_ptr<BaseCluster> BaseCluster::construct(std::shared_ptr<BaseTree::In
 }
 void BaseCluster::do_join() {
 	if (!is_splitted || is_deleted) return;
+	TOP_TREE_COUNT(joins, 1);
 	// No child, no need to join them
 
 	// 1. Set boundaries:
@@ -55,23 +57,24 @@ void BaseCluster::do_join() {
 	// Base handle is used for recomputing handles when some change occurs (during rotating, splaying, splicing) and last_handle is no longer handle.
 	//boundary_left->base_handle = shared_from_this();
 	if (!handles_registered) { // to not register them more than once
+		from_handles_index = boundary_left->base_handles.size();
 		boundary_left->base_handles.push_back(shared_from_this());
-		boundary_left_handles_iterator = std::prev(boundary_left->base_handles.end());
 
 		//boundary_right->base_handle = shared_from_this();
+		to_handles_index = boundary_right->base_handles.size();
 		boundary_right->base_handles.push_back(shared_from_this());
-		boundary_right_handles_iterator = std::prev(boundary_right->base_handles.end());
 
 		handles_registered = true;
 	}
 
 	// 3. Call user defined method:
-	Create(shared_from_this(), edge->data);
+	functions->Create(*this, edge->data);
 
 	is_splitted = false;
 }
 void BaseCluster::do_split(std::vector<std::shared_ptr<STCluster>>* splitted_clusters) {
 	if (is_splitted) return;
+	TOP_TREE_COUNT(splits, 1);
 
 	#ifdef DEBUG
 		std::cerr << "Splitting " << *shared_from_this() << std::endl;
@@ -84,7 +87,7 @@ void BaseCluster::do_split(std::vector<std::shared_ptr<STCluster>>* splitted_clu
 	if (parent != NULL) parent->do_split(splitted_clusters);
 
 	// 3. Call user defined method:
-	Destroy(shared_from_this(), edge->data);
+	functions->Destroy(*this, edge->data);
 
 	is_splitted = true;
 }
@@ -93,11 +96,11 @@ void BaseCluster::unregister() {
 	if (boundary_right->last_handle == shared_from_this()) boundary_right->last_handle = NULL;
 
 	if (handles_registered) {
-		boundary_left->base_handles.erase(boundary_left_handles_iterator);
-		boundary_right->base_handles.erase(boundary_right_handles_iterator);
+		remove_base_handle(edge->from, from_handles_index);
+		remove_base_handle(edge->to, to_handles_index);
 	}
-	edge->from->neighbours.erase(edge->from_iter);
-	edge->to->neighbours.erase(edge->to_iter);
+	edge->from->remove_neighbour(edge->from_index);
+	edge->to->remove_neighbour(edge->to_index);
 
 	boundary_left->degree--;
 	boundary_right->degree--;
@@ -128,12 +131,23 @@ bool BaseCluster::is_handle_for(std::shared_ptr<BaseTree::Internal::Vertex> v) {
 std::ostream& BaseCluster::ToString(std::ostream& o) const {
 	return o << "BaseCluster - endpoints " << *boundary_left->data << ", " << *boundary_right->data;
 }
+void BaseCluster::remove_base_handle(std::shared_ptr<BaseTree::Internal::Vertex> v, int index) {
+	auto &handles = v->base_handles;
+	handles[index] = handles.back();
+	handles.pop_back();
+	if (index == (int) handles.size()) return;
+
+	// Repair index of the moved handle
+	auto moved = static_cast<BaseCluster*>(handles[index].get());
+	if (moved->edge->from == v) moved->from_handles_index = index;
+	else moved->to_handles_index = index;
+}
 std::ostream& BaseCluster::_short_name(std::ostream& o) const {
 	return o << *boundary_left->data << "," << *boundary_right->data;
 }
 
 std::shared_ptr<CompressCluster> CompressCluster::construct(std::shared_ptr<STCluster> left, std::shared_ptr<STCluster> right) {
-	auto cluster = std::make_shared<CompressCluster>();
+	auto cluster = allocate<CompressCluster>(left->functions, left->pool);
 
 	// Basic connections (needed by do_join):
 	cluster->set_left_child(left);
@@ -153,6 +167,7 @@ std::shared_ptr<CompressCluster> CompressCluster::construct(std::shared_ptr<STCl
 }
 void CompressCluster::do_join() {
 	if (!is_splitted || is_deleted) return;
+	TOP_TREE_COUNT(joins, 1);
 
 	#ifdef DEBUG
 		std::cerr << "Joining " << *shared_from_this() << std::endl;
@@ -180,7 +195,7 @@ void CompressCluster::do_join() {
 		right = right_foster_rake;
 	}
 	// 3.2 Normal Join
-	Join(left, right, shared_from_this());
+	functions->Join(*left, *right, *this);
 
 	is_splitted = false;
 }
@@ -190,6 +205,7 @@ void CompressCluster::do_split(std::vector<std::shared_ptr<STCluster>>* splitted
 		std::cerr << "Splitting " << *shared_from_this() << std::endl;
 	#endif
 	if (is_splitted) return;
+	TOP_TREE_COUNT(splits, 1);
 
 	// 1. Log that this cluster will be splitted
 	if (splitted_clusters != NULL) splitted_clusters->push_back(shared_from_this());
@@ -206,10 +222,10 @@ void CompressCluster::do_split(std::vector<std::shared_ptr<STCluster>>* splitted
 	// 3.2 Normal Split
 	left->correct_endpoints();
 	right->correct_endpoints();
-	Split(left, right, shared_from_this());
+	functions->Split(*left, *right, *this);
 	// 3.3 If there are foster children Split virtual rake nodes
-	if (left_foster != NULL) Split(left_foster, left_child, left);
-	if (right_foster != NULL) Split(right_foster, right_child, right);
+	if (left_foster != NULL) functions->Split(*left_foster, *left_child, *left);
+	if (right_foster != NULL) functions->Split(*right_foster, *right_child, *right);
 
 	is_splitted = true;
 }
@@ -312,7 +328,7 @@ std::ostream& CompressCluster::_short_name(std::ostream& o) const {
 
 
 std::shared_ptr<RakeCluster> RakeCluster::construct(std::shared_ptr<STCluster> rake_from, std::shared_ptr<STCluster> rake_to, bool virtual_cluster) {
-	auto cluster = std::make_shared<RakeCluster>();
+	auto cluster = allocate<RakeCluster>(rake_from->functions, rake_from->pool);
 
 	// Basic connections (needed by do_join):
 	if (virtual_cluster) {
@@ -330,6 +346,7 @@ std::shared_ptr<RakeCluster> RakeCluster::construct(std::shared_ptr<STCluster> r
 }
 void RakeCluster::do_join() {
 	if (!is_splitted || is_deleted) return;
+	TOP_TREE_COUNT(joins, 1);
 
 	// nicknames
 	auto rake_from = left_child;
@@ -347,7 +364,7 @@ void RakeCluster::do_join() {
 	#endif
 
 	// 3. Call user defined method:
-	Join(rake_from, rake_to, shared_from_this());
+	functions->Join(*rake_from, *rake_to, *this);
 
 	is_splitted = false;
 }
@@ -357,6 +374,7 @@ void RakeCluster::do_split(std::vector<std::shared_ptr<STCluster>>* splitted_clu
 		std::cerr << "Splitting " << *shared_from_this() << std::endl;
 	#endif
 	if (is_splitted) return;
+	TOP_TREE_COUNT(splits, 1);
 
 	// 1. Log that this cluster will be splitted
 	if (splitted_clusters != NULL) splitted_clusters->push_back(shared_from_this());
@@ -367,7 +385,7 @@ void RakeCluster::do_split(std::vector<std::shared_ptr<STCluster>>* splitted_clu
 	// 3. Call user defined method:
 	left_child->correct_endpoints();
 	right_child->correct_endpoints();
-	Split(left_child, right_child, shared_from_this());
+	functions->Split(*left_child, *right_child, *this);
 
 	is_splitted = true;
 }
@@ -1,11 +1,14 @@
 #include <queue>
+#include <array>
 #include <vector>
 #include <sstream>
+#include <fstream>
 
 #include "ClusterInterface.hpp"
 #include "STTopTree.hpp"
 #include "BaseTreeInternal.hpp"
 #include "STCluster.hpp"
+#include "Statistics.hpp"
 
 //#define DEBUG
 //#define DEBUG_GRAPHVIZ
@@ -18,6 +21,11 @@ namespace TopTree {
 // Hide data from .hpp file using PIMP idiom
 class STTopTree::Internal {
 public:
+	Internal(std::shared_ptr<IUserFunctions> functions): functions{functions} {}
+
+	std::shared_ptr<IUserFunctions> functions;
+	std::shared_ptr<ClusterPool> pool = std::make_shared<ClusterPool>(); // destroyed after the last cluster
+
 	std::list<std::shared_ptr<STCluster>> root_clusters;
 	std::shared_ptr<BaseTree> base_tree;
 
@@ -29,8 +37,12 @@ public:
 
 	std::vector<std::shared_ptr<STCluster>> splitted_clusters;
 	std::vector<std::shared_ptr<CompressCluster>> hard_expose_transformed_clusters;
+	// Scratch lists of splice (kept between calls so they do not allocate, always empty outside of splice)
+	std::vector<std::shared_ptr<STCluster>> splice_left_nodes;
+	std::vector<std::shared_ptr<STCluster>> splice_right_nodes;
 
 	std::shared_ptr<STCluster> get_handle(std::shared_ptr<BaseTree::Internal::Vertex> v);
+	std::shared_ptr<STCluster> find_root(const std::shared_ptr<BaseTree::Internal::Vertex>& v);
 
 	// Debug methods:
 	#ifdef DEBUG
@@ -45,20 +57,20 @@ public:
 	void recursive_delete_cluster(std::shared_ptr<STCluster> cluster);
 private:
 	int graphviz_counter = 0;
-	void adjust_parent(std::shared_ptr<STCluster> parent, std::shared_ptr<STCluster> old_child, std::shared_ptr<STCluster> new_child);
+	void adjust_parent(const std::shared_ptr<STCluster>& parent, const std::shared_ptr<STCluster>& old_child, const std::shared_ptr<STCluster>& new_child);
 	void rotate_left(std::shared_ptr<STCluster> x);
 	void rotate_right(std::shared_ptr<STCluster> x);
 
-	void splice(std::shared_ptr<STCluster> node);
+	void splice(const std::shared_ptr<STCluster>& node);
 
 	void soft_expose_handle(std::shared_ptr<STCluster> handle, std::shared_ptr<STCluster> splay_guard = NULL);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-STTopTree::STTopTree() : internal{std::make_unique<Internal>()} {}
+STTopTree::STTopTree(std::shared_ptr<IUserFunctions> functions) : internal{std::make_unique<Internal>(functions)} {}
 
-STTopTree::STTopTree(std::shared_ptr<BaseTree> baseTree) : STTopTree() {
+STTopTree::STTopTree(std::shared_ptr<IUserFunctions> functions, std::shared_ptr<BaseTree> baseTree) : STTopTree(functions) {
 	InitFromBaseTree(baseTree);
 }
 
@@ -67,6 +79,14 @@ STTopTree::~STTopTree() {
 		internal->recursive_delete_cluster(root_cluster);
 	}
 	internal->root_clusters.clear();
+
+	// Base tree may outlive us, its vertices must not hold clusters from our pool
+	if (internal->base_tree != NULL) {
+		for (auto v: internal->base_tree->internal->vertices) {
+			v->base_handles.clear();
+			v->last_handle = NULL;
+		}
+	}
 }
 
 void STTopTree::InitFromBaseTree(std::shared_ptr<BaseTree> baseTree) {
@@ -87,12 +107,17 @@ void STTopTree::InitFromBaseTree(std::shared_ptr<BaseTree> baseTree) {
 }
 
 void STTopTree::Internal::recursive_delete_cluster(std::shared_ptr<STCluster> cluster) {
-	if (cluster == NULL) return;
-	recursive_delete_cluster(cluster->left_foster);
-	recursive_delete_cluster(cluster->left_child);
-	recursive_delete_cluster(cluster->right_foster);
-	recursive_delete_cluster(cluster->right_child);
-	cluster->unlink();
+	std::vector<std::shared_ptr<STCluster>> stack{cluster};
+	while (!stack.empty()) {
+		cluster = stack.back();
+		stack.pop_back();
+		if (cluster == NULL) continue;
+		stack.push_back(cluster->left_foster);
+		stack.push_back(cluster->left_child);
+		stack.push_back(cluster->right_foster);
+		stack.push_back(cluster->right_child);
+		cluster->unlink();
+	}
 }
 
 #ifdef DEBUG
@@ -185,6 +210,7 @@ void STTopTree::Internal::print_graphviz(const std::shared_ptr<STCluster> root,
 // Soft and hard expose related functions
 
 std::shared_ptr<ICluster> STTopTree::Expose(int v, int w) {
+	TOP_TREE_COUNT(exposes, 1);
 	Restore();
 
 	if (v == w) {
@@ -205,8 +231,37 @@ std::shared_ptr<ICluster> STTopTree::Expose(int v, int w) {
 	return internal->hard_expose(vertexV, vertexW);
 }
 
+bool STTopTree::Connected(int v, int w) const {
+	if (v == w) return true;
+	auto root = internal->find_root(internal->base_tree->internal->vertices[v]);
+	return (root != NULL && root == internal->find_root(internal->base_tree->internal->vertices[w]));
+}
+
+std::shared_ptr<ICluster> STTopTree::FindRoot(int v) const {
+	return internal->find_root(internal->base_tree->internal->vertices[v]);
+}
+
+std::shared_ptr<STCluster> STTopTree::Internal::find_root(const std::shared_ptr<BaseTree::Internal::Vertex>& v) {
+	auto handle = get_handle(v);
+	if (handle == NULL) return NULL;
+	auto root = handle;
+	while (root->parent != NULL) root = root->parent;
+
+	// Pay for the climb by soft expose of the handle with the root as a splay guard: it is amortized O(log n) as in
+	// other operations and the root stays the same cluster (roots are used as component identifiers). Not done while
+	// some hard expose is not restored, splaying would break the exposed cluster.
+	if (handle != root && hard_expose_transformed_clusters.empty()) {
+		splitted_clusters.clear();
+		soft_expose_handle(handle, root);
+		root->do_join();
+		splitted_clusters.clear();
+	}
+	return root;
+}
+
 std::shared_ptr<STCluster> STTopTree::Internal::get_handle(std::shared_ptr<BaseTree::Internal::Vertex> v) {
 	if (v->base_handles.size() == 0) return NULL;
+	TOP_TREE_COUNT(get_handle_calls, 1);
 
 	if (v->last_handle == NULL || !v->last_handle->is_handle_for(v)) v->last_handle = v->base_handles.front();
 
@@ -214,14 +269,16 @@ std::shared_ptr<STCluster> STTopTree::Internal::get_handle(std::shared_ptr<BaseT
 	while (true) {
 		auto parent = v->last_handle->parent;
 		while (parent != NULL && parent->isRake()) parent = parent->parent;
-		if (parent != NULL && parent->is_handle_for(v)) v->last_handle = parent;
-		else break;
+		if (parent != NULL && parent->is_handle_for(v)) {
+			v->last_handle = parent;
+			TOP_TREE_COUNT(get_handle_climbs, 1);
+		} else break;
 	}
 	return v->last_handle;
 }
 
 // A. Splaying
-void STTopTree::Internal::adjust_parent(std::shared_ptr<STCluster> parent, std::shared_ptr<STCluster> old_child, std::shared_ptr<STCluster> new_child) {
+void STTopTree::Internal::adjust_parent(const std::shared_ptr<STCluster>& parent, const std::shared_ptr<STCluster>& old_child, const std::shared_ptr<STCluster>& new_child) {
 	// Ensure that both children are splitted before any action
 	new_child->do_split(&splitted_clusters);
 	old_child->do_split(&splitted_clusters);
@@ -247,6 +304,7 @@ void STTopTree::Internal::adjust_parent(std::shared_ptr<STCluster> parent, std::
 //   A   y    ->    x    C
 //      B C        A B
 void STTopTree::Internal::rotate_left(std::shared_ptr<STCluster> x) {
+	TOP_TREE_COUNT(rotations, 1);
 	auto parent = x->parent;
 	auto y = x->right_child;
 	// Ensure splitted
@@ -273,6 +331,7 @@ void STTopTree::Internal::rotate_left(std::shared_ptr<STCluster> x) {
 //   y   C    ->    A    x
 //  A B                 B C
 void STTopTree::Internal::rotate_right(std::shared_ptr<STCluster> x) {
+	TOP_TREE_COUNT(rotations, 1);
 	auto parent = x->parent;
 	auto y = x->left_child;
 	// Ensure splitted
@@ -315,11 +374,18 @@ void STTopTree::Internal::guarded_splay(std::shared_ptr<STCluster> node, std::sh
 			else rotate_left(node->parent);
 			return;
 		}
-		// Zig-Zag rotate or Zig-Zig rotate
-		// 1. step
-		if (node == node->parent->left_child) rotate_right(node->parent);
-		else rotate_left(node->parent);
-		// 2. step
+		bool node_left = (node == node->parent->left_child);
+		bool parent_left = (node->parent == node->parent->parent->left_child);
+		if (node_left == parent_left) {
+			// Zig-Zig rotate: grandparent first (rotating twice at the parent would only move the node to the root,
+			// which is not amortized O(log n))
+			if (node_left) rotate_right(node->parent->parent);
+			else rotate_left(node->parent->parent);
+		} else {
+			// Zig-Zag rotate: parent first
+			if (node_left) rotate_right(node->parent);
+			else rotate_left(node->parent);
+		}
 		if (node == node->parent->left_child) rotate_right(node->parent);
 		else rotate_left(node->parent);
 	}
@@ -327,9 +393,10 @@ void STTopTree::Internal::guarded_splay(std::shared_ptr<STCluster> node, std::sh
 
 // B. Splicing
 // Splicing occur only after splaying -> at most two rake nodes to the root of some compress tree
-void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
-	auto left_nodes = std::vector<std::shared_ptr<STCluster>>();
-	auto right_nodes = std::vector<std::shared_ptr<STCluster>>();
+void STTopTree::Internal::splice(const std::shared_ptr<STCluster>& node) {
+	TOP_TREE_COUNT(splices, 1);
+	auto& left_nodes = splice_left_nodes;
+	auto& right_nodes = splice_right_nodes;
 
 	#ifdef DEBUG
 		std::cerr << "Splicing " << *node << std::endl;
@@ -383,7 +450,7 @@ void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
 	// 3. construct new left and right foster trees
 	std::shared_ptr<STCluster> new_left_foster = NULL;
 	if (!left_nodes.empty()) {
-		new_left_foster = left_nodes.back();
+		new_left_foster = std::move(left_nodes.back());
 		left_nodes.pop_back();
 		new_left_foster->correct_endpoints();
 
@@ -392,7 +459,7 @@ void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
 		#endif
 
 		while (!left_nodes.empty()) {
-			auto right = left_nodes.back();
+			auto right = std::move(left_nodes.back());
 			left_nodes.pop_back();
 			right->correct_endpoints();
 
@@ -400,7 +467,7 @@ void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
 				std::cerr << " - next left rake is " << *right << std::endl;
 			#endif
 
-			auto temp = std::make_shared<RakeCluster>();
+			auto temp = STCluster::allocate<RakeCluster>(functions.get(), pool.get());
 
 			temp->set_left_child(new_left_foster);
 			temp->set_right_child(right);
@@ -417,7 +484,7 @@ void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
 	// The same for right nodes
 	std::shared_ptr<STCluster> new_right_foster = NULL;
 	if (!right_nodes.empty()) {
-		new_right_foster = right_nodes.back();
+		new_right_foster = std::move(right_nodes.back());
 		right_nodes.pop_back();
 		new_right_foster->correct_endpoints();
 
@@ -426,7 +493,7 @@ void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
 		#endif
 
 		while (!right_nodes.empty()) {
-			auto left = right_nodes.back();
+			auto left = std::move(right_nodes.back());
 			right_nodes.pop_back();
 			left->correct_endpoints();
 
@@ -434,7 +501,7 @@ void STTopTree::Internal::splice(std::shared_ptr<STCluster> node) {
 				std::cerr << " - next right rake is " << *left << std::endl;
 			#endif
 
-			auto temp = std::make_shared<RakeCluster>();
+			auto temp = STCluster::allocate<RakeCluster>(functions.get(), pool.get());
 
 			temp->set_right_child(new_right_foster);
 			temp->set_left_child(left);
@@ -542,7 +609,7 @@ void STTopTree::Internal::soft_expose_handle(std::shared_ptr<STCluster> N, std::
 	guarded_splay(N, extern_splay_guard);
 
 	// 4. Restore all clusters
-	for (auto c: splitted_clusters) c->do_join();
+	for (auto &c: splitted_clusters) c->do_join();
 }
 
 void STTopTree::Internal::soft_expose(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w) {
@@ -677,6 +744,15 @@ std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr
 	#ifdef DEBUG
 		std::cerr << "[Cut of " << *v->data << ", " << *w->data << "]" << std::endl;
 	#endif
+	// Vertices not linked by an edge are found by the edge index without splaying
+	if (internal->base_tree->internal->find_edge(v_index, w_index) == NULL) {
+		#ifdef WARNINGS
+			std::cerr << "WARNING: Vertices " << *v << " and " << *w << " are not linked by an edge, it cannot be cutted" << std::endl;
+		#endif
+		auto Nw = internal->get_handle(w);
+		auto Nv = internal->get_handle(v);
+		return std::make_tuple(Nw, Nv, (std::shared_ptr<EdgeData>)NULL);
+	}
 	internal->soft_expose(v, w);
 	auto Nw = internal->get_handle(w);
 	auto Nv = internal->get_handle(v);
@@ -814,10 +890,11 @@ std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr
 	// Remove edge from underlying Base tree
 	auto baseNode = std::dynamic_pointer_cast<BaseCluster>(node);
 	baseNode->unregister();
+	internal->base_tree->internal->unindex_edge(v_index, w_index);
 	// Node will be deleted by garbage collector
 
 	// Restore all clusters
-	for (auto c: internal->splitted_clusters) c->do_join();
+	for (auto &c: internal->splitted_clusters) c->do_join();
 	internal->splitted_clusters.clear();
 
 	return std::make_tuple(first, second, edge_data);
@@ -866,7 +943,8 @@ std::shared_ptr<ICluster> STTopTree::Link(int v_index, int w_index, std::shared_
 	// 2. Make new base cluster
 	auto edge = std::make_shared<BaseTree::Internal::Edge>(v, w, edge_data);
 	edge->register_at_vertices();
-	auto edge_cluster = BaseCluster::construct(edge);
+	internal->base_tree->internal->index_edge(v_index, w_index, edge);
+	auto edge_cluster = BaseCluster::construct(edge, internal->functions.get(), internal->pool.get());
 
 	// 2. If joining solitary nodes return only the new cluster
 	if (v->degree == 1 && w->degree == 1) {
@@ -922,7 +1000,7 @@ std::shared_ptr<ICluster> STTopTree::Link(int v_index, int w_index, std::shared_
 	}
 
 	// Restore all clusters
-	for (auto c: internal->splitted_clusters) c->do_join();
+	for (auto &c: internal->splitted_clusters) c->do_join();
 
 	return node;
 }
@@ -935,52 +1013,250 @@ std::pair<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>> STTopTree::Split
 	} else return std::make_pair((std::shared_ptr<ICluster>)NULL, (std::shared_ptr<ICluster>)NULL);
 }
 
-////////////////////////////////////////////////////////////////////////////////
+void STTopTree::Save(const std::string& path, IDataSerializer& serializer) {
+	Restore();
 
-std::shared_ptr<STCluster> STTopTree::Internal::construct_cluster(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> e) {
-	std::queue<std::shared_ptr<STCluster>> path;
-	std::queue<std::shared_ptr<STCluster>> rake_list;
+	std::ofstream o(path, std::ios::binary);
+	writeHeader(o, SerializedEngine::ST);
 
-	auto v_backup = v;
+	// 1. Base tree
+	std::unordered_map<BaseTree::Internal::Vertex*, int> vertex_ids;
+	std::unordered_map<BaseTree::Internal::Edge*, int> edge_ids;
+	internal->base_tree->internal->save(o, serializer, vertex_ids, edge_ids);
+
+	// 2. Number all clusters under the current roots (parents are before their children)
+	std::unordered_map<STCluster*, int> cluster_ids;
+	std::vector<std::shared_ptr<STCluster>> clusters;
+	std::vector<int> roots;
+	for (auto v: internal->base_tree->internal->vertices) {
+		for (auto handle: v->base_handles) {
+			std::shared_ptr<STCluster> root = handle;
+			while (root->parent != NULL) root = root->parent;
+			if (cluster_ids.find(root.get()) != cluster_ids.end()) continue;
+			root->do_join(); // saved cluster data must be up to date
+
+			roots.push_back(clusters.size());
+			std::vector<std::shared_ptr<STCluster>> stack{root};
+			while (!stack.empty()) {
+				auto cluster = stack.back();
+				stack.pop_back();
+				if (cluster == NULL) continue;
+				cluster_ids[cluster.get()] = clusters.size();
+				clusters.push_back(cluster);
+				stack.push_back(cluster->left_foster);
+				stack.push_back(cluster->left_child);
+				stack.push_back(cluster->right_foster);
+				stack.push_back(cluster->right_child);
+			}
+		}
+	}
 
-	// #ifdef DEBUG
-	// 	std::cerr << "Constructing path from vertex " << *v->data << std::endl;
-	// #endif
+	// 3. Clusters
+	auto vertex_id = [&vertex_ids](const std::shared_ptr<BaseTree::Internal::Vertex>& v) { return (v == NULL ? -1 : vertex_ids[v.get()]); };
+	auto cluster_id = [&cluster_ids](const std::shared_ptr<STCluster>& c) { return (c == NULL ? -1 : cluster_ids[c.get()]); };
+	writeValue<int32_t>(o, clusters.size());
+	for (auto &c: clusters) {
+		writeValue<int32_t>(o, c->isBase() ? 0 : (c->isCompress() ? 1 : 2));
+		writeValue<int32_t>(o, cluster_id(c->parent));
+		writeValue<int32_t>(o, cluster_id(c->left_child));
+		writeValue<int32_t>(o, cluster_id(c->right_child));
+		writeValue<int32_t>(o, cluster_id(c->left_foster));
+		writeValue<int32_t>(o, cluster_id(c->right_foster));
+		writeValue<int32_t>(o, vertex_id(c->boundary_left));
+		writeValue<int32_t>(o, vertex_id(c->boundary_right));
+		if (c->isBase()) writeValue<int32_t>(o, edge_ids[std::static_pointer_cast<BaseCluster>(c)->edge.get()]);
+		if (c->isCompress()) {
+			auto compress = std::static_pointer_cast<CompressCluster>(c);
+			writeValue<int32_t>(o, vertex_id(c->common_vertex));
+			// (virtual rake clusters of fosters get their boundaries from the children when loading)
+			if (c->left_foster != NULL) serializer.SaveClusterData(o, *compress->left_foster_rake);
+			if (c->right_foster != NULL) serializer.SaveClusterData(o, *compress->right_foster_rake);
+		}
+		serializer.SaveClusterData(o, *c);
+	}
 
-	auto next_v = v;
-	auto next_e = e;
+	writeValue<int32_t>(o, roots.size());
+	for (auto r: roots) writeValue<int32_t>(o, r);
+	// (base handles in their order, so the loaded tree finds the same handles)
+	for (auto v: internal->base_tree->internal->vertices) {
+		writeValue<int32_t>(o, v->base_handles.size());
+		for (auto &handle: v->base_handles) writeValue<int32_t>(o, cluster_id(handle));
+	}
 
-	// A. Find some path, create base clusters from edges of this path,
-	// recursively construct all other clusters and rake them onto base clusters
-	while (v != NULL) {
-		v->used = true;
-		next_v = NULL;
+	if (!o) {
+		std::cerr << "ERROR: Cannot write top tree into " << path << std::endl;
+		exit(1);
+	}
+}
+
+void STTopTree::Load(const std::string& path, IDataSerializer& serializer) {
+	if (internal->base_tree != NULL) {
+		std::cerr << "ERROR: Top tree is already initialized, it cannot be loaded" << std::endl;
+		exit(1);
+	}
+	std::ifstream i(path, std::ios::binary);
+	if (!i) {
+		std::cerr << "ERROR: Cannot read top tree from " << path << std::endl;
+		exit(1);
+	}
+	readHeader(i, SerializedEngine::ST);
+
+	// 1. Base tree
+	internal->base_tree = std::make_shared<BaseTree>();
+	std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> vertices;
+	std::vector<std::shared_ptr<BaseTree::Internal::Edge>> edges;
+	internal->base_tree->internal->load(i, serializer, vertices, edges);
+
+	// 2. Clusters (children are set when all clusters exist)
+	auto functions = internal->functions.get();
+	auto pool = internal->pool.get();
+	std::vector<std::shared_ptr<STCluster>> clusters(readCount(i, remainingBytes(i) / (8 * sizeof(int32_t))));
+	std::vector<std::array<int32_t, 5>> links(clusters.size()); // parent, left and right child, left and right foster
+	auto load_virtual_rake = [&]() {
+		auto rake = STCluster::allocate<RakeCluster>(functions, pool);
+		serializer.LoadClusterData(i, *rake);
+		rake->is_splitted = false;
+		return rake;
+	};
+	for (size_t j = 0; j < clusters.size(); j++) {
+		int32_t type = readValue<int32_t>(i);
+		if (type == 0) clusters[j] = STCluster::allocate<BaseCluster>(functions, pool);
+		else if (type == 1) clusters[j] = STCluster::allocate<CompressCluster>(functions, pool);
+		else if (type == 2) clusters[j] = STCluster::allocate<RakeCluster>(functions, pool);
+		else readError("unknown cluster type");
+		auto &c = clusters[j];
+		for (auto &id: links[j]) id = readId(i, clusters.size());
+		c->boundary_left = vertices[readId(i, vertices.size(), false)];
+		c->boundary_right = vertices[readId(i, vertices.size(), false)];
+		if (type == 0) std::static_pointer_cast<BaseCluster>(c)->edge = edges[readId(i, edges.size(), false)];
+		if (type == 1) {
+			auto compress = std::static_pointer_cast<CompressCluster>(c);
+			c->common_vertex = vertices[readId(i, vertices.size(), false)];
+			if (links[j][3] >= 0) compress->left_foster_rake = load_virtual_rake();
+			if (links[j][4] >= 0) compress->right_foster_rake = load_virtual_rake();
+		}
+		serializer.LoadClusterData(i, *c);
+		c->is_splitted = false;
+	}
+
+	auto get_cluster = [&clusters](int id) { return (id < 0 ? NULL : clusters[id]); };
+	for (size_t j = 0; j < clusters.size(); j++) {
+		auto &c = clusters[j];
+		c->parent = get_cluster(links[j][0]);
+		c->left_child = get_cluster(links[j][1]);
+		c->right_child = get_cluster(links[j][2]);
+		c->left_foster = get_cluster(links[j][3]);
+		c->right_foster = get_cluster(links[j][4]);
+	}
+	for (auto &c: clusters) {
+		// Base clusters are leaves, compress clusters have both children, rake clusters have no fosters
+		bool children = (c->left_child != NULL && c->right_child != NULL);
+		bool fosters = (c->left_foster != NULL || c->right_foster != NULL);
+		if (c->isBase() ? (c->left_child != NULL || c->right_child != NULL || fosters) : (!children || (c->isRake() && fosters))) readError("wrong cluster children");
+		for (auto &child: {c->left_child, c->right_child, c->left_foster, c->right_foster}) {
+			if (child != NULL && child->parent != c) readError("wrong cluster parent");
+		}
+
+		// Virtual rake clusters of fosters have only oneside links (as in RakeCluster::construct)
+		if (c->isCompress()) {
+			auto compress = std::static_pointer_cast<CompressCluster>(c);
+			auto set_virtual_rake = [](const std::shared_ptr<RakeCluster>& rake, const std::shared_ptr<STCluster>& foster, const std::shared_ptr<STCluster>& child) {
+				if (rake == NULL) return;
+				rake->left_child = foster;
+				rake->right_child = child;
+				rake->correct_endpoints();
+			};
+			set_virtual_rake(compress->left_foster_rake, c->left_foster, c->left_child);
+			set_virtual_rake(compress->right_foster_rake, c->right_foster, c->right_child);
+		}
+	}
+
+	// 3. Roots and base handles
+	int32_t roots = readCount(i, clusters.size());
+	for (int32_t r = 0; r < roots; r++) {
+		auto root = clusters[readId(i, clusters.size(), false)];
+		if (root->parent != NULL) readError("root cluster has parent");
+		internal->root_clusters.push_back(root);
+		root->root_clusters_iterator = std::prev(internal->root_clusters.end());
+	}
+	std::vector<int> registrations(clusters.size(), 0);
+	for (auto &v: internal->base_tree->internal->vertices) {
+		int32_t handles = readCount(i, clusters.size());
+		if (handles != v->degree) readError("wrong number of base handles");
+		for (int32_t h = 0; h < handles; h++) {
+			int32_t id = readId(i, clusters.size(), false);
+			if (!clusters[id]->isBase()) readError("base handle is not base cluster");
+			auto base = std::static_pointer_cast<BaseCluster>(clusters[id]);
+			if (base->edge->from == v) base->from_handles_index = h;
+			else if (base->edge->to == v) base->to_handles_index = h;
+			else readError("base handle without the vertex");
+			base->handles_registered = true;
+			registrations[id]++;
+			v->base_handles.push_back(base);
+		}
+	}
+	for (size_t j = 0; j < clusters.size(); j++) {
+		if (clusters[j]->isBase() && registrations[j] != 2) readError("base cluster is not registered at its endpoints");
+	}
+}
 
+////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<STCluster> STTopTree::Internal::construct_cluster(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> e) {
+	// Every path of the decomposition has its own frame on the explicit stack (instead of recursion, the tree could
+	// be very deep), top tree of the subtree is raked onto the path in the parent frame when its frame is finished
+	struct path_frame {
+		std::shared_ptr<BaseTree::Internal::Vertex> v;
+		std::shared_ptr<BaseTree::Internal::Edge> e;
+		std::shared_ptr<BaseTree::Internal::Vertex> next_v;
+		std::shared_ptr<BaseTree::Internal::Edge> next_e;
+		std::shared_ptr<STCluster> path_cluster;
+		size_t next_neighbour;
+		std::queue<std::shared_ptr<STCluster>> path;
+		std::queue<std::shared_ptr<STCluster>> rake_list;
+	};
+	std::vector<path_frame> stack;
+
+	// A. Find some path, create base clusters from edges of this path,
+	// construct all other clusters and rake them onto base clusters
+	auto start_vertex = [&](path_frame& f) {
+		f.v->used = true;
+		f.next_v = NULL;
+		f.next_neighbour = 0;
 		// 1. Construct BaseCluster if there was edge given
-		std::shared_ptr<STCluster> path_cluster = (e != NULL ? BaseCluster::construct(e) : NULL);
-
-		// 2. Select continuation and recursive construct top trees on subtrees
-		for (auto n : v->neighbours) {
-			if (auto ee = n.edge.lock()) {
-				auto vv = ee->from;
-				if (vv == v) vv = ee->to;
-				if (vv->used) continue;
-				if (next_v == NULL) {
-					// Use this as continuation of path
-					next_v = vv;
-					next_e = ee;
-				} else {
-					// Recursively construct top tree on subtree
-					rake_list.push(construct_cluster(vv, ee));
-				}
+		f.path_cluster = (f.e != NULL ? BaseCluster::construct(f.e, functions.get(), pool.get()) : NULL);
+	};
+	stack.push_back(path_frame{v, e});
+	start_vertex(stack.back());
+
+	while (true) {
+		auto& f = stack.back();
+
+		// 2. Select continuation and construct top trees on subtrees (in the new frames)
+		if (f.next_neighbour < f.v->neighbours.size()) {
+			auto ee = f.v->neighbours[f.next_neighbour++].edge.lock();
+			if (ee == NULL) continue;
+			auto vv = ee->from;
+			if (vv == f.v) vv = ee->to;
+			if (vv->used) continue;
+			if (f.next_v == NULL) {
+				// Use this as continuation of path
+				f.next_v = vv;
+				f.next_e = ee;
+			} else {
+				// Construct top tree on subtree (invalidates f)
+				stack.push_back(path_frame{vv, ee});
+				start_vertex(stack.back());
 			}
+			continue;
 		}
 
 		// 3. Rake all top trees from rake list to rake tree,
 		// connect the rake tree as foster child to the path edge
 		// and add path edge into path
-		if (path_cluster != NULL) {
+		if (f.path_cluster != NULL) {
 			// 3.1 Rake all edges into rake tree
+			auto& rake_list = f.rake_list;
 			std::queue<std::shared_ptr<STCluster>> rake_list_new;
 			while (rake_list.size() > 1) {
 				while (rake_list.size() > 0) {
@@ -1003,42 +1279,46 @@ std::shared_ptr<STCluster> STTopTree::Internal::construct_cluster(std::shared_pt
 				rake_list.pop();
 
 				// Only use one side (left)
-				v->rake_tree_left = rake_tree;
+				f.v->rake_tree_left = rake_tree;
 			}
 			// 3.3 Push cluster with edge into path
-			path.push(path_cluster);
+			f.path.push(f.path_cluster);
 		}
 
 		// 4. Move to the next vertex on path
-		v = next_v;
-		e = next_e;
-	}
+		if (f.next_v != NULL) {
+			f.v = f.next_v;
+			f.e = f.next_e;
+			start_vertex(f);
+			continue;
+		}
 
-	// B. Compress all clusters into one compress cluster
-	std::queue<std::shared_ptr<STCluster>> path_new;
-	while (path.size() > 1) {
-		while (path.size() > 0) {
-			if (path.size() == 1) {
-				path_new.push(path.front());
-				path.pop();
-			} else {
-				auto left = path.front();
-				path.pop();
-				auto right = path.front();
-				path.pop();
+		// B. Compress all clusters into one compress cluster
+		auto& path = f.path;
+		std::queue<std::shared_ptr<STCluster>> path_new;
+		while (path.size() > 1) {
+			while (path.size() > 0) {
+				if (path.size() == 1) {
+					path_new.push(path.front());
+					path.pop();
+				} else {
+					auto left = path.front();
+					path.pop();
+					auto right = path.front();
+					path.pop();
 
-				// Construct compress cluster and push it into the path
-				path_new.push(CompressCluster::construct(left, right));
+					// Construct compress cluster and push it into the path
+					path_new.push(CompressCluster::construct(left, right));
+				}
 			}
+			path.swap(path_new);
 		}
-		path.swap(path_new);
-	}
 
-	// #ifdef DEBUG
-	// 	std::cerr << "Construction of path from vertex " << *v_backup->data << " ended" << std::endl;
-	// #endif
-
-	return path.front();
+		auto result = path.front();
+		stack.pop_back();
+		if (stack.empty()) return result;
+		stack.back().rake_list.push(result);
+	}
 }
 
 }
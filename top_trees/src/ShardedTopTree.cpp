@@ -0,0 +1,294 @@
+#include <iostream>
+#include <vector>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "ShardedTopTree.hpp"
+#include "ThreadPool.hpp"
+
+//#define DEBUG
+
+namespace TopTree {
+
+class ShardedTopTree::Internal {
+public:
+	struct shard {
+		std::shared_ptr<ITopTree> top_tree;
+		std::shared_ptr<BaseTree> base_tree;
+		int vertices = 0; // number of vertices placed here (without the moved ones)
+		std::vector<int> free_indexes; // isolated vertices left in the base tree by moved trees (reused by new ones)
+
+		std::vector<size_t> queue; // indexes of operations for Apply
+		std::atomic<bool> pending{false};
+	};
+	struct vertex {
+		int shard;
+		int index; // index in the base tree of the shard
+		std::vector<int> neighbours; // global indexes
+	};
+
+	std::vector<std::unique_ptr<shard>> shards;
+	std::vector<vertex> vertices;
+	std::unique_ptr<ThreadPool> workers; // started once for all Apply calls (NULL if there is only one thread)
+
+	std::shared_ptr<ICluster> link(int v, int w, std::shared_ptr<EdgeData> edge_data);
+	std::shared_ptr<EdgeData> cut(int v, int w);
+	void remove_neighbour(int v, int w);
+	// Returns index of new vertex in the base tree of the shard (free index is reused if there is some)
+	int add_vertex(shard& s, std::shared_ptr<VertexData> data);
+
+	// Moves tree of the vertex v into the target shard
+	void move_tree(int v, int target);
+	// Returns which of trees of v and w is smaller (searched alternately so only the smaller one is searched whole)
+	int smaller_tree(int v, int w);
+
+	void run_queue(shard& s, const std::vector<Operation>& operations, std::function<void(size_t, std::shared_ptr<ICluster>)>& callback, std::atomic<int>& applied);
+	void run_queues(const std::vector<Operation>& operations, std::function<void(size_t, std::shared_ptr<ICluster>)>& callback, std::atomic<int>& applied);
+};
+
+ShardedTopTree::ShardedTopTree(std::function<std::shared_ptr<ITopTree>()> make_top_tree, unsigned int shards, unsigned int threads) : internal{std::make_unique<Internal>()} {
+	for (unsigned int i = 0; i < std::max(1u, shards); i++) {
+		auto s = std::make_unique<Internal::shard>();
+		s->top_tree = make_top_tree();
+		s->base_tree = std::make_shared<BaseTree>();
+		s->top_tree->InitFromBaseTree(s->base_tree); // empty for now
+		internal->shards.push_back(std::move(s));
+	}
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min<unsigned int>(threads, internal->shards.size()); // more threads would have no queue to run
+	if (threads > 1) internal->workers = std::make_unique<ThreadPool>(threads);
+}
+
+ShardedTopTree::~ShardedTopTree() {}
+
+int ShardedTopTree::AddVertex(std::shared_ptr<VertexData> data) {
+	int target = 0;
+	for (size_t i = 1; i < internal->shards.size(); i++) {
+		if (internal->shards[i]->vertices < internal->shards[target]->vertices) target = i;
+	}
+	auto& s = *internal->shards[target];
+	s.vertices++;
+	internal->vertices.push_back(Internal::vertex{target, internal->add_vertex(s, data), {}});
+	return internal->vertices.size() - 1;
+}
+
+int ShardedTopTree::GetShard(int v) const {
+	return internal->vertices[v].shard;
+}
+
+std::shared_ptr<ICluster> ShardedTopTree::Expose(int v, int w) {
+	auto& vv = internal->vertices[v];
+	auto& ww = internal->vertices[w];
+	if (vv.shard != ww.shard) return NULL; // different trees
+	return internal->shards[vv.shard]->top_tree->Expose(vv.index, ww.index);
+}
+
+bool ShardedTopTree::Connected(int v, int w) const {
+	auto& vv = internal->vertices[v];
+	auto& ww = internal->vertices[w];
+	if (vv.shard != ww.shard) return false;
+	return internal->shards[vv.shard]->top_tree->Connected(vv.index, ww.index);
+}
+
+std::shared_ptr<EdgeData> ShardedTopTree::Cut(int v, int w) {
+	if (internal->vertices[v].shard != internal->vertices[w].shard) return NULL;
+	return internal->cut(v, w);
+}
+
+std::shared_ptr<ICluster> ShardedTopTree::Link(int v, int w, std::shared_ptr<EdgeData> edge_data) {
+	if (internal->vertices[v].shard != internal->vertices[w].shard) {
+		// Move the smaller tree to the shard of the bigger one
+		if (internal->smaller_tree(v, w) == v) internal->move_tree(v, internal->vertices[w].shard);
+		else internal->move_tree(w, internal->vertices[v].shard);
+	}
+	return internal->link(v, w, edge_data);
+}
+
+int ShardedTopTree::Apply(const std::vector<Operation>& operations, std::function<void(size_t, std::shared_ptr<ICluster>)> callback) {
+	std::atomic<int> applied{0};
+
+	// Operations are done by phases: queues of all shards run in parallel and then the links between shards queued in
+	// this phase move their trees. Moving changes shards of vertices, so operation on a shard of some queued link (or
+	// of an operation postponed before it) is postponed to the next phase, other shards continue with their queues.
+	std::vector<size_t> postponed;
+	std::vector<size_t> links; // links between shards in this phase
+	std::vector<bool> closed(internal->shards.size());
+	size_t next = 0;
+	while (next < operations.size() || !postponed.empty()) {
+		std::fill(closed.begin(), closed.end(), false);
+		size_t closed_count = 0;
+		auto close = [&](int s) {
+			if (!closed[s]) closed_count++;
+			closed[s] = true;
+		};
+		auto schedule = [&](size_t i) {
+			auto &op = operations[i];
+			int v_shard = internal->vertices[op.v].shard;
+			int w_shard = internal->vertices[op.w].shard;
+			if (closed[v_shard] || closed[w_shard]) {
+				postponed.push_back(i);
+				close(v_shard);
+				close(w_shard);
+			} else if (v_shard == w_shard) {
+				internal->shards[v_shard]->queue.push_back(i);
+			} else if (op.type == Operation::LINK) {
+				links.push_back(i);
+				close(v_shard);
+				close(w_shard);
+			} else if (op.type == Operation::EXPOSE && callback != NULL) callback(i, NULL);
+		};
+
+		std::vector<size_t> waiting;
+		waiting.swap(postponed);
+		for (auto i: waiting) schedule(i);
+		while (next < operations.size() && closed_count < closed.size()) schedule(next++);
+
+		internal->run_queues(operations, callback, applied);
+		for (auto i: links) {
+			if (Link(operations[i].v, operations[i].w, operations[i].edge_data) != NULL) applied++;
+		}
+		links.clear();
+	}
+
+	return applied;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<ICluster> ShardedTopTree::Internal::link(int v, int w, std::shared_ptr<EdgeData> edge_data) {
+	auto result = shards[vertices[v].shard]->top_tree->Link(vertices[v].index, vertices[w].index, edge_data);
+	if (result != NULL) {
+		vertices[v].neighbours.push_back(w);
+		vertices[w].neighbours.push_back(v);
+	}
+	return result;
+}
+
+std::shared_ptr<EdgeData> ShardedTopTree::Internal::cut(int v, int w) {
+	auto edge_data = std::get<2>(shards[vertices[v].shard]->top_tree->Cut(vertices[v].index, vertices[w].index));
+	if (edge_data != NULL) {
+		remove_neighbour(v, w);
+		remove_neighbour(w, v);
+	}
+	return edge_data;
+}
+
+void ShardedTopTree::Internal::remove_neighbour(int v, int w) {
+	auto& neighbours = vertices[v].neighbours;
+	auto it = std::find(neighbours.begin(), neighbours.end(), w);
+	if (it == neighbours.end()) return;
+	*it = neighbours.back();
+	neighbours.pop_back();
+}
+
+int ShardedTopTree::Internal::add_vertex(shard& s, std::shared_ptr<VertexData> data) {
+	if (s.free_indexes.empty()) return s.base_tree->AddVertex(data);
+	int index = s.free_indexes.back();
+	s.free_indexes.pop_back();
+	s.base_tree->SetVertexData(index, data);
+	return index;
+}
+
+int ShardedTopTree::Internal::smaller_tree(int v, int w) {
+	// Two DFS run by turns, the first one which visits its whole tree wins
+	std::vector<int> stacks[2] = {{v}, {w}};
+	std::unordered_set<int> visited[2] = {{v}, {w}};
+	while (true) {
+		for (int side = 0; side < 2; side++) {
+			if (stacks[side].empty()) return (side == 0 ? v : w);
+			int x = stacks[side].back();
+			stacks[side].pop_back();
+			for (int y: vertices[x].neighbours) {
+				if (visited[side].insert(y).second) stacks[side].push_back(y);
+			}
+		}
+	}
+}
+
+void ShardedTopTree::Internal::move_tree(int v, int target) {
+	int source = vertices[v].shard;
+	#ifdef DEBUG
+		std::cerr << "Moving tree of " << v << " from shard " << source << " to " << target << std::endl;
+	#endif
+
+	// 1. Find all vertices and edges of the tree
+	std::vector<int> tree{v};
+	std::vector<std::pair<int, int>> edges;
+	std::vector<bool> in_tree(vertices.size(), false);
+	in_tree[v] = true;
+	for (size_t i = 0; i < tree.size(); i++) {
+		for (int y: vertices[tree[i]].neighbours) {
+			if (in_tree[y]) continue;
+			in_tree[y] = true;
+			tree.push_back(y);
+			edges.push_back(std::make_pair(tree[i], y));
+		}
+	}
+
+	// 2. Cut all edges in the old shard (it pushes all data down into EdgeData)
+	std::vector<std::shared_ptr<EdgeData>> edge_data;
+	for (auto &e: edges) edge_data.push_back(cut(e.first, e.second));
+
+	// 3. Add vertices into the new shard (old copies stay there as isolated vertices, their indexes are reused later)
+	for (int x: tree) {
+		auto& old_shard = *shards[source];
+		auto data = old_shard.base_tree->GetVertexData(vertices[x].index);
+		old_shard.base_tree->SetVertexData(vertices[x].index); // (do not hold user data of the moved vertex)
+		old_shard.free_indexes.push_back(vertices[x].index);
+		vertices[x].shard = target;
+		vertices[x].index = add_vertex(*shards[target], data);
+	}
+	shards[source]->vertices -= tree.size();
+	shards[target]->vertices += tree.size();
+
+	// 4. Link edges again
+	for (size_t i = 0; i < edges.size(); i++) link(edges[i].first, edges[i].second, edge_data[i]);
+}
+
+void ShardedTopTree::Internal::run_queue(shard& s, const std::vector<Operation>& operations, std::function<void(size_t, std::shared_ptr<ICluster>)>& callback, std::atomic<int>& applied) {
+	for (auto i: s.queue) {
+		auto &op = operations[i];
+		switch (op.type) {
+		case Operation::LINK:
+			if (link(op.v, op.w, op.edge_data) != NULL) applied++;
+			break;
+		case Operation::CUT:
+			if (cut(op.v, op.w) != NULL) applied++;
+			break;
+		case Operation::EXPOSE: {
+			auto cluster = s.top_tree->Expose(vertices[op.v].index, vertices[op.w].index);
+			if (callback != NULL) callback(i, cluster);
+			break;}
+		}
+	}
+	s.queue.clear();
+}
+
+void ShardedTopTree::Internal::run_queues(const std::vector<Operation>& operations, std::function<void(size_t, std::shared_ptr<ICluster>)>& callback, std::atomic<int>& applied) {
+	size_t busy = 0;
+	for (auto &s: shards) {
+		s->pending = !s->queue.empty();
+		if (s->pending) busy++;
+	}
+	if (busy == 0) return;
+
+	// Worker takes every shard whose queue is still pending, it starts with its own shards (i, i + threads, ...)
+	// and continues with the others
+	auto worker = [&](size_t first) {
+		for (size_t k = 0; k < shards.size(); k++) {
+			auto &s = *shards[(first + k) % shards.size()];
+			if (s.pending.exchange(false)) run_queue(s, operations, callback, applied);
+		}
+	};
+
+	size_t workers_count = (workers == NULL ? 1 : std::min<size_t>(workers->size(), busy));
+	if (workers_count <= 1) {
+		worker(0);
+		return;
+	}
+	workers->run(workers_count, [&](size_t i) { worker(i * shards.size() / workers_count); });
+}
+
+}
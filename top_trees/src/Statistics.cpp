@@ -0,0 +1,25 @@
+#include "Statistics.hpp"
+
+namespace TopTree {
+
+Statistics statistics;
+
+void Statistics::Reset() {
+	for (auto counter: {&exposes, &joins, &splits, &rotations, &splices, &get_handle_calls, &get_handle_climbs,
+		&update_rounds, &update_list_items, &simple_clusters, &simple_cluster_allocations}) counter->store(0);
+}
+
+void Statistics::Print(std::ostream& o) const {
+	uint64_t e = (exposes > 0 ? exposes.load() : 1); // for per expose values
+	o << "exposes: " << exposes << std::endl
+		<< "joins: " << joins << std::endl
+		<< "splits: " << splits << std::endl
+		<< "rotations: " << rotations << std::endl
+		<< "splices: " << splices << std::endl
+		<< "get_handle calls: " << get_handle_calls << " (climbs: " << get_handle_climbs << ")" << std::endl
+		<< "update_clusters rounds: " << update_rounds << " (list items: " << update_list_items << ")" << std::endl
+		<< "simple clusters: " << simple_clusters << " (allocated: " << simple_cluster_allocations << ", "
+		<< (double) simple_clusters / e << " per expose)" << std::endl;
+}
+
+}
@@ -0,0 +1,64 @@
+#include "ThreadPool.hpp"
+
+namespace TopTree {
+
+ThreadPool::ThreadPool(unsigned int threads) {
+	for (unsigned int i = 1; i < threads; i++) workers.push_back(std::thread([this]() { work(); }));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	work_ready.notify_all();
+	for (auto &w: workers) w.join();
+}
+
+void ThreadPool::run(size_t tasks, const std::function<void(size_t)>& f) {
+	if (workers.empty() || tasks <= 1) {
+		for (size_t t = 0; t < tasks; t++) f(t);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &f;
+		job_tasks = tasks;
+		next_task = 0;
+		running = workers.size();
+		generation++;
+	}
+	work_ready.notify_all();
+
+	take_tasks(f, tasks);
+
+	// Workers must leave the job before it is destroyed by the caller
+	std::unique_lock<std::mutex> lock(mutex);
+	work_done.wait(lock, [this]() { return running == 0; });
+	job = NULL;
+}
+
+void ThreadPool::work() {
+	size_t done_generation = 0;
+	while (true) {
+		std::unique_lock<std::mutex> lock(mutex);
+		work_ready.wait(lock, [&]() { return stopping || generation != done_generation; });
+		if (stopping) return;
+		done_generation = generation;
+		auto f = job;
+		size_t tasks = job_tasks;
+		lock.unlock();
+
+		take_tasks(*f, tasks);
+
+		lock.lock();
+		if (--running == 0) work_done.notify_one();
+	}
+}
+
+void ThreadPool::take_tasks(const std::function<void(size_t)>& f, size_t tasks) {
+	for (size_t t = next_task++; t < tasks; t = next_task++) f(t);
+}
+
+}
@@ -1,5 +1,5 @@
-#include "UserFunctions.hpp"
 #include "TopologyCluster.hpp"
+#include "Statistics.hpp"
 
 //#define DEBUG
 
@@ -21,9 +21,9 @@ void SimpleCluster::do_split() {
 
 	if (parent != NULL) parent->do_split();
 
-	if (first != NULL && second != NULL) Split(first, second, shared_from_this());
-	else if (first != NULL) CopyClusterData(shared_from_this(), first); // just copy data
-	else if (edge != NULL && !edge->subvertice_edge) Destroy(shared_from_this(), edge->data);
+	if (first != NULL && second != NULL) functions->Split(*first, *second, *this);
+	else if (first != NULL) functions->CopyClusterData(*this, *first); // just copy data
+	else if (edge != NULL && !edge->subvertice_edge) functions->Destroy(*this, edge->data);
 	else {
 		std::cerr << "Not know what to do with this simple cluster, cannot Split, copy nor Destroy" << std::endl;
 		exit(1);
@@ -34,8 +34,15 @@ void SimpleCluster::do_split() {
 	was_splitted = true;
 }
 
-std::shared_ptr<SimpleCluster> SimpleCluster::construct(std::shared_ptr<ICluster> first, std::shared_ptr<ICluster> second) {
-	auto cluster = std::make_shared<SimpleCluster>();
+std::shared_ptr<SimpleCluster> SimpleCluster::create(IUserFunctions* functions, SimpleClusterPool* pool) {
+	TOP_TREE_COUNT(simple_clusters, 1);
+	if (pool != NULL) return pool->get();
+	TOP_TREE_COUNT(simple_cluster_allocations, 1);
+	return std::make_shared<SimpleCluster>(functions);
+}
+
+std::shared_ptr<SimpleCluster> SimpleCluster::construct(std::shared_ptr<ICluster> first, std::shared_ptr<ICluster> second, IUserFunctions* functions, SimpleClusterPool* pool) {
+	auto cluster = create(functions, pool);
 	cluster->first = first;
 	auto simple_first = std::dynamic_pointer_cast<SimpleCluster>(first);
 	if (simple_first != NULL) simple_first->parent = cluster;
@@ -54,6 +61,30 @@ void SimpleCluster::unlink(bool recursive) {
 	second = NULL;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// SimpleClusterPool
+
+std::shared_ptr<SimpleCluster> SimpleClusterPool::get() {
+	if (free_clusters.empty()) {
+		TOP_TREE_COUNT(simple_cluster_allocations, 1);
+		return std::allocate_shared<SimpleCluster>(PoolAllocator<SimpleCluster>(memory), functions);
+	}
+	auto cluster = std::move(free_clusters.back());
+	free_clusters.pop_back();
+	// User functions may depend on the initial state of the data (Join is not required to overwrite all of it)
+	functions->ResetClusterData(*cluster->data);
+	return cluster;
+}
+
+void SimpleClusterPool::put(std::shared_ptr<SimpleCluster>& cluster) {
+	if (cluster == NULL || cluster.use_count() > 1) return; // still used (e.g. returned from Expose to the user)
+	cluster->unlink();
+	cluster->boundary_left = NULL;
+	cluster->boundary_right = NULL;
+	cluster->was_splitted = false;
+	free_clusters.push_back(std::move(cluster));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /// TopologyCluster
 
@@ -73,6 +104,12 @@ void TopologyCluster::unlink() {
 }
 
 std::shared_ptr<BaseTree::Internal::Vertex> TopologyCluster::get_common_vertex(std::shared_ptr<ICluster> cluster_a, std::shared_ptr<ICluster> cluster_b, bool get_superior) {
+	// Exact match first (both boundaries of a subvertex edge have the same superior vertex, so comparing superior
+	// vertices only cannot tell which of them is the common one)
+	for (auto v: {cluster_a->boundary_left, cluster_a->boundary_right}) {
+		if (v == cluster_b->boundary_left || v == cluster_b->boundary_right) return v;
+	}
+
 	auto common_vertex = cluster_a->boundary_left;
 
 	if (get_superior && common_vertex->superior_vertex != NULL) common_vertex = common_vertex->superior_vertex;
@@ -89,9 +126,9 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyCluster::get_common_vertex(s
 	return common_vertex;
 }
 
-int TopologyCluster::global_index = 0;
+std::atomic<int> TopologyCluster::global_index{0};
 
-TopologyCluster::TopologyCluster() {
+TopologyCluster::TopologyCluster(IUserFunctions* functions, SimpleClusterPool* simple_pool): ICluster(functions), simple_pool{simple_pool} {
 	index = global_index++;
 }
 
@@ -119,6 +156,7 @@ void TopologyCluster::set_second_child(std::shared_ptr<TopologyCluster> child) {
 void TopologyCluster::do_join() {
 	if (!is_splitted) return;
 	if (is_deleted) return;
+	TOP_TREE_COUNT(joins, 1);
 
 	#ifdef DEBUG
 		std::cerr << "Joining " << *shared_from_this() << " (" << shared_from_this() << ")" << std::endl;
@@ -152,7 +190,7 @@ void TopologyCluster::do_join() {
 		edge = NULL;
 		edge_cluster = NULL;
 		//data = first->data;
-		CopyClusterData(first, shared_from_this());
+		functions->CopyClusterData(*first, *this);
 	} else {
 		if (edge == NULL) {
 			std::cerr << "ERROR: Cluster '" << this << "' with both children but without edge between!" << std::endl;
@@ -165,18 +203,29 @@ void TopologyCluster::do_join() {
 		// Normal edge - we Join everything with the edge
 		is_top_cluster = !edge->subvertice_edge || first->is_top_cluster || second->is_top_cluster; // if edge or at least one child is top cluster -> this is top cluster too
 
+		// 0. Return previous edge clusters into the pool, so they are reused when nobody else holds them
+		if (simple_pool != NULL) {
+			auto old_edge_cluster = std::static_pointer_cast<SimpleCluster>(edge_cluster);
+			std::shared_ptr<SimpleCluster> old_combined_edge_cluster = NULL;
+			if (combined_edge_cluster != edge_cluster) old_combined_edge_cluster = std::static_pointer_cast<SimpleCluster>(combined_edge_cluster);
+			edge_cluster = NULL;
+			combined_edge_cluster = NULL;
+			simple_pool->put(old_edge_cluster);
+			simple_pool->put(old_combined_edge_cluster);
+		}
+
 		// 1. Create base cluster for edge
-		edge_cluster = std::make_shared<SimpleCluster>();
+		edge_cluster = SimpleCluster::create(functions, simple_pool);
 		edge_cluster->boundary_left = edge->from;
 		edge_cluster->boundary_right = edge->to;
-		if (!edge->subvertice_edge) Create(edge_cluster, edge->data);
+		if (!edge->subvertice_edge) functions->Create(*edge_cluster, edge->data);
 
 		// 2. Join with the edge first (if there is something to Join)
 		if (first->is_top_cluster) {
 			#ifdef DEBUG
 				std::cerr << "... joining " << *first << " (" << *first->boundary_left << "-" << *first->boundary_right << ") with edge with endpoints " << *edge_cluster->boundary_left << "-" << *edge_cluster->boundary_right << std::endl;
 			#endif
-			combined_edge_cluster = std::make_shared<SimpleCluster>();
+			combined_edge_cluster = SimpleCluster::create(functions, simple_pool);
 			if (first->is_rake_branch) {
 				//if (edge->subvertice_edge) {
 				//	combined_edge_cluster->boundary_left = first->boundary_left;
@@ -188,7 +237,7 @@ void TopologyCluster::do_join() {
 			} else {
 				// It is compress
 				// i) get common vertex
-				auto common_vertex = get_common_vertex(first, edge_cluster, !edge->subvertice_edge);
+				auto common_vertex = get_common_vertex(first, edge_cluster);
 
 				// ii) Get boundary vertices
 				combined_edge_cluster->boundary_left = (common_vertex == first->boundary_left || common_vertex == first->boundary_left->superior_vertex ? first->boundary_right : first->boundary_left);
@@ -196,9 +245,9 @@ void TopologyCluster::do_join() {
 			}
 			if (!edge->subvertice_edge) {
 				//if (first->data == combined_edge_cluster->data || edge_cluster->data == combined_edge_cluster->data) combined_edge_cluster->data = InitClusterData();
-				Join(first, edge_cluster, combined_edge_cluster);
+				functions->Join(*first, *edge_cluster, *combined_edge_cluster);
 			}
-			else CopyClusterData(first, combined_edge_cluster); // combined_edge_cluster->data = first->data;
+			else functions->CopyClusterData(*first, *combined_edge_cluster); // combined_edge_cluster->data = first->data;
 			#ifdef DEBUG
 				std::cerr << "... combined edge have endpoints " << *combined_edge_cluster->boundary_left << "," << *combined_edge_cluster->boundary_right << std::endl;
 			#endif
@@ -217,7 +266,7 @@ void TopologyCluster::do_join() {
 			} else {
 				// It is compress
 				// i) get common vertex
-				auto common_vertex = get_common_vertex(second, combined_edge_cluster, !edge->subvertice_edge || first->is_top_cluster);
+				auto common_vertex = get_common_vertex(second, combined_edge_cluster);
 
 				// ii) Get boundary vertices
 				boundary_left = (common_vertex == second->boundary_left || common_vertex == second->boundary_left->superior_vertex ? second->boundary_right : second->boundary_left);
@@ -232,9 +281,9 @@ void TopologyCluster::do_join() {
 				#endif
 				//if (second->data == data || combined_edge_cluster->data == data) data = InitClusterData();
 				//std::cerr << second << " + " << combined_edge_cluster << " -> " << shared_from_this() << std::endl;
-				Join(second, combined_edge_cluster, shared_from_this());
+				functions->Join(*second, *combined_edge_cluster, *this);
 			}
-			else CopyClusterData(second, shared_from_this()); // data = second->data;
+			else functions->CopyClusterData(*second, *this); // data = second->data;
 
 			#ifdef DEBUG
 				std::cerr << "... cluster have endpoints " << *boundary_left << "," << *boundary_right << std::endl;
@@ -244,7 +293,7 @@ void TopologyCluster::do_join() {
 			boundary_left = combined_edge_cluster->boundary_left;
 			boundary_right = combined_edge_cluster->boundary_right;
 			//data = combined_edge_cluster->data;
-			CopyClusterData(combined_edge_cluster, shared_from_this());
+			functions->CopyClusterData(*combined_edge_cluster, *this);
 		}
 		//}
 	}
@@ -257,11 +306,11 @@ void TopologyCluster::do_join() {
 }
 
 void TopologyCluster::remove_all_outer_edges() {
-	for (auto o: outer_edges) {
+	for (auto &o: outer_edges) {
 		// Remove outer edge from neighbour
 		// bool removed = false;
 		for (uint i = 0; i < o.cluster->outer_edges.size(); i++) {
-			if (o.cluster->outer_edges[i].edge == o.edge && o.cluster->outer_edges[i].cluster == shared_from_this()) {
+			if (o.cluster->outer_edges[i].edge == o.edge && o.cluster->outer_edges[i].cluster.get() == this) {
 				// std::cerr << "Removed edge to " << *o.cluster << " " << *o.cluster->outer_edges[i].cluster << "(" << *o.edge->data << ")" << std::endl;
 				o.cluster->outer_edges.erase(o.cluster->outer_edges.begin() + i);
 				// removed = true;
@@ -273,7 +322,7 @@ void TopologyCluster::remove_all_outer_edges() {
 	outer_edges.clear();
 }
 
-void TopologyCluster::calculate_outer_edges(bool check_neighbours) {
+void TopologyCluster::calculate_outer_edges() {
 	do_split(); // ensure splitted
 	outer_edges.clear();
 	if (first == NULL && second == NULL) {
@@ -302,17 +351,17 @@ void TopologyCluster::calculate_outer_edges(bool check_neighbours) {
 			}
 		}
 	} else if (second == NULL) {
-		for (auto o: first->outer_edges) outer_edges.push_back(neighbour{o.edge, o.cluster->parent});
+		for (auto &o: first->outer_edges) outer_edges.push_back(neighbour{o.edge, o.cluster->parent});
 		boundary_left = first->boundary_left;
 		boundary_right = first->boundary_right;
 	} else {
 		// Take only unique edges from both children
 		// std::cerr << "First " << *first << " edges:" << std::endl;
 		int first_counter = 0;
-		for (auto o: first->outer_edges) {
+		for (auto &o: first->outer_edges) {
 			// std::cerr << *o.cluster << "(" << *o.edge->data << ")" << std::endl;
 			bool unique = true;
-			for (auto oo: second->outer_edges) if (o.edge == oo.edge) {
+			for (auto &oo: second->outer_edges) if (o.edge == oo.edge) {
 				// edge = o.edge; // not neede because the second for does it
 				unique = false;
 			}
@@ -323,10 +372,10 @@ void TopologyCluster::calculate_outer_edges(bool check_neighbours) {
 		}
 		// std::cerr << "Second " << *second << " edges:" << std::endl;
 		int second_counter = 0;
-		for (auto o: second->outer_edges) {
+		for (auto &o: second->outer_edges) {
 			// std::cerr << *o.cluster << "(" << *o.edge->data << ")" << std::endl;
 			bool unique = true;
-			for (auto oo: first->outer_edges) if (o.edge == oo.edge) {
+			for (auto &oo: first->outer_edges) if (o.edge == oo.edge) {
 				edge = o.edge;
 				unique = false;
 			}
@@ -340,8 +389,10 @@ void TopologyCluster::calculate_outer_edges(bool check_neighbours) {
 		else if (first_counter == 0 && second_counter == 2) is_rake_branch = true;
 		else is_rake_branch = false;
 	}
+}
 
-	if (check_neighbours) for (auto o: outer_edges) {
+void TopologyCluster::update_neighbours() {
+	for (auto &o: outer_edges) {
 		#ifdef DEBUG
 			std::cerr << "Checking edge " << *o.edge->data << " to cluster " << *o.cluster << std::endl;
 		#endif
@@ -358,8 +409,9 @@ void TopologyCluster::calculate_outer_edges(bool check_neighbours) {
 	}
 }
 
-void TopologyCluster::do_split(std::vector<std::shared_ptr<TopologyCluster>>* splitted_clusters) {
+void TopologyCluster::do_split(std::vector<std::shared_ptr<TopologyCluster>>* splitted_clusters, bool read_only) {
 	if (is_splitted) return;
+	TOP_TREE_COUNT(splits, 1);
 	#ifdef DEBUG
 		std::cerr << "Splitting " << *shared_from_this() << std::endl;
 	#endif
@@ -368,7 +420,7 @@ void TopologyCluster::do_split(std::vector<std::shared_ptr<TopologyCluster>>* sp
 	if (splitted_clusters != NULL) splitted_clusters->push_back(shared_from_this());
 
 	// 2. Ensure that parent is splitted:
-	if (parent != NULL) parent->do_split(splitted_clusters);
+	if (parent != NULL) parent->do_split(splitted_clusters, read_only);
 
 	if (first == NULL && second == NULL) {
 		is_splitted = true;
@@ -379,7 +431,7 @@ void TopologyCluster::do_split(std::vector<std::shared_ptr<TopologyCluster>>* sp
 	if (second == NULL) {
 		// Just copy data down
 		//first->data = data;
-		CopyClusterData(shared_from_this(), first);
+		functions->CopyClusterData(*this, *first);
 	} else {
 		if (edge == NULL) {
 			std::cerr << "ERROR: Cluster '" << this << "' with both children but without edge between!" << std::endl;
@@ -389,35 +441,35 @@ void TopologyCluster::do_split(std::vector<std::shared_ptr<TopologyCluster>>* sp
 			// They are joined as rake clusters, first was raked to the second one
 			if (first->is_top_cluster && second->is_top_cluster) {
 				// Rake Split:
-				Split(first, second, shared_from_this());
+				functions->Split(*first, *second, *this);
 			} else if (first->is_top_cluster) {
 				// Just copy data down
 				//first->data = data;
-				CopyClusterData(shared_from_this(), first);
+				functions->CopyClusterData(*this, *first);
 			} else if (second->is_top_cluster) {
 				// Just copy data down
 				//second->data = data;
-				CopyClusterData(shared_from_this(), second);
+				functions->CopyClusterData(*this, *second);
 			}
 		} else {
 			// 1. Split with the second
 			if (second->is_top_cluster) {
-				Split(second, combined_edge_cluster, shared_from_this());
+				functions->Split(*second, *combined_edge_cluster, *this);
 			} else {
 				//combined_edge_cluster->data = data;
-				CopyClusterData(shared_from_this(), combined_edge_cluster);
+				functions->CopyClusterData(*this, *combined_edge_cluster);
 			}
 
 			// 2. Split with the first
 			if (first->is_top_cluster) {
-				Split(first, edge_cluster, combined_edge_cluster);
+				functions->Split(*first, *edge_cluster, *combined_edge_cluster);
 			} else {
 				//edge_cluster->data = combined_edge_cluster->data;
-				CopyClusterData(combined_edge_cluster, edge_cluster);
+				functions->CopyClusterData(*combined_edge_cluster, *edge_cluster);
 			}
 
 			// 3. Destroy edge cluster
-			Destroy(edge_cluster, edge->data);
+			if (!read_only) functions->Destroy(*edge_cluster, edge->data);
 		}
 	}
 
@@ -437,7 +489,7 @@ bool TopologyCluster::is_external_boundary_vertex(std::shared_ptr<BaseTree::Inte
 	  && (boundary_right == NULL || boundary_right->superior_vertex != v)
 	) return false; // v isn't either boundary vertex, it cannot be external boundary vertex
 
-	for (auto n: outer_edges) {
+	for (auto &n: outer_edges) {
 		if (n.edge->from == v || n.edge->to == v || n.edge->from->superior_vertex == v || n.edge->to->superior_vertex == v) return true;
 	}
 
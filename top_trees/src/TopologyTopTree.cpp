@@ -1,10 +1,18 @@
 #include <queue>
 #include <vector>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
 
 #include "TopologyTopTree.hpp"
 #include "BaseTreeInternal.hpp"
 #include "TopologyCluster.hpp"
+#include "Statistics.hpp"
+#include "ThreadPool.hpp"
 
 //#define DEBUG
 //#define DEBUG_GRAPHVIZ
@@ -17,20 +25,50 @@ namespace TopTree {
 // Hide data from .hpp file using PIMP idiom
 class TopologyTopTree::Internal {
 public:
+	Internal(std::shared_ptr<IUserFunctions> functions): functions{functions}, simple_pool{std::make_unique<SimpleClusterPool>(functions.get())} {}
+
+	std::shared_ptr<IUserFunctions> functions;
+	std::unique_ptr<SimpleClusterPool> simple_pool; // edge clusters and temporary clusters of Expose
+
 	std::list<std::shared_ptr<TopologyCluster> > root_clusters;
 	std::shared_ptr<BaseTree> base_tree;
 
-	std::shared_ptr<TopologyCluster> construct_basic_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> parent_edge=NULL);
-	std::shared_ptr<TopologyCluster> construct_topology_tree(std::shared_ptr<TopologyCluster> cluster, int level = 0, std::shared_ptr<BaseTree::Internal::Edge> parent_edge = NULL);
+	std::shared_ptr<TopologyCluster> construct_basic_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v);
+	std::shared_ptr<TopologyCluster> construct_basic_cluster(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> parent_edge=NULL);
+	std::vector<std::shared_ptr<TopologyCluster>> construct_level(const std::vector<std::shared_ptr<TopologyCluster>>& level);
 	std::shared_ptr<BaseTree::Internal::Vertex> split_vertex(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> parent_edge = NULL);
 	std::shared_ptr<BaseTree::Internal::Vertex> repair_subvertex_after_cut(std::shared_ptr<BaseTree::Internal::Vertex> v);
 	std::shared_ptr<BaseTree::Internal::Vertex> get_vertex_to_link(std::shared_ptr<BaseTree::Internal::Vertex> v);
+	std::shared_ptr<BaseTree::Internal::Vertex> get_link_slot(std::shared_ptr<BaseTree::Internal::Vertex> v);
+	// Subvertices of the same superior vertex in BFS order from the given one, depth is set to the distance of the last
+	std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> subvertices_bfs(std::shared_ptr<BaseTree::Internal::Vertex> root, int* depth = NULL) const;
 
 	std::tuple<std::shared_ptr<TopologyCluster>, std::shared_ptr<TopologyCluster>> cut(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge);
 	std::shared_ptr<TopologyCluster> link(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge);
-
-	std::list<std::shared_ptr<SimpleCluster>> expose_get_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> second_v, bool continue_above_common);
-	std::shared_ptr<SimpleCluster> expose_join_clusters(std::shared_ptr<BaseTree::Internal::Vertex> current, std::shared_ptr<BaseTree::Internal::Vertex> target, std::shared_ptr<SimpleCluster> parent_cluster);
+	// Change only the edge and clusters of its vertices, the clusters are added into the change list and the hierarchy
+	// above them is repaired by the next update_clusters (so more edges could be changed in one pass)
+	void cut_edge(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge);
+	void link_edge(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge);
+	void start_update();
+	// Repairs the hierarchy above all changed clusters at once, returns the new roots of the changed trees
+	std::vector<std::shared_ptr<TopologyCluster>>& finish_update();
+
+	// State of one expose (it is not stored in the tree, so read-only queries could run concurrently)
+	struct expose_state {
+		std::vector<std::shared_ptr<SimpleCluster>>& simple_clusters; // temporary clusters (to split or unlink them in Restore)
+		bool read_only; // clusters were splitted without destroying edge clusters, use them instead of EdgeData
+		SimpleClusterPool* pool; // NULL for read-only queries (they could run concurrently)
+		std::unordered_map<BaseTree::Internal::Vertex*, std::vector<std::shared_ptr<SimpleCluster>>> vertex_clusters = {};
+	};
+	std::shared_ptr<SimpleCluster> expose_path(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<TopologyCluster> cluster_v, std::shared_ptr<TopologyCluster> cluster_w, expose_state& state) const;
+	std::list<std::shared_ptr<SimpleCluster>> expose_get_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> second_v, std::shared_ptr<TopologyCluster> last_cluster, bool continue_above_common, expose_state& state) const;
+	// Expose without Restore of the previous one
+	std::shared_ptr<ICluster> expose(int v_index, int w_index);
+	// Clusters in keep_splitted stay splitted and listed in splitted_clusters (the next expose would split them again)
+	void restore(bool split_simple_clusters, const std::unordered_set<TopologyCluster*>* keep_splitted = NULL);
+	std::shared_ptr<SimpleCluster> expose_join_clusters(std::shared_ptr<BaseTree::Internal::Vertex> current, std::shared_ptr<BaseTree::Internal::Vertex> target, std::shared_ptr<SimpleCluster> parent_cluster, expose_state& state) const;
+	std::shared_ptr<TopologyCluster> clone_cluster(const std::shared_ptr<TopologyCluster>& cluster) const;
+	std::shared_ptr<SimpleCluster> clone_cluster(const std::shared_ptr<ICluster>& cluster) const;
 
 	//void soft_expose(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w);
 	//std::shared_ptr<Cluster> hard_expose(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w);
@@ -41,26 +79,38 @@ public:
 	std::vector<std::shared_ptr<TopologyCluster>> to_calculate_outer_edges;
 	std::vector<std::shared_ptr<SimpleCluster>> expose_simple_clusters;
 
+	// When set, Cut and Link leave splitted clusters for BatchUpdate (to join them only once)
+	bool defer_join = false;
+
+	// Threads used for the construction of levels (0 = number of hardware threads)
+	unsigned int construction_threads = 0;
+	// Started by InitFromBaseTree for all levels of big trees (NULL = construction is sequential)
+	std::unique_ptr<ThreadPool> construction_pool;
+	// Runs f(0), ..., f(n-1) split into contiguous chunks between threads of the construction pool
+	static const size_t min_parallel_chunk = 4096; // smaller chunks are not worth of waking a worker
+	template<class F>
+	void parallel_for(size_t n, F f);
+
 	#ifdef DEBUG_GRAPHVIZ
 		void print_graphviz(std::shared_ptr<TopologyCluster> node, const std::string title="", bool full = false);
 		void print_graphviz_recursive(std::shared_ptr<TopologyCluster> cluster, std::shared_ptr<BaseTree::Internal::Edge> parent_edge = NULL, std::shared_ptr<TopologyCluster> parent = NULL, bool edges_to_childs = false, bool gray = false) const;
 	#endif
 
-	bool in_same_tree(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w) {
-		// 1. Get topology clusters
-		auto v_root = v->topology_cluster;
-		if (!v->subvertices.empty()) v_root = v->subvertices.front()->topology_cluster;
-		auto w_root = w->topology_cluster;
-		if (!w->subvertices.empty()) w_root = w->subvertices.front()->topology_cluster;
-
-		// 2. If one of them has no cluster -> it is independent vertex, they are not connected
-		if (v_root == NULL || w_root == NULL) return false;
+	std::shared_ptr<TopologyCluster> find_root(const std::shared_ptr<BaseTree::Internal::Vertex>& v) const {
+		// 1. Get topology cluster (NULL for independent vertex)
+		auto root = v->topology_cluster;
+		if (!v->subvertices.empty()) root = v->subvertices.front()->topology_cluster;
+		if (root == NULL) return NULL;
 
-		// 3. Test if they aren't in the same tree (if they are already linked) - O(log N)
-		while (v_root->parent != NULL) v_root = v_root->parent;
-		while (w_root->parent != NULL) w_root = w_root->parent;
+		// 2. Go up to the root - O(log N)
+		while (root->parent != NULL) root = root->parent;
+		return root;
+	}
 
-		return (v_root == w_root);
+	bool in_same_tree(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w) const {
+		// If one of them has no cluster -> it is independent vertex, they are not connected
+		auto v_root = find_root(v);
+		return (v_root != NULL && v_root == find_root(w));
 	}
 
 	void recursive_delete_cluster(std::shared_ptr<TopologyCluster> cluster);
@@ -79,15 +129,16 @@ private:
 	std::vector<std::shared_ptr<TopologyCluster>> found_roots;
 
 	void update_clusters();
+	void add_to_change_list(std::shared_ptr<TopologyCluster> cluster);
 	void update_clusters_join_with_neighbour(std::shared_ptr<TopologyCluster> cluster, std::shared_ptr<TopologyCluster> neighbour);
 	void update_clusters_only_child(std::shared_ptr<TopologyCluster> cluster);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-TopologyTopTree::TopologyTopTree() : internal{std::make_unique<Internal>()} {}
+TopologyTopTree::TopologyTopTree(std::shared_ptr<IUserFunctions> functions) : internal{std::make_unique<Internal>(functions)} {}
 
-TopologyTopTree::TopologyTopTree(std::shared_ptr<BaseTree> baseTree) : TopologyTopTree() {
+TopologyTopTree::TopologyTopTree(std::shared_ptr<IUserFunctions> functions, std::shared_ptr<BaseTree> baseTree) : TopologyTopTree(functions) {
 	InitFromBaseTree(baseTree);
 }
 
@@ -99,29 +150,50 @@ TopologyTopTree::~TopologyTopTree() {
 	internal->root_clusters.clear();
 }
 
+void TopologyTopTree::SetConstructionThreads(unsigned int threads) {
+	internal->construction_threads = threads;
+}
+
 void TopologyTopTree::InitFromBaseTree(std::shared_ptr<BaseTree> baseTree) {
 	internal->base_tree = baseTree;
 
 	for (auto v : internal->base_tree->internal->vertices) v->used = false;
 
+	// 1. Basic clusters of all trees form the lowest level
+	std::vector<std::shared_ptr<TopologyCluster>> level;
 	for (auto v : internal->base_tree->internal->vertices) {
 		if (v->used || v->degree != 1) continue;
 
 		#ifdef DEBUG
 			std::cerr << "Constructing basic clusters from vertex " << *v << std::endl;
 		#endif
+		size_t first_cluster = internal->splitted_clusters.size();
 		auto root_cluster = internal->construct_basic_clusters(v);
 		#ifdef DEBUG_GRAPHVIZ
 			internal->print_graphviz(root_cluster, "Basic clusters");
 		#endif
-		while (root_cluster->outer_edges.size() > 0) {
-			root_cluster = internal->construct_topology_tree(root_cluster);
-			for (auto c: internal->to_calculate_outer_edges) c->calculate_outer_edges();
-			internal->to_calculate_outer_edges.clear();
+		level.insert(level.end(), internal->splitted_clusters.begin() + first_cluster, internal->splitted_clusters.end());
+	}
+
+	// 2. Construct levels of all trees at once, cluster without outer edges is the root of its tree
+	// (threads are started once for all levels, small trees are constructed sequentially)
+	unsigned int threads = internal->construction_threads;
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	if (threads > 1 && level.size() >= 2 * Internal::min_parallel_chunk) internal->construction_pool = std::make_unique<ThreadPool>(threads);
+	while (!level.empty()) {
+		std::vector<std::shared_ptr<TopologyCluster>> active;
+		active.reserve(level.size());
+		for (auto c: level) {
+			if (c->outer_edges.size() > 0) {
+				active.push_back(c);
+				continue;
+			}
+			internal->root_clusters.push_back(c);
+			c->root_clusters_iterator = std::prev(internal->root_clusters.end());
 		}
-		internal->root_clusters.push_back(root_cluster);
-		root_cluster->root_clusters_iterator = std::prev(internal->root_clusters.end());
+		level = internal->construct_level(active);
 	}
+	internal->construction_pool = NULL;
 
 	for (auto c: internal->splitted_clusters) c->do_join();
 	internal->splitted_clusters.clear();
@@ -132,10 +204,15 @@ void TopologyTopTree::InitFromBaseTree(std::shared_ptr<BaseTree> baseTree) {
 }
 
 void TopologyTopTree::Internal::recursive_delete_cluster(std::shared_ptr<TopologyCluster> cluster) {
-	if (cluster == NULL) return;
-	recursive_delete_cluster(cluster->first);
-	recursive_delete_cluster(cluster->second);
-	cluster->unlink();
+	std::vector<std::shared_ptr<TopologyCluster>> stack{cluster};
+	while (!stack.empty()) {
+		cluster = stack.back();
+		stack.pop_back();
+		if (cluster == NULL) continue;
+		stack.push_back(cluster->first);
+		stack.push_back(cluster->second);
+		cluster->unlink();
+	}
 }
 
 //std::vector<std::shared_ptr<Cluster> > TopologyTopTree::GetTopTrees() {
@@ -165,7 +242,7 @@ void TopologyTopTree::Internal::print_graphviz_recursive(std::shared_ptr<Topolog
 		if (cluster->first != NULL) std::cout << "\t\"" << cluster << "\" -> \"" << cluster->first << "\" [color=orange, weight=0.5]" << std::endl;
 		if (cluster->second != NULL) std::cout << "\t\"" << cluster << "\" -> \"" << cluster->second << "\" [color=orange, weight=0.5]" << std::endl;
 	}
-	for (auto o: cluster->outer_edges) {
+	for (auto &o: cluster->outer_edges) {
 		if (o.edge != parent_edge) print_graphviz_recursive(o.cluster, o.edge, cluster, edges_to_childs, gray);
 	}
 
@@ -215,7 +292,7 @@ void TopologyTopTree::Internal::update_clusters_join_with_neighbour(std::shared_
 	neighbour->listed_in_abandon_list = false;
 	if (cluster->parent == NULL && neighbour->parent == NULL) {
 		// Add new cluster to above level
-		auto parent = std::make_shared<TopologyCluster>();
+		auto parent = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
 		splitted_clusters.push_back(parent);
 		parent->set_first_child(cluster);
 		parent->set_second_child(neighbour);
@@ -264,7 +341,7 @@ void TopologyTopTree::Internal::update_clusters_only_child(std::shared_ptr<Topol
 	// This cluster is the only one child of its parent, ensure that parent exists
 	if (cluster->parent == NULL) {
 		// Have to create new parent
-		auto parent = std::make_shared<TopologyCluster>();
+		auto parent = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
 		splitted_clusters.push_back(parent);
 		parent->set_first_child(cluster);
 		parent->vertex = cluster->vertex;
@@ -293,6 +370,8 @@ void TopologyTopTree::Internal::update_clusters() {
 		#endif
 		return;
 	}
+	TOP_TREE_COUNT(update_rounds, 1);
+	TOP_TREE_COUNT(update_list_items, delete_list.size() + change_list.size() + abandon_list.size());
 
 	#ifdef DEBUG
 		std::cerr << std::endl << "Delete list(" << delete_list.size() << "): ";
@@ -378,7 +457,7 @@ void TopologyTopTree::Internal::update_clusters() {
 		// If connected with sibling by edge and parent is valid cluster
 		// Get common edge:
 		std::shared_ptr<BaseTree::Internal::Edge> common_edge = NULL;
-		for (auto o: cluster->outer_edges) if (o.cluster == sibling) common_edge = o.edge;
+		for (auto &o: cluster->outer_edges) if (o.cluster == sibling) common_edge = o.edge;
 		// Test parent
 		if (common_edge != NULL && (cluster->outer_edges.size() + sibling->outer_edges.size()) <= 4) {
 			#ifdef DEBUG
@@ -434,14 +513,14 @@ void TopologyTopTree::Internal::update_clusters() {
 		if (cluster->outer_edges.size() == 3) {
 			// Find if there is neighbour with degree 1
 			std::shared_ptr<TopologyCluster> neighbour = NULL;
-			for (auto o: cluster->outer_edges) if (o.cluster->outer_edges.size() == 1) neighbour = o.cluster;
+			for (auto &o: cluster->outer_edges) if (o.cluster->outer_edges.size() == 1) neighbour = o.cluster;
 
 			if (neighbour != NULL) update_clusters_join_with_neighbour(cluster, neighbour); // Join with neighbour
 			else update_clusters_only_child(cluster);
 		} else if (cluster->outer_edges.size() >= 1) {
 			// Find if there is neighbour with degree <= (4 - #outer_edges)
 			std::shared_ptr<TopologyCluster> neighbour = NULL;
-			for (auto o: cluster->outer_edges) {
+			for (auto &o: cluster->outer_edges) {
 				// Test if neighbour have low degree and if it have no sibling - if yes choose it
 				if (o.cluster->outer_edges.size() <= (4 - cluster->outer_edges.size()) && (o.cluster->parent == NULL || o.cluster->parent->second == NULL)) neighbour = o.cluster;
 			}
@@ -469,11 +548,14 @@ void TopologyTopTree::Internal::update_clusters() {
 		#ifdef DEBUG
 			std::cerr << "Computing outer edges for " << *c << std::endl;
 		#endif
-		c->calculate_outer_edges(true); // with checking neighbours (neighbours may not be on this list and we need to add new edges into them)
+		c->calculate_outer_edges();
 		#ifdef DEBUG
 			std::cerr << "Outer edges for " << *c << " computed" << std::endl;
 		#endif
 	}
+	// Neighbours may not be on this list and we need to add new edges into them (only after all clusters on the list
+	// are calculated, so their old edges are not counted)
+	for (auto c: to_calculate_outer_edges) c->update_neighbours();
 
 	// Continue with above level
 	delete_list = next_delete;
@@ -499,16 +581,8 @@ std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr
 		std::cerr << "Starting Cut operation between " << *v << " and " << *w << std::endl;
 	#endif
 
-	// 1. Find edge
-	std::shared_ptr<BaseTree::Internal::Edge> edge = NULL;
-	for (auto n: v->neighbours) {
-		auto ee = n.edge.lock();
-		if ((BaseTree::Internal::Vertex::get_superior(ee->from) == v && BaseTree::Internal::Vertex::get_superior(ee->to) == w)
-		|| (BaseTree::Internal::Vertex::get_superior(ee->from) == w && BaseTree::Internal::Vertex::get_superior(ee->to) == v)) {
-			edge = n.edge.lock();
-			break;
-		}
-	}
+	// 1. Find edge (by the edge index, not by scanning neighbours)
+	auto edge = internal->base_tree->internal->find_edge(v_index, w_index);
 	if (edge == NULL) {
 		std::cerr << "ERROR: Vertices not linked by edge, cannot cut" << std::endl;
 		return std::make_tuple((std::shared_ptr<ICluster>)NULL, (std::shared_ptr<ICluster>)NULL, (std::shared_ptr<EdgeData>)NULL);
@@ -529,6 +603,7 @@ std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr
 
 	// 3. Cut itself (save results)
 	auto result = internal->cut(vv, ww, edge);
+	internal->base_tree->internal->unindex_edge(v_index, w_index);
 
 	// 4. If were subvertices it is necessary to update subvertices and to delete edge even from superior vertices
 	// 4.2 Repair connections
@@ -549,8 +624,10 @@ std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr
 	root_w->root_clusters_iterator = std::prev(internal->root_clusters.end());
 
 	// 6. Restore all splitted clusters
-	for (auto c: internal->splitted_clusters) c->do_join();
-	internal->splitted_clusters.clear();
+	if (!internal->defer_join) {
+		for (auto c: internal->splitted_clusters) c->do_join();
+		internal->splitted_clusters.clear();
+	}
 
 	// Edge from the underlying Base tree was removed in the internal cut method
 	// (including edge on superior vertices), node will be deleted by garbage collector
@@ -565,6 +642,112 @@ std::tuple<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>, std::shared_ptr
 	return std::make_tuple(root_v, root_w, edge->data);
 }
 
+int TopologyTopTree::SubvertexTreeDiameter(int v) const {
+	auto vertex = internal->base_tree->internal->vertices[v];
+	if (vertex->subvertices.empty()) return 0;
+
+	// Farthest subvertex from any one is an end of the longest path
+	int diameter;
+	internal->subvertices_bfs(internal->subvertices_bfs(vertex->subvertices.front()).back(), &diameter);
+	return diameter;
+}
+
+int TopologyTopTree::BatchUpdate(const std::vector<std::pair<int, int>>& cuts, const std::vector<LinkUpdate>& links) {
+	// Restore previous expose (if needed)
+	Restore();
+
+	// Edges between vertices without subvertices are changed directly at the lowest level and the hierarchy above all of
+	// them is repaired by one update_clusters (clusters on the shared root paths are splitted and rebuilt only once).
+	// Updates which have to change subvertices need the repaired hierarchy, so they are done one by one after the pass.
+	auto& vertices = internal->base_tree->internal->vertices;
+	internal->defer_join = true;
+	int applied = 0;
+
+	// 1. Cuts (in one pass)
+	std::vector<std::pair<int, int>> subvertex_cuts;
+	std::unordered_set<TopologyCluster*> old_roots;
+	internal->start_update();
+	for (auto &c: cuts) {
+		auto edge = internal->base_tree->internal->find_edge(c.first, c.second);
+		if (edge == NULL) continue;
+		if (edge->from->superior_vertex != NULL || edge->to->superior_vertex != NULL) {
+			subvertex_cuts.push_back(c);
+			continue;
+		}
+
+		// Old root is removed from the roots list (the hierarchy is not changed yet, so it is still reachable)
+		auto root = internal->find_root(edge->from);
+		if (old_roots.insert(root.get()).second) internal->root_clusters.erase(root->root_clusters_iterator);
+
+		internal->cut_edge(edge->from, edge->to, edge);
+		internal->base_tree->internal->unindex_edge(c.first, c.second);
+		applied++;
+	}
+	for (auto root: internal->finish_update()) {
+		internal->root_clusters.push_back(root);
+		root->root_clusters_iterator = std::prev(internal->root_clusters.end());
+	}
+	for (auto &c: subvertex_cuts) {
+		if (internal->base_tree->internal->find_edge(c.first, c.second) == NULL) continue; // cut twice
+		if (std::get<2>(Cut(c.first, c.second)) != NULL) applied++;
+	}
+
+	// 2. Links are checked against the forest after the cuts, trees linked in this batch are merged by union-find over
+	// their roots (isolated vertices without cluster are represented by themselves)
+	std::unordered_map<void*, void*> merged;
+	auto find = [&merged](void* x) {
+		void* root = x;
+		for (auto it = merged.find(root); it != merged.end(); it = merged.find(root)) root = it->second;
+		while (x != root) {
+			auto& next = merged[x];
+			x = next;
+			next = root;
+		}
+		return root;
+	};
+	auto tree_of = [&](int v) -> void* {
+		auto root = internal->find_root(vertices[v]);
+		return (root == NULL ? (void*) vertices[v].get() : (void*) root.get());
+	};
+	std::vector<const LinkUpdate*> accepted;
+	for (auto &l: links) {
+		void* tree_v = find(tree_of(l.v));
+		void* tree_w = find(tree_of(l.w));
+		if (tree_v == tree_w) continue;
+		merged[tree_v] = tree_w;
+		accepted.push_back(&l);
+	}
+
+	// 3. Links (in one pass)
+	std::vector<const LinkUpdate*> subvertex_links;
+	internal->start_update();
+	for (auto l: accepted) {
+		auto v = vertices[l->v];
+		auto w = vertices[l->w];
+		if (!v->subvertices.empty() || !w->subvertices.empty() || v->degree >= 3 || w->degree >= 3) {
+			subvertex_links.push_back(l);
+			continue;
+		}
+
+		auto edge = std::make_shared<BaseTree::Internal::Edge>(v, w, l->edge_data);
+		internal->base_tree->internal->index_edge(l->v, l->w, edge);
+		internal->link_edge(v, w, edge);
+		applied++;
+	}
+	for (auto root: internal->finish_update()) {
+		internal->root_clusters.push_back(root);
+		root->root_clusters_iterator = std::prev(internal->root_clusters.end());
+	}
+	for (auto l: subvertex_links) if (Link(l->v, l->w, l->edge_data) != NULL) applied++;
+	internal->defer_join = false;
+
+	// 4. Join all splitted clusters once
+	for (auto c: internal->splitted_clusters) c->do_join();
+	internal->splitted_clusters.clear();
+
+	return applied;
+}
+
 std::tuple<std::shared_ptr<TopologyCluster>, std::shared_ptr<TopologyCluster>> TopologyTopTree::Internal::cut(
 	std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge
 ) {
@@ -577,30 +760,44 @@ std::tuple<std::shared_ptr<TopologyCluster>, std::shared_ptr<TopologyCluster>> T
 		exit(1);
 	}
 
-	// 1. Get clusters and split from them
-	auto cluster_v = v->topology_cluster;
-	auto cluster_w = w->topology_cluster;
-
 	#ifdef DEBUG
-		std::cerr << "===" << std::endl << "Starting internal cut operation between " << *cluster_v << " and " << *cluster_w << std::endl;
+		std::cerr << "===" << std::endl << "Starting internal cut operation between " << *v->topology_cluster << " and " << *w->topology_cluster << std::endl;
 	#endif
 
+	// 1. Remove the edge and repair the hierarchy
+	start_update();
+	cut_edge(v, w, edge);
+	finish_update();
+
+	// 2. Get results
+	if (found_roots.size() != 2) {
+		std::cerr << "ERROR: Expecting 2 roots after cut operation, found " << found_roots.size() << " roots!" << std::endl;
+		exit(1);
+	}
+	return std::make_tuple(found_roots[0], found_roots[1]);
+	// expecting that do_join will be called from outside Cut function
+}
+
+void TopologyTopTree::Internal::cut_edge(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge) {
+	// 1. Split from clusters of both vertices
+	auto cluster_v = v->topology_cluster;
+	auto cluster_w = w->topology_cluster;
 	cluster_v->do_split(&splitted_clusters);
 	cluster_w->do_split(&splitted_clusters);
 
 	// 2. Remove edge from neighbours list
-	edge->from->neighbours.erase(edge->from_iter);
-	edge->to->neighbours.erase(edge->to_iter);
+	edge->from->remove_neighbour(edge->from_index);
+	edge->to->remove_neighbour(edge->to_index);
 	// 2.1 Update degrees
 	v->degree--;
 	w->degree--;
 	// Superior vertex
 	if (edge->from->superior_vertex != NULL && !edge->subvertice_edge) {
-		edge->from->superior_vertex->neighbours.erase(edge->superior_from_iter);
+		edge->from->superior_vertex->remove_neighbour(edge->superior_from_index);
 		edge->from->superior_vertex->degree--;
 	}
 	if (edge->to->superior_vertex != NULL && !edge->subvertice_edge) {
-		edge->to->superior_vertex->neighbours.erase(edge->superior_to_iter);
+		edge->to->superior_vertex->remove_neighbour(edge->superior_to_index);
 		edge->to->superior_vertex->degree--;
 	}
 
@@ -608,26 +805,60 @@ std::tuple<std::shared_ptr<TopologyCluster>, std::shared_ptr<TopologyCluster>> T
 	cluster_v->calculate_outer_edges();
 	cluster_w->calculate_outer_edges();
 
-	// 3. Add both clusters into changed list (and empty other lists)
+	// 3. Add both clusters into changed list
+	add_to_change_list(cluster_v);
+	add_to_change_list(cluster_w);
+}
+
+void TopologyTopTree::Internal::link_edge(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge) {
+	if (v->topology_cluster == NULL) {
+		v->topology_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
+		v->topology_cluster->vertex = v;
+	}
+	auto cluster_v = v->topology_cluster;
+	if (w->topology_cluster == NULL) {
+		w->topology_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
+		w->topology_cluster->vertex = w;
+	}
+	auto cluster_w = w->topology_cluster;
+
+	// 0. Split from both clusters
+	cluster_v->do_split(&splitted_clusters);
+	cluster_w->do_split(&splitted_clusters);
+
+	// 1. Add new edge (expecting that outer Link function ensures not adding edge to vertices with degree 3)
+	cluster_v->outer_edges.push_back(TopologyCluster::neighbour{edge, cluster_w});
+	cluster_w->outer_edges.push_back(TopologyCluster::neighbour{edge, cluster_v});
+	// 1.1 Update edge
+	edge->from = v;
+	edge->to = w;
+	edge->register_at_vertices(); // including superior vertices
+
+	// 1.2 Add edge to clusters
+	cluster_v->calculate_outer_edges();
+	cluster_w->calculate_outer_edges();
+
+	// 2. Add both clusters into changed list
+	add_to_change_list(cluster_v);
+	add_to_change_list(cluster_w);
+}
+
+void TopologyTopTree::Internal::add_to_change_list(std::shared_ptr<TopologyCluster> cluster) {
+	if (cluster->listed_in_change_list) return;
+	change_list.push_back(cluster);
+	cluster->listed_in_change_list = true;
+}
+
+void TopologyTopTree::Internal::start_update() {
 	delete_list.clear();
 	abandon_list.clear();
 	change_list.clear();
-	change_list.push_back(cluster_v);
-	cluster_v->listed_in_change_list = true;
-	change_list.push_back(cluster_w);
-	cluster_w->listed_in_change_list = true;
-
-	// 4. Run update procedure
 	found_roots.clear();
-	update_clusters();
+}
 
-	// 5. Get results
-	if (found_roots.size() != 2) {
-		std::cerr << "ERROR: Expecting 2 roots after cut operation, found " << found_roots.size() << " roots!" << std::endl;
-		exit(1);
-	}
-	return std::make_tuple(found_roots[0], found_roots[1]);
-	// expecting that do_join will be called from outside Cut function
+std::vector<std::shared_ptr<TopologyCluster>>& TopologyTopTree::Internal::finish_update() {
+	update_clusters();
+	return found_roots;
 }
 
 std::shared_ptr<ICluster> TopologyTopTree::Link(int v_index, int w_index, std::shared_ptr<EdgeData> edge_data) {
@@ -665,6 +896,7 @@ std::shared_ptr<ICluster> TopologyTopTree::Link(int v_index, int w_index, std::s
 
 	// 3. Create edge
 	auto edge = std::make_shared<BaseTree::Internal::Edge>(vv, ww, edge_data);
+	internal->base_tree->internal->index_edge(v_index, w_index, edge);
 
 	// 4. Link vertices
 	auto result = internal->link(vv, ww, edge);
@@ -673,8 +905,10 @@ std::shared_ptr<ICluster> TopologyTopTree::Link(int v_index, int w_index, std::s
 	result->root_clusters_iterator = std::prev(internal->root_clusters.end());
 
 	// 5. Restore all splitted clusters
-	for (auto c: internal->splitted_clusters) c->do_join();
-	internal->splitted_clusters.clear();
+	if (!internal->defer_join) {
+		for (auto c: internal->splitted_clusters) c->do_join();
+		internal->splitted_clusters.clear();
+	}
 
 	#ifdef DEBUG_GRAPHVIZ
 		std::ostringstream ss;
@@ -700,31 +934,23 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_verte
 			exit(1);
 		}
 
-		// Have to add new subvertex, we add it as second subvertex in the chain
+		// Have to add new subvertex, it takes one outer edge of the shallowest subvertex that has some and the new edge
+		// goes to its free slot. So the tree of subvertices grows level by level (like a heap) and stays O(log degree) deep.
 		// 1. Prepare new subvertex
 		auto subvertex = std::make_shared<BaseTree::Internal::Vertex>(std::make_shared<VertexData>());
 		subvertex->index = v->index; // index of the subvertex is the same as index of the superior vertex (from the Join point of view it is the same vertex)
 		subvertex->superior_vertex = v;
-		subvertex->topology_cluster = std::make_shared<TopologyCluster>();
+		subvertex->topology_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
 		splitted_clusters.push_back(subvertex->topology_cluster);
 		subvertex->topology_cluster->vertex = subvertex;
 
-		// 2. Cut between first and second subvertex
-		auto first = v->subvertices.begin();
-		auto second = std::next(first);
-		std::shared_ptr<BaseTree::Internal::Edge> edge;
-		//std::cerr << "First subvertex is " << *(*first)->topology_cluster << " and second " << *(*second)->topology_cluster << std::endl;
-		//std::cerr << "Searching for subvertice edge between " << **first << " and " << **second << std::endl;
-		for (auto n: (*first)->neighbours) {
-			auto ee = n.edge.lock();
-			//std::cerr << "...edge: " << *ee->from << "-" << *ee->to << std::endl;
-			if ((ee->from == *first && ee->to == *second) || (ee->from == *second && ee->to == *first)) {
-				edge = ee;
-				break;
-			}
-		}
-		//std::cerr << "Edge: " << edge << std::endl;
-		auto cut_result = cut(*first, *second, edge);
+		// 2. Cut the outer edge from the shallowest subvertex
+		auto slot = get_link_slot(v);
+		std::shared_ptr<BaseTree::Internal::Edge> edge = NULL;
+		for (auto n: slot->neighbours) if (auto ee = n.edge.lock()) if (!ee->subvertice_edge) { edge = ee; break; }
+		bool slot_is_from = (edge->from == slot);
+		auto other = (slot_is_from ? edge->to : edge->from);
+		auto cut_result = cut(slot, other, edge);
 		#ifdef DEBUG_GRAPHVIZ_VERBOSE
 			std::ostringstream ss;
 			ss << "Getting vertex for link fox " << *v << " - added new subvertex " << *subvertex;
@@ -732,22 +958,21 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_verte
 			print_graphviz(std::get<1>(cut_result), ss.str() + " after cut 2/2", true);
 		#endif
 
-		// 3. Link first-new-second
-		// 3.1 Insert new subvertex a
-		subvertex->superior_vertex_subvertices_iter = v->subvertices.insert(second, subvertex);
+		// 3. Link slot-new by new subvertice edge and new-other by the original edge (keeping its direction)
+		// 3.1 Insert new subvertex
+		v->add_subvertex(subvertex);
 		// 3.2 Link itself
-		edge->from = *first;
-		edge->to = subvertex;
-		auto link_result = link(*first, subvertex, edge); // reuse original edge
+		auto edge2 = std::make_shared<BaseTree::Internal::Edge>(slot, subvertex, std::make_shared<EdgeData>());
+		edge2->subvertice_edge = true;
+		v->add_subvertice_edge(edge2);
+		auto link_result = link(slot, subvertex, edge2);
 		#ifdef DEBUG_GRAPHVIZ_VERBOSE
 			print_graphviz(link_result, ss.str() + " after first link", true);
 		#endif
 
-		auto edge2 = std::make_shared<BaseTree::Internal::Edge>(subvertex, *second, std::make_shared<EdgeData>());
-		edge2->subvertice_edge = true;
-		v->subvertice_edges.push_back(edge2);
-		edge2->subvertice_edges_iterator = std::prev(v->subvertice_edges.end());
-		link_result = link(subvertex, *second, edge2);
+		if (slot_is_from) link_result = link(subvertex, other, edge);
+		else link_result = link(other, subvertex, edge);
+		v->link_slots.push_back(subvertex);
 
 		#ifdef DEBUG_GRAPHVIZ_VERBOSE
 			print_graphviz(link_result, ss.str() + " after second link", true);
@@ -767,43 +992,34 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_verte
 		subvertexB->index = v->index; // index of the subvertex is the same as index of the superior vertex (from the Join point of view it is the same vertex)
 		subvertexA->superior_vertex = v;
 		subvertexB->superior_vertex = v;
-		subvertexA->topology_cluster = std::make_shared<TopologyCluster>();
+		subvertexA->topology_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
 		splitted_clusters.push_back(subvertexA->topology_cluster);
 		subvertexA->topology_cluster->vertex = subvertexA;
-		subvertexB->topology_cluster = std::make_shared<TopologyCluster>();
+		subvertexB->topology_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
 		splitted_clusters.push_back(subvertexB->topology_cluster);
 		subvertexB->topology_cluster->vertex = subvertexB;
 
 		// 2. Add subvertices to superior vertex's list of subvertices
-		v->subvertices.push_back(subvertexA);
-		subvertexA->superior_vertex_subvertices_iter = std::prev(v->subvertices.end());
-		v->subvertices.push_back(subvertexB);
-		subvertexB->superior_vertex_subvertices_iter = std::prev(v->subvertices.end());
+		v->add_subvertex(subvertexA);
+		v->add_subvertex(subvertexB);
 
 		// 2. Reconnect first two edges to subvertexA and third edge to subvertexB
-		auto n = v->neighbours.begin();
-		while (n != v->neighbours.end()) {
-			// (because cut operation deletes from this std::list we need to get next pointer before calling cut)
-			auto next_n = std::next(n);
-			if (auto ee = (*n).edge.lock()) {
-				std::shared_ptr<BaseTree::Internal::Vertex> vv;
-				if (ee->from == v) vv = ee->to;
-				else if (ee->to == v) vv = ee->from;
-				else {
-					//std::cerr << "Skipping subvertice edge " << *ee->from << "-" << *ee->to << std::endl;
-					n = next_n;
-					continue;
-				}
+		// (cut and link operations modify neighbours of v, so get edges first)
+		std::vector<std::shared_ptr<BaseTree::Internal::Edge>> edges;
+		for (auto n: v->neighbours) {
+			if (auto ee = n.edge.lock()) {
+				if (ee->from == v || ee->to == v) edges.push_back(ee);
+				//else std::cerr << "Skipping subvertice edge " << *ee->from << "-" << *ee->to << std::endl;
+			}
+		}
+		for (auto ee: edges) {
+			{
 				#ifdef DEBUG
-					std::cerr << "Working on edge " << *ee->data << " to the " << *vv << std::endl;
+					std::cerr << "Working on edge " << *ee->data << " to the " << *(ee->from == v ? ee->to : ee->from) << std::endl;
 				#endif
 
 				auto subvertex = subvertexA;
-				(*n).subvertice_iter = v->subvertices.begin();
-				if (subvertexA->degree == 2) {
-					subvertex = subvertexB;
-					(*n).subvertice_iter = std::next((*n).subvertice_iter);
-				}
+				if (subvertexA->degree == 2) subvertex = subvertexB;
 
 				if (ee->from == v) {
 					auto result = cut(v, ee->to, ee);
@@ -831,7 +1047,6 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_verte
 					#endif
 				}
 			}
-			n = next_n;
 		}
 
 		#ifdef DEBUG
@@ -841,8 +1056,7 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_verte
 		// 3. Connect subvertices one to the other
 		auto edge = std::make_shared<BaseTree::Internal::Edge>(subvertexA, subvertexB, std::make_shared<EdgeData>());
 		edge->subvertice_edge = true;
-		v->subvertice_edges.push_back(edge);
-		edge->subvertice_edges_iterator = std::prev(v->subvertice_edges.end());
+		v->add_subvertice_edge(edge);
 		link(subvertexA, subvertexB, edge);
 
 		return subvertexB; // subvertexB has one free slot for the new edge
@@ -852,17 +1066,6 @@ std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_verte
 std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::link(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<BaseTree::Internal::Edge> edge) {
 	// This function is not aware of splitted vertices (not needs it)
 
-	if (v->topology_cluster == NULL) {
-		v->topology_cluster = std::make_shared<TopologyCluster>();
-		v->topology_cluster->vertex = v;
-	}
-	auto cluster_v = v->topology_cluster;
-	if (w->topology_cluster == NULL) {
-		w->topology_cluster = std::make_shared<TopologyCluster>();
-		w->topology_cluster->vertex = w;
-	}
-	auto cluster_w = w->topology_cluster;
-
 	#ifdef DEBUG
 		std::cerr << "==========" << std::endl;
 		std::cerr << "Linking " << *v << " and " << *w << std::endl;
@@ -873,36 +1076,12 @@ std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::link(std::shared_ptr
 		exit(1);
 	}
 
-	// 0. Split from both clusters
-	cluster_v->do_split(&splitted_clusters);
-	cluster_w->do_split(&splitted_clusters);
-
-	// 1. Add new edge (expecting that outer Link function ensures not adding edge to vertices with degree 3)
-	cluster_v->outer_edges.push_back(TopologyCluster::neighbour{edge, cluster_w});
-	cluster_w->outer_edges.push_back(TopologyCluster::neighbour{edge, cluster_v});
-	// 1.1 Update edge
-	edge->from = v;
-	edge->to = w;
-	edge->register_at_vertices(); // including superior vertices
-
-	// 1.2 Add edge to clusters
-	cluster_v->calculate_outer_edges();
-	cluster_w->calculate_outer_edges();
+	// 1. Add the edge and repair the hierarchy
+	start_update();
+	link_edge(v, w, edge);
+	finish_update();
 
-	// 2. Add both clusters into changed list (and empty other lists)
-	delete_list.clear();
-	abandon_list.clear();
-	change_list.clear();
-	change_list.push_back(cluster_v);
-	cluster_v->listed_in_change_list = true;
-	change_list.push_back(cluster_w);
-	cluster_w->listed_in_change_list = true;
-
-	// 3. Run update procedure
-	found_roots.clear();
-	update_clusters();
-
-	// 4. Get results
+	// 2. Get results
 	if (found_roots.size() != 1) {
 		std::cerr << "ERROR: Expecting 1 root after link operation, found " << found_roots.size() << " roots!" << std::endl;
 		exit(1);
@@ -918,170 +1097,160 @@ std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::link(std::shared_ptr
 	// expecting that do_join will be called from outside Cut function
 }
 
-std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::repair_subvertex_after_cut(std::shared_ptr<BaseTree::Internal::Vertex> v) {
-	std::shared_ptr<BaseTree::Internal::Vertex> first_neighbour = NULL;
-	std::shared_ptr<BaseTree::Internal::Edge> first_neighbour_edge = NULL;
-	std::shared_ptr<BaseTree::Internal::Vertex> second_neighbour = NULL;
-	std::shared_ptr<BaseTree::Internal::Edge> second_neighbour_edge = NULL;
-
-	for (auto n: v->neighbours) {
-		if (n.edge.lock()->subvertice_edge) {
-			if (first_neighbour == NULL) {
-				//first_neighbour = n.vertex.lock();
-				first_neighbour_edge = n.edge.lock();
-				if (first_neighbour_edge->from == v) first_neighbour = first_neighbour_edge->to;
-				else first_neighbour = first_neighbour_edge->from;
-			} else {
-				//second_neighbour = n.vertex.lock();
-				second_neighbour_edge = n.edge.lock();
-				if (second_neighbour_edge->from == v) second_neighbour = second_neighbour_edge->to;
-				else second_neighbour = second_neighbour_edge->from;
-			}
+std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::get_link_slot(std::shared_ptr<BaseTree::Internal::Vertex> v) {
+	auto has_outer_edge = [](const std::shared_ptr<BaseTree::Internal::Vertex>& s) {
+		for (auto n: s->neighbours) if (auto ee = n.edge.lock()) if (!ee->subvertice_edge) return true;
+		return false;
+	};
+
+	// Too many removed subvertices in the queue (after cuts), rebuild it
+	if (v->link_slots.size() > 2 * v->subvertices.size()) v->link_slots.clear();
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		while (!v->link_slots.empty()) {
+			auto s = v->link_slots.front().lock();
+			if (s != NULL && s->superior_vertex == v && has_outer_edge(s)) return s;
+			v->link_slots.pop_front();
 		}
+		// Empty queue (also after load or copy of the tree) - all subvertices with outer edges in BFS order
+		for (auto s: subvertices_bfs(v->subvertices.front())) if (has_outer_edge(s)) v->link_slots.push_back(s);
 	}
 
+	std::cerr << "ERROR: No subvertex of " << *v << " has an outer edge" << std::endl;
+	exit(1);
+}
+
+std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> TopologyTopTree::Internal::subvertices_bfs(std::shared_ptr<BaseTree::Internal::Vertex> root, int* depth) const {
+	std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> order{root};
+	std::vector<int> distances{0};
+	std::unordered_set<BaseTree::Internal::Vertex*> visited{root.get()};
+	for (size_t i = 0; i < order.size(); i++) {
+		for (auto n: order[i]->neighbours) {
+			auto ee = n.edge.lock();
+			if (ee == NULL || !ee->subvertice_edge) continue;
+			auto next = (ee->from == order[i] ? ee->to : ee->from);
+			if (!visited.insert(next.get()).second) continue;
+			order.push_back(next);
+			distances.push_back(distances[i] + 1);
+		}
+	}
+	if (depth != NULL) *depth = distances.back();
+	return order;
+}
+
+std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::repair_subvertex_after_cut(std::shared_ptr<BaseTree::Internal::Vertex> v) {
+	// Subvertices of a vertex form a tree in which all subvertices have degree 3, the subvertex v has just lost one edge.
+	// Either the superior vertex has no more than 3 edges and subvertices are joined back into it, or v is removed and
+	// its two remaining neighbours are linked together (only the neighbourhood of v is changed).
+	auto superior_vertex = v->superior_vertex;
+
 	#ifdef DEBUG
 		std::cerr << "Repairing subvertex " << *v << " after cut" << std::endl;
 	#endif
 
-	if (second_neighbour == NULL) {
-		// This vertex is one of end subvertices
-		int subvertice_edges_counter = 0;
-		for (auto n: first_neighbour->neighbours) if (n.edge.lock()->subvertice_edge) subvertice_edges_counter++;
-		if (subvertice_edges_counter == 1) {
-			auto w = first_neighbour;
-			// There is second endpoint (with 2 valid edges) -> we join them back into superior vertex
-			// 1. Superior vertex may not have its TopologyCluster, create it
-			if (v->superior_vertex->topology_cluster == NULL) {
-				v->superior_vertex->topology_cluster = std::make_shared<TopologyCluster>();
-				splitted_clusters.push_back(v->superior_vertex->topology_cluster);
-				v->superior_vertex->topology_cluster->vertex = v->superior_vertex;
-				#ifdef DEBUG
-					std::cerr << "Created cluster for superior vertex " << *v->superior_vertex << " with " << v->superior_vertex->neighbours.size() << " neighbours" << std::endl;
-				#endif
-			}
-
-			// 2. Run through neighbours and cut them, saving into list
-			std::vector<std::pair<std::shared_ptr<BaseTree::Internal::Vertex>, std::shared_ptr<BaseTree::Internal::Edge>>> neighbours_list;
-			// 2.A - neighbours from the first endpoint
-			auto n = v->neighbours.begin();
-			while (n != v->neighbours.end()) {
-				// (because cut operation deletes from this std::list we need to get next pointer before calling cut)
-				auto next_n = std::next(n);
-				if (auto ee = (*n).edge.lock()) {
-					auto vv = ee->from;
-					if (vv == v) vv = ee->to;
-
-					if (!ee->subvertice_edge) neighbours_list.push_back(std::make_pair(vv, ee));
-					auto result = cut(v, vv, ee);
-					#ifdef DEBUG_GRAPHVIZ_VERBOSE
-						std::ostringstream ss;
-						ss << "Repair subvertex " << *v << " - joining into superior - after A cut ";
-						print_graphviz(std::get<0>(result), ss.str() + "1/2", true);
-						print_graphviz(std::get<1>(result), ss.str() + "2/2", true);
-					#endif
-				}
-				n = next_n;
-			}
-			// 2.B - neighbours from the second endpoint
-			n = w->neighbours.begin();
-			while (n != w->neighbours.end()) {
-				// (because cut operation deletes from this std::list we need to get next pointer before calling cut)
-				auto next_n = std::next(n);
-				if (auto ee = (*n).edge.lock()) {
-					auto vv = ee->from;
-					if (vv == w) vv = ee->to;
-
-					if (!ee->subvertice_edge) neighbours_list.push_back(std::make_pair(vv, ee));
-					auto result = cut(w, vv, ee);
-					#ifdef DEBUG_GRAPHVIZ_VERBOSE
-						std::ostringstream ss;
-						ss << "Repair subvertex " << *v << " - joining into superior - after B cut ";
-						print_graphviz(std::get<0>(result), ss.str() + "1/2", true);
-						print_graphviz(std::get<1>(result), ss.str() + "2/2", true);
-					#endif
-				}
-				n = next_n;
-			}
-			v->superior_vertex->subvertices.clear();
+	if (superior_vertex->degree <= 3) {
+		// 1. Superior vertex may not have its TopologyCluster, create it
+		if (superior_vertex->topology_cluster == NULL) {
+			superior_vertex->topology_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
+			splitted_clusters.push_back(superior_vertex->topology_cluster);
+			superior_vertex->topology_cluster->vertex = superior_vertex;
+			#ifdef DEBUG
+				std::cerr << "Created cluster for superior vertex " << *superior_vertex << " with " << superior_vertex->neighbours.size() << " neighbours" << std::endl;
+			#endif
+		}
 
-			// 3. Connect all to the superior vertex
-			std::shared_ptr<TopologyCluster> result;
-			for (auto n: neighbours_list) {
-				result = link(v->superior_vertex, n.first, n.second);
+		// 2. Cut all edges of all subvertices, saving the outer ones into list
+		std::vector<std::pair<std::shared_ptr<BaseTree::Internal::Vertex>, std::shared_ptr<BaseTree::Internal::Edge>>> neighbours_list;
+		auto subvertices = superior_vertex->subvertices;
+		for (auto subvertex: subvertices) {
+			// (cut operation removes edges from the neighbours of the subvertex, so get them first)
+			std::vector<std::shared_ptr<BaseTree::Internal::Edge>> edges;
+			for (auto n: subvertex->neighbours) if (auto ee = n.edge.lock()) edges.push_back(ee);
+			for (auto ee: edges) {
+				auto vv = ee->from;
+				if (vv == subvertex) vv = ee->to;
+
+				if (!ee->subvertice_edge) neighbours_list.push_back(std::make_pair(vv, ee));
+				auto result = cut(subvertex, vv, ee);
 				#ifdef DEBUG_GRAPHVIZ_VERBOSE
 					std::ostringstream ss;
-					ss << "Repair subvertex " << *v << " - joining into superior - after link";
-					print_graphviz(result, ss.str(), true);
+					ss << "Repair subvertex " << *v << " - joining into superior - after cut ";
+					print_graphviz(std::get<0>(result), ss.str() + "1/2", true);
+					print_graphviz(std::get<1>(result), ss.str() + "2/2", true);
 				#endif
 			}
+		}
+		superior_vertex->subvertices.clear();
+		superior_vertex->subvertice_edges.clear();
+		superior_vertex->link_slots.clear();
+
+		// 3. Connect all to the superior vertex
+		std::shared_ptr<TopologyCluster> result;
+		for (auto n: neighbours_list) {
+			result = link(superior_vertex, n.first, n.second);
+			#ifdef DEBUG_GRAPHVIZ_VERBOSE
+				std::ostringstream ss;
+				ss << "Repair subvertex " << *v << " - joining into superior - after link";
+				print_graphviz(result, ss.str(), true);
+			#endif
+		}
 
-			auto superior_vertex = v->superior_vertex;
-			v->unlink();
-			w->unlink();
+		for (auto subvertex: subvertices) subvertex->unlink();
 
-			return superior_vertex;
-		} else {
-			// We "steal" one edge from the neighbour and then we repair on this vertex
-			for (auto n: first_neighbour->neighbours) {
-				if (auto ee = n.edge.lock()) {
-					// Get opposite vertex
-					auto vv = ee->from;
-					if (vv == first_neighbour) vv = ee->to;
-					if (!ee->subvertice_edge) {
-
-						auto result = cut(first_neighbour, vv, ee);
-						#ifdef DEBUG_GRAPHVIZ_VERBOSE
-							std::ostringstream ss;
-							ss << "Repair subvertex " << *v << " - stealing from neighbour - after cut ";
-							print_graphviz(std::get<0>(result), ss.str() + "1/2", true);
-							print_graphviz(std::get<1>(result), ss.str() + "2/2", true);
-						#endif
-						auto result2 = link(v, vv, ee);
-						#ifdef DEBUG_GRAPHVIZ_VERBOSE
-							ss.clear();
-							ss << "Repair subvertex " << *v << " - stealing from neighbour - after link";
-							print_graphviz(result2, ss.str(), true);
-						#endif
-						break;
-					}
-				}
-			}
-			return repair_subvertex_after_cut(first_neighbour);
-		}
-	} else {
-		// It is vertex inside "chain" -> remove it and join neighbours
-		auto result = cut(first_neighbour, v, first_neighbour_edge);
+		return superior_vertex;
+	}
+
+	// Get remaining edges of v
+	std::vector<std::shared_ptr<BaseTree::Internal::Edge>> edges;
+	for (auto n: v->neighbours) if (auto ee = n.edge.lock()) edges.push_back(ee);
+	if (edges.size() > 2) return v; // still has degree 3 (nothing to repair)
+	// Subvertice edge first (the other one could be an outer edge)
+	if (edges.size() == 2 && !edges[0]->subvertice_edge) std::swap(edges[0], edges[1]);
+	if (edges.empty() || !edges[0]->subvertice_edge) {
+		std::cerr << "ERROR: Subvertex " << *v << " is not connected to other subvertices" << std::endl;
+		exit(1);
+	}
+
+	// Remove v from the tree of subvertices
+	std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> neighbours;
+	for (auto ee: edges) {
+		auto vv = ee->from;
+		if (vv == v) vv = ee->to;
+		neighbours.push_back(vv);
+
+		auto result = cut(v, vv, ee);
 		#ifdef DEBUG_GRAPHVIZ_VERBOSE
 			std::ostringstream ss;
-			ss << "Repair subvertex " << *v << " - ";
-			print_graphviz(std::get<0>(result), ss.str() + "After first chain cut 1/2", true);
-			print_graphviz(std::get<1>(result), ss.str() + "After first chain cut 2/2", true);
-		#endif
-		v->superior_vertex->subvertice_edges.erase(first_neighbour_edge->subvertice_edges_iterator); // erase first subvertice edge
-		result = cut(second_neighbour, v, second_neighbour_edge);
-		#ifdef DEBUG_GRAPHVIZ_VERBOSE
-			print_graphviz(std::get<0>(result), ss.str() + "After second chain cut 1/2", true);
-			print_graphviz(std::get<1>(result), ss.str() + "After second chain cut 2/2", true);
+			ss << "Repair subvertex " << *v << " - removing subvertex - after cut ";
+			print_graphviz(std::get<0>(result), ss.str() + "1/2", true);
+			print_graphviz(std::get<1>(result), ss.str() + "2/2", true);
 		#endif
-		auto result2 = link(first_neighbour, second_neighbour, second_neighbour_edge); // reuse second subvertice edge
-		#ifdef DEBUG_GRAPHVIZ_VERBOSE
-			print_graphviz(result2, ss.str() + "After chain link", true);
-		#endif
-		// Delete vertex from supervertice's subvertices list
-		v->superior_vertex->subvertices.erase(v->superior_vertex_subvertices_iter);
-		v->unlink();
-		return first_neighbour;
 	}
+	superior_vertex->remove_subvertice_edge(edges[0]); // erase first subvertice edge
+	superior_vertex->remove_subvertex(v);
+	v->unlink();
+
+	if (edges.size() == 1) {
+		// v was a leaf of the tree of subvertices, now its neighbour lost an edge
+		return repair_subvertex_after_cut(neighbours[0]);
+	}
+
+	// Link both neighbours, reusing the second edge (outer edge stays outer, subvertice edge stays in the list)
+	auto result2 = link(neighbours[0], neighbours[1], edges[1]);
+	#ifdef DEBUG_GRAPHVIZ_VERBOSE
+		std::ostringstream ss;
+		ss << "Repair subvertex " << *v << " - after link of neighbours";
+		print_graphviz(result2, ss.str(), true);
+	#endif
+	return neighbours[0];
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Expose
 
-std::list<std::shared_ptr<SimpleCluster>> TopologyTopTree::Internal::expose_get_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> second_v, bool continue_above_common) {
+std::list<std::shared_ptr<SimpleCluster>> TopologyTopTree::Internal::expose_get_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> second_v, std::shared_ptr<TopologyCluster> last_cluster, bool continue_above_common, expose_state& state) const {
 	std::list<std::shared_ptr<SimpleCluster>> list;
 
-	auto last_cluster = v->topology_cluster;
 	auto cluster = last_cluster->parent; // we starts one level above base cluster
 	bool was_added = false;
 	while (cluster != NULL) {
@@ -1100,21 +1269,14 @@ std::list<std::shared_ptr<SimpleCluster>> TopologyTopTree::Internal::expose_get_
 						std::cerr << "    Adding first cluster " << *last_cluster << std::endl;
 					#endif
 
-					std::shared_ptr<ICluster> first = NULL;
-					std::shared_ptr<ICluster> second = NULL;
-					if (last_cluster->first != NULL && last_cluster->first->is_top_cluster) first = last_cluster->first;
-					if (last_cluster->second != NULL && last_cluster->second->is_top_cluster) {
-						if (first == NULL) first = last_cluster->second;
-						else second = last_cluster->second;
-					}
-
-					auto new_simple_cluster = SimpleCluster::construct(first, second);
+					// (cluster is splitted now, it is joined again when both lists are known and the copy takes its data then)
+					auto new_simple_cluster = SimpleCluster::construct(last_cluster, NULL, functions.get(), state.pool);
 					new_simple_cluster->boundary_left = last_cluster->boundary_left;
 					new_simple_cluster->boundary_right = last_cluster->boundary_right;
 					//new_simple_cluster->data = last_cluster->data;
-					CopyClusterData(last_cluster, new_simple_cluster);
+					functions->CopyClusterData(*last_cluster, *new_simple_cluster);
 					new_simple_cluster->edge = last_cluster->edge;
-					expose_simple_clusters.push_back(new_simple_cluster); // to allow splitting it in Restore operation
+					state.simple_clusters.push_back(new_simple_cluster); // to allow splitting it in Restore operation
 					list.push_back(new_simple_cluster);
 				}
 				was_added = true;
@@ -1135,22 +1297,26 @@ std::list<std::shared_ptr<SimpleCluster>> TopologyTopTree::Internal::expose_get_
 
 				std::shared_ptr<SimpleCluster> edge_cluster = NULL;
 				if (!cluster->edge->subvertice_edge) {
-					edge_cluster = std::make_shared<SimpleCluster>();
+					edge_cluster = SimpleCluster::create(functions.get(), state.pool);
 					edge_cluster->boundary_left = cluster->edge->from;
 					edge_cluster->boundary_right = cluster->edge->to;
 					edge_cluster->edge = cluster->edge;
-					expose_simple_clusters.push_back(edge_cluster); // to allow splitting it in Restore operation
-					Create(edge_cluster, cluster->edge->data);
+					state.simple_clusters.push_back(edge_cluster); // to allow splitting it in Restore operation
+					// (after read-only split the EdgeData are not updated, but the edge cluster keeps the data)
+					if (state.read_only) functions->CopyClusterData(*cluster->edge_cluster, *edge_cluster);
+					else functions->Create(*edge_cluster, cluster->edge->data);
 				}
 
 				std::shared_ptr<SimpleCluster> sibling_cluster = NULL;
 				if (sibling->is_top_cluster && !sibling->is_splitted) {
-					sibling_cluster = SimpleCluster::construct(sibling->first, sibling->second);
+					// (sibling is joined, its data are copied back in the Restore)
+					sibling_cluster = SimpleCluster::construct(sibling, NULL, functions.get(), state.pool);
 					sibling_cluster->boundary_left = sibling->boundary_left;
 					sibling_cluster->boundary_right = sibling->boundary_right;
 					//sibling_cluster->data = sibling->data;
-					CopyClusterData(sibling, sibling_cluster);
+					functions->CopyClusterData(*sibling, *sibling_cluster);
 					sibling_cluster->edge = sibling->edge;
+					state.simple_clusters.push_back(sibling_cluster); // to allow splitting it in Restore operation
 				}
 
 				std::shared_ptr<SimpleCluster> new_cluster = NULL;
@@ -1160,19 +1326,19 @@ std::list<std::shared_ptr<SimpleCluster>> TopologyTopTree::Internal::expose_get_
 							  << " with cluster with endpoints " << *sibling_cluster->boundary_left << "-" << *sibling_cluster->boundary_right << std::endl;
 					#endif
 					// Combine them into one newly created SimpleCluster
-					auto new_simple_cluster = SimpleCluster::construct(edge_cluster, sibling);
+					auto new_simple_cluster = SimpleCluster::construct(edge_cluster, sibling_cluster, functions.get(), state.pool);
 					if (sibling->is_rake_branch) {
 						new_simple_cluster->boundary_left = edge_cluster->boundary_left;
 						new_simple_cluster->boundary_right = edge_cluster->boundary_right;
 					} else {
 						// Find common vertex and construct compress cluster around it
-						auto common_vertex = TopologyCluster::get_common_vertex(sibling_cluster, edge_cluster, !cluster->edge->subvertice_edge);
+						auto common_vertex = TopologyCluster::get_common_vertex(sibling_cluster, edge_cluster);
 
 						new_simple_cluster->boundary_left = (common_vertex == edge_cluster->boundary_left || common_vertex == edge_cluster->boundary_left->superior_vertex ? edge_cluster->boundary_right : edge_cluster->boundary_left);
 						new_simple_cluster->boundary_right = (common_vertex == sibling_cluster->boundary_left || common_vertex == sibling_cluster->boundary_left->superior_vertex ? sibling_cluster->boundary_right : sibling_cluster->boundary_left);
 					}
-					Join(edge_cluster, sibling_cluster, new_simple_cluster);
-					expose_simple_clusters.push_back(new_simple_cluster); // to allow splitting it in Restore operation
+					functions->Join(*edge_cluster, *sibling_cluster, *new_simple_cluster);
+					state.simple_clusters.push_back(new_simple_cluster); // to allow splitting it in Restore operation
 					new_cluster = new_simple_cluster;
 				} else if (edge_cluster != NULL) new_cluster = edge_cluster;
 				else if (sibling_cluster != NULL) new_cluster = sibling_cluster;
@@ -1191,16 +1357,17 @@ std::list<std::shared_ptr<SimpleCluster>> TopologyTopTree::Internal::expose_get_
 	return list;
 }
 
-std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_join_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> target, std::shared_ptr<SimpleCluster> parent_cluster) {
+std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_join_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> target, std::shared_ptr<SimpleCluster> parent_cluster, expose_state& state) const {
 	#ifdef DEBUG
 		std::cerr << "Starting joining from vertex " << *v << std::endl;
 	#endif
 
 	// If this is leaf
-	if ((parent_cluster != NULL && v->expose_clusters.size() == 1) || v->expose_clusters.size() == 0) return parent_cluster;
+	const auto& expose_clusters = state.vertex_clusters[v.get()];
+	if ((parent_cluster != NULL && expose_clusters.size() == 1) || expose_clusters.size() == 0) return parent_cluster;
 
 	std::shared_ptr<SimpleCluster> constructed_cluster = NULL;
-	for (auto c: v->expose_clusters) {
+	for (auto c: expose_clusters) {
 		if (c == parent_cluster) continue;
 
 		auto other_vertex = BaseTree::Internal::Vertex::get_superior(c->boundary_left);
@@ -1208,14 +1375,14 @@ std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_join_clusters(s
 		std::shared_ptr<SimpleCluster> child_cluster;
 
 		if (other_vertex == v) child_cluster = c; // cluster around subvertice edge, there is no continuation from it
-		else child_cluster = expose_join_clusters(other_vertex, target, c);
+		else child_cluster = expose_join_clusters(other_vertex, target, c, state);
 
 		if (constructed_cluster == NULL) constructed_cluster = child_cluster;
 		else {
 			// We do rake join
 			// 1. Construct cluster
-			auto new_cluster = SimpleCluster::construct(constructed_cluster, child_cluster);
-			expose_simple_clusters.push_back(new_cluster); // to allow splitting it in Restore operation
+			auto new_cluster = SimpleCluster::construct(constructed_cluster, child_cluster, functions.get(), state.pool);
+			state.simple_clusters.push_back(new_cluster); // to allow splitting it in Restore operation
 
 			// 2. Set boundaries
 			other_vertex = BaseTree::Internal::Vertex::get_superior(child_cluster->boundary_left);
@@ -1237,15 +1404,15 @@ std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_join_clusters(s
 			#endif
 
 			// 3. Join itself
-			Join(constructed_cluster, child_cluster, new_cluster);
+			functions->Join(*constructed_cluster, *child_cluster, *new_cluster);
 			constructed_cluster = new_cluster;
 		}
 	}
 
 	if (parent_cluster == NULL) return constructed_cluster;
 
-	auto new_cluster = SimpleCluster::construct(parent_cluster, constructed_cluster);
-	expose_simple_clusters.push_back(new_cluster); // to allow splitting it in Restore operation
+	auto new_cluster = SimpleCluster::construct(parent_cluster, constructed_cluster, functions.get(), state.pool);
+	state.simple_clusters.push_back(new_cluster); // to allow splitting it in Restore operation
 	if (v == target) {
 		// Rake onto parent_cluster
 		new_cluster->boundary_left = parent_cluster->boundary_left;
@@ -1261,7 +1428,7 @@ std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_join_clusters(s
 			<< *constructed_cluster->boundary_left << "-" << *constructed_cluster->boundary_right << " into "
 			<< *new_cluster->boundary_left << "-" << *new_cluster->boundary_right << std::endl;
 	#endif
-	Join(parent_cluster, constructed_cluster, new_cluster);
+	functions->Join(*parent_cluster, *constructed_cluster, *new_cluster);
 
 	return new_cluster;
 }
@@ -1269,10 +1436,69 @@ std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_join_clusters(s
 std::shared_ptr<ICluster> TopologyTopTree::Expose(int v_index, int w_index) {
 	// Restore previous expose (if needed)
 	Restore();
+	return internal->expose(v_index, w_index);
+}
+
+void TopologyTopTree::QueryPaths(const std::vector<std::pair<int, int>>& paths, std::function<void(size_t, std::shared_ptr<ICluster>)> callback) {
+	Restore();
+	auto& vertices = internal->base_tree->internal->vertices;
+	auto base_cluster = [&vertices](int v) {
+		auto vertex = vertices[v];
+		if (!vertex->subvertices.empty()) vertex = vertex->subvertices.front();
+		return vertex->topology_cluster;
+	};
+
+	// 1. Order queries by positions of their endpoints in the hierarchy (child choices from the root), so consecutive
+	// queries share upper parts of their root paths. Same paths (also with swapped endpoints) get next to each other.
+	struct query {
+		std::string position_v, position_w;
+		int v, w;
+		size_t index;
+	};
+	auto position = [&base_cluster](int v) {
+		std::string position;
+		for (auto c = base_cluster(v); c != NULL && c->parent != NULL; c = c->parent) position.push_back(c == c->parent->first ? '0' : '1');
+		std::reverse(position.begin(), position.end());
+		return position;
+	};
+	std::vector<query> queries;
+	queries.reserve(paths.size());
+	for (size_t i = 0; i < paths.size(); i++) {
+		query q{position(paths[i].first), position(paths[i].second), paths[i].first, paths[i].second, i};
+		if (std::tie(q.position_w, q.w) < std::tie(q.position_v, q.v)) {
+			std::swap(q.position_v, q.position_w);
+			std::swap(q.v, q.w);
+		}
+		queries.push_back(std::move(q));
+	}
+	std::sort(queries.begin(), queries.end(), [](const query& a, const query& b) {
+		return std::tie(a.position_v, a.position_w, a.v, a.w) < std::tie(b.position_v, b.position_w, b.v, b.w);
+	});
+
+	// 2. Between queries only clusters which the next query does not split are joined back (clusters on its root paths
+	// stay splitted, so the shared upper parts are splitted and joined once for the whole batch)
+	std::unordered_set<TopologyCluster*> next_paths;
+	for (size_t i = 0; i < queries.size(); i++) {
+		next_paths.clear();
+		for (int x: {queries[i].v, queries[i].w}) {
+			for (auto c = base_cluster(x); c != NULL; c = c->parent) next_paths.insert(c.get());
+		}
+		internal->restore(false, &next_paths);
+
+		auto cluster = internal->expose(queries[i].v, queries[i].w);
+		size_t j = i;
+		for (; j < queries.size() && queries[j].v == queries[i].v && queries[j].w == queries[i].w; j++) callback(queries[j].index, cluster);
+		i = j - 1;
+	}
+	RestoreReadOnly();
+}
+
+std::shared_ptr<ICluster> TopologyTopTree::Internal::expose(int v_index, int w_index) {
+	TOP_TREE_COUNT(exposes, 1);
 
 	// 0. Get vertices and their clusters
-	auto v = internal->base_tree->internal->vertices[v_index];
-	auto w = internal->base_tree->internal->vertices[w_index];
+	auto v = base_tree->internal->vertices[v_index];
+	auto w = base_tree->internal->vertices[w_index];
 
 	#ifdef DEBUG
 		std::cerr << "Starting Expose of path between " << *v << " and " << *w << std::endl;
@@ -1285,7 +1511,7 @@ std::shared_ptr<ICluster> TopologyTopTree::Expose(int v_index, int w_index) {
 		return NULL;
 	}
 
-	if (!internal->in_same_tree(v, w)) {
+	if (!in_same_tree(v, w)) {
 		#ifdef WARNINGS
 			std::cerr << "WARNING: Vertices " << *v << " and " << *w << " are not linked in the same tree, cannot expose path between them" << std::endl;
 		#endif
@@ -1300,14 +1526,30 @@ std::shared_ptr<ICluster> TopologyTopTree::Expose(int v_index, int w_index) {
 	auto cluster_w = w->topology_cluster;
 
 	// 1. Split from both base clusters
-	cluster_v->do_split(&internal->splitted_clusters);
-	cluster_w->do_split(&internal->splitted_clusters);
+	cluster_v->do_split(&splitted_clusters);
+	cluster_w->do_split(&splitted_clusters);
 
+	expose_state state{expose_simple_clusters, false, simple_pool.get()};
+	return expose_path(v, w, cluster_v, cluster_w, state);
+}
 
+std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::expose_path(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Vertex> w, std::shared_ptr<TopologyCluster> cluster_v, std::shared_ptr<TopologyCluster> cluster_w, expose_state& state) const {
 	// 2. Get all clusters that contains v/w as non-boundary vertex and save them into two lists
-	auto first_list = internal->expose_get_clusters(v, w, true);
-	auto second_list = internal->expose_get_clusters(w, v, false);
-	// 2.1 Join lists (second in reverse order)
+	auto first_list = expose_get_clusters(v, w, cluster_v, true, state);
+	auto second_list = expose_get_clusters(w, v, cluster_w, false, state);
+	// 2.1 Whole clusters at the start of both lists were splitted (as ancestors of the base clusters), their data could
+	// be stale after pushing them down, so join them again (Restore splits them with the data of the copies)
+	if (!state.read_only) {
+		for (auto list: {&first_list, &second_list}) {
+			for (auto &c: *list) {
+				auto original = std::dynamic_pointer_cast<TopologyCluster>(c->first);
+				if (original == NULL || !original->is_splitted) continue;
+				original->do_join();
+				functions->CopyClusterData(*original, *c);
+			}
+		}
+	}
+	// 2.2 Join lists (second in reverse order)
 	std::list<std::shared_ptr<SimpleCluster>> clusters_list;
 	for (auto it = first_list.begin(); it != first_list.end(); ++it) clusters_list.push_back(*it);
 	for (auto it = second_list.rbegin(); it != second_list.rend(); ++it) clusters_list.push_back(*it);
@@ -1318,46 +1560,114 @@ std::shared_ptr<ICluster> TopologyTopTree::Expose(int v_index, int w_index) {
 		std::cerr << std::endl;
 	#endif
 
-	// 3. Make graph from all clusters
-	// 3.1 Empty all vertices
-	for (auto c: clusters_list) {
-		BaseTree::Internal::Vertex::get_superior(c->boundary_left)->expose_clusters.clear();
-		BaseTree::Internal::Vertex::get_superior(c->boundary_right)->expose_clusters.clear();
-	}
-	// 3.2 Register each cluster
+	// 3. Make graph from all clusters (register each cluster at its boundary vertices)
 	for (auto c: clusters_list) {
-		BaseTree::Internal::Vertex::get_superior(c->boundary_left)->expose_clusters.push_back(c);
-		BaseTree::Internal::Vertex::get_superior(c->boundary_right)->expose_clusters.push_back(c);
+		state.vertex_clusters[BaseTree::Internal::Vertex::get_superior(c->boundary_left).get()].push_back(c);
+		state.vertex_clusters[BaseTree::Internal::Vertex::get_superior(c->boundary_right).get()].push_back(c);
 	}
 
 	// 4. Run DFS
-	auto final_cluster = internal->expose_join_clusters(BaseTree::Internal::Vertex::get_superior(v), BaseTree::Internal::Vertex::get_superior(w), NULL);
+	auto final_cluster = expose_join_clusters(BaseTree::Internal::Vertex::get_superior(v), BaseTree::Internal::Vertex::get_superior(w), NULL, state);
 	#ifdef DEBUG
 		std::cerr << "Final cluster is: " << *final_cluster->boundary_left << "-" << *final_cluster->boundary_right << std::endl;
 	#endif
 
-	// Cleaning
-	for (auto c: clusters_list) {
-		BaseTree::Internal::Vertex::get_superior(c->boundary_left)->expose_clusters.clear();
-		BaseTree::Internal::Vertex::get_superior(c->boundary_right)->expose_clusters.clear();
+	return final_cluster;
+}
+
+std::shared_ptr<ICluster> TopologyTopTree::QueryPath(int v_index, int w_index) const {
+	// 0. Get vertices and their clusters
+	auto v = internal->base_tree->internal->vertices[v_index];
+	auto w = internal->base_tree->internal->vertices[w_index];
+
+	#ifdef DEBUG
+		std::cerr << "Starting read-only query of path between " << *v << " and " << *w << std::endl;
+	#endif
+
+	if (!internal->expose_simple_clusters.empty()) {
+		std::cerr << "ERROR: Cannot query path between " << *v << " and " << *w << " before Restore of the previous Expose" << std::endl;
+		return NULL;
+	}
+	if (v_index == w_index || !internal->in_same_tree(v, w)) {
+		#ifdef WARNINGS
+			std::cerr << "WARNING: Cannot query path between " << *v << " and " << *w << std::endl;
+		#endif
+		return NULL;
 	}
 
-	return final_cluster;
+	if (!v->subvertices.empty()) v = v->subvertices.front();
+	if (!w->subvertices.empty()) w = w->subvertices.front();
+
+	// 1. Copy clusters on the paths to the root and their children (only these are touched by splitting)
+	std::unordered_map<TopologyCluster*, std::shared_ptr<TopologyCluster>> copies;
+	for (auto c: {v->topology_cluster, w->topology_cluster}) {
+		for (; c != NULL; c = c->parent) {
+			for (auto cc: {c, c->first, c->second}) {
+				if (cc != NULL && copies.find(cc.get()) == copies.end()) copies[cc.get()] = internal->clone_cluster(cc);
+			}
+		}
+	}
+	// 1.1 Redirect copies to each other (children of siblings stay original, they are never splitted)
+	auto get_copy = [&copies](const std::shared_ptr<TopologyCluster>& c) {
+		if (c == NULL) return c;
+		auto it = copies.find(c.get());
+		return (it != copies.end() ? it->second : c);
+	};
+	for (auto &c: copies) {
+		c.second->parent = get_copy(c.second->parent);
+		c.second->first = get_copy(c.second->first);
+		c.second->second = get_copy(c.second->second);
+	}
+	auto cluster_v = copies[v->topology_cluster.get()];
+	auto cluster_w = copies[w->topology_cluster.get()];
+
+	// 2. Split copies and expose on them
+	cluster_v->do_split(NULL, true);
+	cluster_w->do_split(NULL, true);
+
+	std::vector<std::shared_ptr<SimpleCluster>> simple_clusters;
+	Internal::expose_state state{simple_clusters, true, NULL};
+	auto final_cluster = internal->expose_path(v, w, cluster_v, cluster_w, state);
+	auto result = internal->clone_cluster(std::static_pointer_cast<ICluster>(final_cluster));
+
+	// 3. Break cycles between temporary clusters
+	for (auto c: simple_clusters) c->unlink();
+	for (auto &c: copies) c.second->unlink();
+
+	return result;
+}
+
+bool TopologyTopTree::Connected(int v_index, int w_index) const {
+	if (v_index == w_index) return true;
+	return internal->in_same_tree(internal->base_tree->internal->vertices[v_index], internal->base_tree->internal->vertices[w_index]);
+}
+
+std::shared_ptr<ICluster> TopologyTopTree::FindRoot(int v_index) const {
+	return internal->find_root(internal->base_tree->internal->vertices[v_index]);
 }
 
 void TopologyTopTree::Restore() {
-	if (internal->expose_simple_clusters.empty()) return; // no need to restore anything
+	internal->restore(true);
+}
+
+void TopologyTopTree::RestoreReadOnly() {
+	internal->restore(false);
+}
+
+void TopologyTopTree::Internal::restore(bool split_simple_clusters, const std::unordered_set<TopologyCluster*>* keep_splitted) {
+	if (expose_simple_clusters.empty() && splitted_clusters.empty()) return; // no need to restore anything
 
 	#ifdef DEBUG
 		std::cerr << "Restore STARTED " << std::endl;
 	#endif
 
-	// 1. Split temporary clusters
-	for (auto c: internal->expose_simple_clusters) {
-		c->do_split();
+	// 1. Split temporary clusters (their data were not changed after read-only expose, so they could be just dropped)
+	for (auto &c: expose_simple_clusters) {
+		if (split_simple_clusters) c->do_split();
 		c->unlink(true);
 	}
-	internal->expose_simple_clusters.clear();
+	for (auto &c: expose_simple_clusters) simple_pool->put(c); // after all unlinks, so parents are not held by children
+	expose_simple_clusters.clear();
 
 	#ifdef DEBUG
 		std::cerr << "Restore - simple clusters all splitted " << std::endl;
@@ -1366,18 +1676,23 @@ void TopologyTopTree::Restore() {
 
 	// 2. Join original clusters
 	// 2.1 Firstly ensure that they are already splitted
-	for (auto c: internal->splitted_clusters) c->do_split();
-	// 2.2 Join them back
-	for (auto c: internal->splitted_clusters) {
-		while (c != NULL && c->is_splitted) {
+	for (auto c: splitted_clusters) c->do_split();
+	// 2.2 Join them back (kept clusters are on root paths, so their parents are kept too)
+	auto keep = [keep_splitted](const std::shared_ptr<TopologyCluster>& c) {
+		return keep_splitted != NULL && keep_splitted->count(c.get()) > 0;
+	};
+	std::vector<std::shared_ptr<TopologyCluster>> kept;
+	for (auto c: splitted_clusters) {
+		if (keep(c) && c->is_splitted) kept.push_back(c);
+		while (c != NULL && c->is_splitted && !keep(c)) {
 			c->do_join();
 			c = c->parent;
 		}
 	}
-	internal->splitted_clusters.clear();
+	splitted_clusters.swap(kept);
 
 	#ifdef DEBUG_GRAPHVIZ
-		for (auto root_cluster: internal->root_clusters) internal->print_graphviz(root_cluster, "After RESTORE", true);
+		for (auto root_cluster: root_clusters) print_graphviz(root_cluster, "After RESTORE", true);
 	#endif
 
 	#ifdef DEBUG
@@ -1385,6 +1700,201 @@ void TopologyTopTree::Restore() {
 	#endif
 }
 
+std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::clone_cluster(const std::shared_ptr<TopologyCluster>& cluster) const {
+	auto clone = std::make_shared<TopologyCluster>(*cluster);
+	clone->simple_pool = NULL; // temporary copy, it could be used by concurrent readers
+	clone->data = functions->InitClusterData();
+	functions->CopyClusterData(*cluster, *clone);
+	if (cluster->edge_cluster != NULL) clone->edge_cluster = clone_cluster(cluster->edge_cluster);
+	if (cluster->combined_edge_cluster != NULL) clone->combined_edge_cluster = clone_cluster(cluster->combined_edge_cluster);
+	return clone;
+}
+
+std::shared_ptr<SimpleCluster> TopologyTopTree::Internal::clone_cluster(const std::shared_ptr<ICluster>& cluster) const {
+	auto clone = std::make_shared<SimpleCluster>(functions.get());
+	clone->boundary_left = cluster->boundary_left;
+	clone->boundary_right = cluster->boundary_right;
+	functions->CopyClusterData(*cluster, *clone);
+	return clone;
+}
+
+void TopologyTopTree::Save(const std::string& path, IDataSerializer& serializer) {
+	Restore();
+
+	std::ofstream o(path, std::ios::binary);
+	writeHeader(o, SerializedEngine::Topology);
+
+	// 1. Base tree (with subvertices)
+	std::unordered_map<BaseTree::Internal::Vertex*, int> vertex_ids;
+	std::unordered_map<BaseTree::Internal::Edge*, int> edge_ids;
+	internal->base_tree->internal->save(o, serializer, vertex_ids, edge_ids);
+
+	// 2. Number all clusters under the current roots (parents are before their children)
+	std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> all_vertices(vertex_ids.size());
+	for (auto &v: internal->base_tree->internal->vertices) {
+		all_vertices[vertex_ids[v.get()]] = v;
+		for (auto &s: v->subvertices) all_vertices[vertex_ids[s.get()]] = s;
+	}
+	std::unordered_map<TopologyCluster*, int> cluster_ids;
+	std::vector<std::shared_ptr<TopologyCluster>> clusters;
+	std::vector<int> roots;
+	for (auto &v: all_vertices) {
+		auto root = v->topology_cluster;
+		if (root == NULL) continue;
+		while (root->parent != NULL) root = root->parent;
+		if (cluster_ids.find(root.get()) != cluster_ids.end()) continue;
+
+		roots.push_back(clusters.size());
+		std::vector<std::shared_ptr<TopologyCluster>> stack{root};
+		while (!stack.empty()) {
+			auto cluster = stack.back();
+			stack.pop_back();
+			cluster_ids[cluster.get()] = clusters.size();
+			clusters.push_back(cluster);
+			if (cluster->first != NULL) stack.push_back(cluster->first);
+			if (cluster->second != NULL) stack.push_back(cluster->second);
+		}
+	}
+
+	// 3. Clusters
+	auto vertex_id = [&vertex_ids](const std::shared_ptr<BaseTree::Internal::Vertex>& v) {
+		auto it = (v == NULL ? vertex_ids.end() : vertex_ids.find(v.get()));
+		return (it == vertex_ids.end() ? -1 : it->second);
+	};
+	auto edge_id = [&edge_ids](const std::shared_ptr<BaseTree::Internal::Edge>& e) {
+		auto it = (e == NULL ? edge_ids.end() : edge_ids.find(e.get()));
+		return (it == edge_ids.end() ? -1 : it->second);
+	};
+	auto cluster_id = [&cluster_ids](const std::shared_ptr<TopologyCluster>& c) {
+		auto it = (c == NULL ? cluster_ids.end() : cluster_ids.find(c.get()));
+		return (it == cluster_ids.end() ? -1 : it->second);
+	};
+	auto save_simple_cluster = [&](const std::shared_ptr<ICluster>& c) {
+		writeValue<int32_t>(o, vertex_id(c->boundary_left));
+		writeValue<int32_t>(o, vertex_id(c->boundary_right));
+		serializer.SaveClusterData(o, *c);
+	};
+
+	writeValue<int32_t>(o, clusters.size());
+	for (auto &c: clusters) {
+		writeValue<int32_t>(o, cluster_id(c->parent));
+		writeValue<int32_t>(o, cluster_id(c->first));
+		writeValue<int32_t>(o, cluster_id(c->second));
+		writeValue<int32_t>(o, edge_id(c->edge));
+		writeValue<int32_t>(o, vertex_id(c->vertex));
+		writeValue<int32_t>(o, vertex_id(c->boundary_left));
+		writeValue<int32_t>(o, vertex_id(c->boundary_right));
+		writeValue<bool>(o, c->is_top_cluster);
+		writeValue<bool>(o, c->is_rake_branch);
+		writeValue<int32_t>(o, c->outer_edges_count);
+		writeValue<int32_t>(o, c->outer_edges.size());
+		for (auto &n: c->outer_edges) {
+			writeValue<int32_t>(o, edge_id(n.edge));
+			writeValue<int32_t>(o, cluster_id(n.cluster));
+		}
+		serializer.SaveClusterData(o, *c);
+
+		// Edge clusters (combined edge cluster may be the same as the edge cluster)
+		writeValue<bool>(o, c->edge_cluster != NULL);
+		if (c->edge_cluster != NULL) save_simple_cluster(c->edge_cluster);
+		int32_t combined = (c->combined_edge_cluster == NULL ? 0 : (c->combined_edge_cluster == c->edge_cluster ? 1 : 2));
+		writeValue<int32_t>(o, combined);
+		if (combined == 2) save_simple_cluster(c->combined_edge_cluster);
+	}
+
+	writeValue<int32_t>(o, roots.size());
+	for (auto r: roots) writeValue<int32_t>(o, r);
+	for (auto &v: all_vertices) writeValue<int32_t>(o, cluster_id(v->topology_cluster));
+
+	if (!o) {
+		std::cerr << "ERROR: Cannot write top tree into " << path << std::endl;
+		exit(1);
+	}
+}
+
+void TopologyTopTree::Load(const std::string& path, IDataSerializer& serializer) {
+	if (internal->base_tree != NULL) {
+		std::cerr << "ERROR: Top tree is already initialized, it cannot be loaded" << std::endl;
+		exit(1);
+	}
+	std::ifstream i(path, std::ios::binary);
+	if (!i) {
+		std::cerr << "ERROR: Cannot read top tree from " << path << std::endl;
+		exit(1);
+	}
+	readHeader(i, SerializedEngine::Topology);
+
+	// 1. Base tree (with subvertices)
+	internal->base_tree = std::make_shared<BaseTree>();
+	std::vector<std::shared_ptr<BaseTree::Internal::Vertex>> vertices;
+	std::vector<std::shared_ptr<BaseTree::Internal::Edge>> edges;
+	internal->base_tree->internal->load(i, serializer, vertices, edges);
+
+	// 2. Clusters
+	std::vector<std::shared_ptr<TopologyCluster>> clusters(readCount(i, remainingBytes(i)));
+	for (auto &c: clusters) c = std::make_shared<TopologyCluster>(internal->functions.get(), internal->simple_pool.get());
+	auto get_vertex = [&](bool optional = true) {
+		int id = readId(i, vertices.size(), optional);
+		return (id < 0 ? NULL : vertices[id]);
+	};
+	auto get_edge = [&]() {
+		int id = readId(i, edges.size());
+		return (id < 0 ? NULL : edges[id]);
+	};
+	auto get_cluster = [&](bool optional = true) {
+		int id = readId(i, clusters.size(), optional);
+		return (id < 0 ? NULL : clusters[id]);
+	};
+	auto load_simple_cluster = [&]() {
+		auto c = SimpleCluster::create(internal->functions.get(), internal->simple_pool.get());
+		c->boundary_left = get_vertex(false);
+		c->boundary_right = get_vertex(false);
+		serializer.LoadClusterData(i, *c);
+		return c;
+	};
+
+	for (auto &c: clusters) {
+		c->parent = get_cluster();
+		c->first = get_cluster();
+		c->second = get_cluster();
+		c->edge = get_edge();
+		c->vertex = get_vertex();
+		c->boundary_left = get_vertex();
+		c->boundary_right = get_vertex();
+		c->is_top_cluster = readValue<bool>(i);
+		c->is_rake_branch = readValue<bool>(i);
+		c->outer_edges_count = readCount(i, edges.size());
+		c->outer_edges.resize(readCount(i, edges.size()));
+		for (auto &n: c->outer_edges) {
+			n.edge = get_edge();
+			n.cluster = get_cluster();
+		}
+		serializer.LoadClusterData(i, *c);
+
+		if (readValue<bool>(i)) c->edge_cluster = load_simple_cluster();
+		int32_t combined = readValue<int32_t>(i);
+		if (combined < 0 || combined > 2 || (combined == 1 && c->edge_cluster == NULL)) readError("wrong combined edge cluster");
+		if (combined == 1) c->combined_edge_cluster = c->edge_cluster;
+		else if (combined == 2) c->combined_edge_cluster = load_simple_cluster();
+
+		c->is_splitted = false;
+	}
+
+	int32_t roots = readCount(i, clusters.size());
+	for (int32_t r = 0; r < roots; r++) {
+		auto root = get_cluster(false);
+		if (root->parent != NULL) readError("root cluster has parent");
+		internal->root_clusters.push_back(root);
+		internal->root_clusters.back()->root_clusters_iterator = std::prev(internal->root_clusters.end());
+	}
+	for (auto &v: vertices) v->topology_cluster = get_cluster();
+
+	if (!i) {
+		std::cerr << "ERROR: Cannot read top tree from " << path << std::endl;
+		exit(1);
+	}
+}
+
 std::pair<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>> TopologyTopTree::SplitRoot(std::shared_ptr<ICluster> root) {
 	auto cluster = std::dynamic_pointer_cast<SimpleCluster>(root);
 	if (cluster->first == NULL || cluster->second == NULL) {
@@ -1399,171 +1909,223 @@ std::pair<std::shared_ptr<ICluster>, std::shared_ptr<ICluster>> TopologyTopTree:
 /// Functions for construction:
 
 std::shared_ptr<BaseTree::Internal::Vertex> TopologyTopTree::Internal::split_vertex(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> parent_edge) {
-	// Create subvertices
-	auto current = std::make_shared<BaseTree::Internal::Vertex>(std::make_shared<VertexData>());
-	current->index = v->index; // index of the subvertex is the same as index of the superior vertex (from the Join point of view it is the same vertex)
-	current->superior_vertex = v;
-	v->subvertices.push_back(current);
-	auto vertex_to_return = current; // by default we return the first vertex
-
-	auto current_iter = std::prev(v->subvertices.end());
-	for (auto n = v->neighbours.begin(); n != v->neighbours.end(); ++n) {
-		// Copy this edge into subvertice and notice what subvertice it is
-		auto edge = (*n).edge.lock();
-		//auto target_vertex = (*n).vertex.lock();
-		auto target_vertex = edge->from;
-		if (target_vertex == v) target_vertex = edge->to;
-
-		// 1. If this subvertice is full create a new one
-		if (current->degree == 2 && n != std::prev(v->neighbours.end())) {
-			#ifdef DEBUG
-				std::cerr << "Creating new subvertex for " << *v << std::endl;
-			#endif
-			auto temp = std::make_shared<BaseTree::Internal::Vertex>(std::make_shared<VertexData>());
-			temp->index = v->index; // index of the subvertex is the same as index of the superior vertex (from the Join point of view it is the same vertex)
-			temp->superior_vertex = v;
-			v->subvertices.push_back(temp);
-			temp->superior_vertex_subvertices_iter = std::prev(v->subvertices.end());
-
-			// Add edge between them (subvertice edge)
-			auto inner_edge = std::make_shared<BaseTree::Internal::Edge>(current, temp, std::make_shared<EdgeData>());
+	// Subvertices form a balanced binary tree (not a chain): edges of the vertex are paired under new subvertices level
+	// by level until only three items remain, these are connected to the last (root) subvertex. Every subvertex has
+	// degree 3, so there are degree - 2 subvertices and any two of them are O(log degree) subvertice edges apart.
+	struct item {
+		int neighbour; // index of the edge in the neighbours of v (-1 if it is a subvertex)
+		std::shared_ptr<BaseTree::Internal::Vertex> subvertex;
+	};
+	std::queue<item> items;
+	for (size_t i = 0; i < v->neighbours.size(); i++) items.push(item{(int) i, NULL});
+	std::shared_ptr<BaseTree::Internal::Vertex> vertex_to_return = NULL;
+
+	auto new_subvertex = [&]() {
+		auto subvertex = std::make_shared<BaseTree::Internal::Vertex>(std::make_shared<VertexData>());
+		subvertex->index = v->index; // index of the subvertex is the same as index of the superior vertex (from the Join point of view it is the same vertex)
+		subvertex->superior_vertex = v;
+		v->add_subvertex(subvertex);
+		return subvertex;
+	};
+	auto attach = [&](std::shared_ptr<BaseTree::Internal::Vertex> current, const item& it) {
+		if (it.neighbour < 0) {
+			// Add edge between subvertices (subvertice edge)
+			auto inner_edge = std::make_shared<BaseTree::Internal::Edge>(current, it.subvertex, std::make_shared<EdgeData>());
 			inner_edge->subvertice_edge = true;
 			inner_edge->register_at_vertices();
-
-			v->subvertice_edges.push_back(inner_edge);
-			inner_edge->subvertice_edges_iterator = std::prev(v->subvertice_edges.end());
-
-			current = temp;
-
-			current_iter = std::prev(v->subvertices.end());
+			v->add_subvertice_edge(inner_edge);
+			return;
 		}
 
-		// 2. Test if this edge is the parent edge (so it will be connected with this subvertex) and if so remember it so we will return this one
+		// Move the edge of v into the subvertex
+		auto edge = v->neighbours[it.neighbour].edge.lock();
+		// Test if this edge is the parent edge (so it will be connected with this subvertex) and if so remember it so we will return this one
 		if (edge == parent_edge) vertex_to_return = current;
 
-		// 3. Add this edge to current subvertice
-		current->neighbours.push_back(BaseTree::Internal::neighbour{edge});
+		int index = current->add_neighbour(edge);
 		current->degree++;
-		(*n).subvertice_iter = current_iter;
+		v->neighbours[it.neighbour].superior = true;
 
-		// 4. Update edge itself - its from/to will be updated to this vertex and iter will be added
+		// Update edge itself - its from/to will be updated to this vertex and index will be added
 		if (edge->from == v) {
 			edge->from = current;
-			edge->superior_from_iter = edge->from_iter;
-			edge->from_iter = std::prev(current->neighbours.end());
+			edge->superior_from_index = edge->from_index;
+			edge->from_index = index;
 		} else {
 			edge->to = current;
-			edge->superior_to_iter = edge->to_iter;
-			edge->to_iter = std::prev(current->neighbours.end());
+			edge->superior_to_index = edge->to_index;
+			edge->to_index = index;
+		}
+	};
+
+	while (items.size() > 3) {
+		auto current = new_subvertex();
+		for (int i = 0; i < 2; i++) {
+			attach(current, items.front());
+			items.pop();
 		}
+		items.push(item{-1, current});
 	}
-	return vertex_to_return;
+	auto root = new_subvertex();
+	while (!items.empty()) {
+		attach(root, items.front());
+		items.pop();
+	}
+
+	return (vertex_to_return != NULL ? vertex_to_return : root);
 }
 
 
-std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::construct_basic_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> parent_edge) {
-	if (v->degree > 3) return construct_basic_clusters(split_vertex(v, parent_edge), parent_edge);
+std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::construct_basic_cluster(std::shared_ptr<BaseTree::Internal::Vertex> v, std::shared_ptr<BaseTree::Internal::Edge> parent_edge) {
+	if (v->degree > 3) v = split_vertex(v, parent_edge);
 
-	// Otherwise...
 	// 1. Sanity check
 	if (parent_edge == NULL and v->degree > 1) {
 		std::cerr << "ERROR: Cluster without parent with degree > 1" << std::endl;
 		exit(1);
 	}
 
-	// 2. Construct basic topology clusters from this vertex and connect with outgoing edges with others
-	auto cluster = std::make_shared<TopologyCluster>();
+	// 2. Construct basic topology cluster for this vertex
+	auto cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
 	splitted_clusters.push_back(cluster);
 	cluster->vertex = v;
 	v->topology_cluster = cluster;
 	v->used = true;
-	for (auto n : v->neighbours) {
-		if (auto ee = n.edge.lock()) {
-			if (ee == parent_edge) continue;
+	return cluster;
+}
+
+std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::construct_basic_clusters(std::shared_ptr<BaseTree::Internal::Vertex> v) {
+	// DFS with explicit stack (the tree could be very deep, e.g. long paths), clusters are connected with outgoing edges
+	// when returning from the child, so outer edges are in the same order as when it was done by recursion
+	struct frame {
+		std::shared_ptr<TopologyCluster> cluster;
+		std::shared_ptr<BaseTree::Internal::Edge> parent_edge;
+		size_t next_neighbour;
+	};
+	std::vector<frame> stack;
+	stack.push_back(frame{construct_basic_cluster(v), NULL, 0});
+
+	while (true) {
+		auto& top = stack.back();
+		auto vertex = top.cluster->vertex;
+		if (top.next_neighbour < vertex->neighbours.size()) {
+			auto ee = vertex->neighbours[top.next_neighbour++].edge.lock();
+			if (ee == NULL || ee == top.parent_edge) continue;
 			// Get oposite vertex
 			auto vv = ee->from;
-			if (vv == v) vv = ee->to;
+			if (vv == vertex) vv = ee->to;
 
 			if (vv->used) {
 				std::cerr << "ERROR: Vertex " << *vv << " already used in Topology Tree, underlying tree isn't acyclic!" << std::endl;
 				return NULL;
 			}
 			vv->used = true;
-			auto child = construct_basic_clusters(vv, ee);
-			cluster->outer_edges.push_back(TopologyCluster::neighbour{ee, child});
-			cluster->outer_edges_count++;
-			child->outer_edges.push_back(TopologyCluster::neighbour{ee, cluster});
-			child->outer_edges_count++;
+			stack.push_back(frame{construct_basic_cluster(vv, ee), ee, 0}); // (invalidates top)
+			continue;
 		}
-	}
 
-	// Now there is prepared topology tree with
-	return cluster;
+		// All neighbours done, connect with the parent
+		auto child = top.cluster;
+		auto ee = top.parent_edge;
+		stack.pop_back();
+		if (stack.empty()) return child;
+
+		auto cluster = stack.back().cluster;
+		cluster->outer_edges.push_back(TopologyCluster::neighbour{ee, child});
+		cluster->outer_edges_count++;
+		child->outer_edges.push_back(TopologyCluster::neighbour{ee, cluster});
+		child->outer_edges_count++;
+	}
 }
 
-std::shared_ptr<TopologyCluster> TopologyTopTree::Internal::construct_topology_tree(std::shared_ptr<TopologyCluster> cluster, int level, std::shared_ptr<BaseTree::Internal::Edge> parent_edge) {
-	std::shared_ptr<TopologyCluster> first = NULL;
-	std::shared_ptr<TopologyCluster> second = NULL;
+template<class F>
+void TopologyTopTree::Internal::parallel_for(size_t n, F f) {
+	size_t chunks = (construction_pool == NULL ? 1 : std::min<size_t>(construction_pool->size(), (n + min_parallel_chunk - 1) / min_parallel_chunk));
+	if (chunks <= 1) {
+		for (size_t i = 0; i < n; i++) f(i);
+		return;
+	}
 
-	#ifdef DEBUG
-		if (cluster->vertex != NULL) {
-			if (cluster->vertex->data == NULL) std::cerr << "At basic cluster [helper]" << std::endl;
-			else std::cerr << "At basic cluster " << *cluster->vertex << std::endl;
-		}
-	#endif
+	size_t chunk = (n + chunks - 1) / chunks;
+	construction_pool->run(chunks, [&](size_t c) {
+		for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) f(i);
+	});
+}
 
-	// 1. Construct clusters for both children
-	for (auto o : cluster->outer_edges) {
-		if (o.edge == parent_edge) continue;
-		if (first == NULL) first = construct_topology_tree(o.cluster, level, o.edge);
-		else second = construct_topology_tree(o.cluster, level, o.edge);
+// Priority of the pair of clusters for the matching (bijective mix of both indices, so different pairs never have the same priority)
+static uint64_t pair_priority(uint64_t a, uint64_t b) {
+	if (a > b) std::swap(a, b);
+	uint64_t x = (a << 32) | b;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+std::vector<std::shared_ptr<TopologyCluster>> TopologyTopTree::Internal::construct_level(const std::vector<std::shared_ptr<TopologyCluster>>& level) {
+	// Two neighbouring clusters could be combined when the new cluster has at most 2 outer edges (so clusters with
+	// 3 outer edges are combined only with leaves). We search maximal matching of such pairs by rounds: each cluster
+	// proposes to its free neighbour with the highest pair priority, mutual proposals are matched. The priorities depend
+	// only on positions in the level, so the resulting tree is the same for any number of threads.
+	size_t n = level.size();
+	parallel_for(n, [&](size_t i) { level[i]->level_index = i; });
+
+	std::vector<int> match(n, -1);
+	std::vector<int> proposal(n, -1);
+	while (true) {
+		// 1. Proposals
+		std::atomic<bool> proposed{false};
+		parallel_for(n, [&](size_t i) {
+			proposal[i] = -1;
+			if (match[i] != -1) return;
+			auto cluster = level[i].get();
+			uint64_t best = 0;
+			for (auto &o: cluster->outer_edges) {
+				int j = o.cluster->level_index;
+				if (match[j] != -1 || cluster->outer_edges_count + o.cluster->outer_edges_count > 4) continue;
+				uint64_t priority = pair_priority(i, j);
+				if (proposal[i] == -1 || priority > best) {
+					best = priority;
+					proposal[i] = j;
+				}
+			}
+			if (proposal[i] != -1) proposed.store(true, std::memory_order_relaxed);
+		});
+		if (!proposed) break;
+
+		// 2. Matching of mutual proposals
+		parallel_for(n, [&](size_t i) {
+			if (proposal[i] != -1 && proposal[proposal[i]] == (int) i) match[i] = proposal[i];
+		});
 	}
 
-	// 3. Check if this cluster could be added to one of the child clusters:
-	if (first != NULL && second != NULL) {
-		// Both children, we could add this cluster only to some with only one cluster and without other edges
-		if (first->second == NULL && first->outer_edges_count == 1) {
-			#ifdef DEBUG
-				std::cerr << "A: Adding this cluster to the first one child" << std::endl;
-			#endif
-			first->second = cluster;
-			cluster->parent = first;
-			first->outer_edges_count += cluster->outer_edges_count - 2;
-			// outer edges will be calculated after finishing making all clusters on this level of topology tree
-			return first;
-		} else if (second->second == NULL && second->outer_edges_count == 1) {
-			#ifdef DEBUG
-				std::cerr << "A: Adding this cluster to the second one child" << std::endl;
-			#endif
-			second->second = cluster;
-			cluster->parent = second;
-			second->outer_edges_count += cluster->outer_edges_count - 2;
-			// outer edges will be calculated after finishing making all clusters on this level of topology tree
-			return second;
+	// 3. Create clusters of the next level (sequentially, order of clusters and their indices is deterministic)
+	std::vector<std::shared_ptr<TopologyCluster>> next_level;
+	next_level.reserve(n);
+	for (size_t i = 0; i < n; i++) {
+		if (match[i] != -1 && match[i] < (int) i) continue; // already added with its pair
+		auto cluster = level[i];
+		auto new_cluster = std::make_shared<TopologyCluster>(functions.get(), simple_pool.get());
+		splitted_clusters.push_back(new_cluster);
+		new_cluster->first = cluster;
+		new_cluster->vertex = cluster->vertex;
+		cluster->parent = new_cluster;
+		new_cluster->outer_edges_count = cluster->outer_edges_count;
+		if (match[i] != -1) {
+			auto second = level[match[i]];
+			new_cluster->second = second;
+			second->parent = new_cluster;
+			new_cluster->outer_edges_count += second->outer_edges_count - 2;
 		}
-	} else if (first != NULL && first->second == NULL && first->outer_edges_count <= 2) {
-		#ifdef DEBUG
-			std::cerr << "B: Adding this cluster to the first one child" << std::endl;
-		#endif
-		first->second = cluster;
-		cluster->parent = first;
-		first->outer_edges_count += cluster->outer_edges_count - 2;
-		return first;
+		next_level.push_back(new_cluster);
 	}
 
-	// 4. Cannot add to any cluster, have to create own
-	#ifdef DEBUG
-		std::cerr << "Creating new cluster " << cluster->outer_edges_count << std::endl;
-	#endif
-	auto new_cluster = std::make_shared<TopologyCluster>();
-	splitted_clusters.push_back(new_cluster);
-	new_cluster->first = cluster;
-	new_cluster->vertex = cluster->vertex;
-	cluster->parent = new_cluster;
-	new_cluster->outer_edges_count = cluster->outer_edges_count;
-	to_calculate_outer_edges.push_back(new_cluster);
+	// 4. Outer edges of the new clusters (only parents of the clusters on this level are needed)
+	parallel_for(next_level.size(), [&](size_t i) { next_level[i]->calculate_outer_edges(); });
 
-	return new_cluster;
+	return next_level;
 }
 
 }
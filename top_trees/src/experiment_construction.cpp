@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <ctime>
+
+#include "examples/maximum_edge_weight.hpp"
+
+#include "STTopTree.hpp"
+#include "TopologyTopTree.hpp"
+
+#define MAX_WEIGHT 10000
+
+// Measures only construction (and destruction) of top trees on very deep trees:
+// - path: 0-1-2-...-(N-1)
+// - caterpillar: spine of N/2 vertices with one leg on each of them, legs are added before the next spine edge
+//   so the construction goes into the legs first and the spine is the deepest part of the tree
+
+std::vector<std::pair<int, int>> edges; // pairs of vertices
+std::vector<int> weights;
+
+std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
+	for (int i = 0; i < N; i++) worker->add_vertex(std::to_string(i));
+	for (uint i = 0; i < edges.size(); i++) worker->add_edge(edges[i].first, edges[i].second, weights[i]);
+
+	clock_t begin = clock();
+	worker->initialize();
+	clock_t end = clock();
+	double init_time = double(end - begin) / CLOCKS_PER_SEC;
+
+	begin = clock();
+	delete(worker);
+	end = clock();
+	double delete_time = double(end - begin) / CLOCKS_PER_SEC;
+
+	return std::make_pair(init_time / N, delete_time / N);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		std::cerr << "Usage: " << argv[0] << " <seed> <N> path|caterpillar" << std::endl;
+		return 1;
+	}
+	// Init random generator
+	auto seed = strtoull(argv[1], NULL, 16);
+	srand(seed);
+	int N = atoi(argv[2]);
+
+	// Generate tree
+	if (strcmp(argv[3], "path") == 0) {
+		for (int i = 1; i < N; i++) edges.push_back(std::make_pair(i - 1, i));
+	} else if (strcmp(argv[3], "caterpillar") == 0) {
+		// spine vertex i has index 2*i, its leg has index 2*i+1
+		for (int i = 0; 2*i + 1 < N; i++) {
+			if (i > 0) edges.push_back(std::make_pair(2*(i-1), 2*i));
+			edges.push_back(std::make_pair(2*i + 1, 2*i));
+		}
+	} else {
+		std::cerr << "ERROR: Unknown type of tree " << argv[3] << std::endl;
+		return 1;
+	}
+	for (uint i = 0; i < edges.size(); i++) weights.push_back(rand() % MAX_WEIGHT);
+
+	// Run both implementations
+	auto functions = std::make_shared<TopTree::PolicyFunctions<MaximumEdgeWeightPolicy>>();
+	auto time_top_tree = run(new MaximumEdgeWeight(new TopTree::STTopTree(functions)), N);
+	auto time_topology_top_tree = run(new MaximumEdgeWeight(new TopTree::TopologyTopTree(functions)), N);
+
+	std::cout << time_top_tree.first << " " << time_top_tree.second << " " << time_topology_top_tree.first << " " << time_topology_top_tree.second << std::endl;
+}
@@ -1,8 +1,10 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <string.h>
 
 #include "examples/double_edge_connectivity.hpp"
+#include "experiments/latency.hpp"
 
 #include "STTopTree.hpp"
 #include "TopologyTopTree.hpp"
@@ -33,9 +35,10 @@ struct operation getRandomOp(int N) {
 
 std::vector<std::pair<int, int>> initial_edges; // pair(edge to, edge weight)
 std::vector<struct operation> operations;
+LatencyRecorder *latency = NULL; // only when the output file for latencies is given
 
 
-std::tuple<double, double, double> run(DoubleConnectivity *worker, uint N, uint M) {
+std::tuple<double, double, double> run(DoubleConnectivity *worker, uint N, uint M, const std::string& engine) {
 	// Vector for indexing edges
 	std::vector<std::shared_ptr<MyEdgeData>> edges;
 
@@ -56,6 +59,7 @@ std::tuple<double, double, double> run(DoubleConnectivity *worker, uint N, uint
 	// Start measure time and perform all operations
 	begin = clock();
 	int op_skipped = 0;
+	LatencyRecorder::clock::time_point op_begin;
 	for (auto op: operations) {
 		switch (op.op) {
 		case INSERT: {
@@ -66,7 +70,9 @@ std::tuple<double, double, double> run(DoubleConnectivity *worker, uint N, uint
 			#ifdef VERBOSE
 				std::cerr << "Adding edge " << op.vertex_a << " and " << op.vertex_b << std::endl;
 			#endif
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			auto edge = worker->Insert(op.vertex_a, op.vertex_b);
+			if (latency != NULL) latency->record(engine, "insert", op_begin);
 			if (edge != NULL) edges.push_back(edge);
 		break;}
 		case DELETE: {
@@ -79,13 +85,17 @@ std::tuple<double, double, double> run(DoubleConnectivity *worker, uint N, uint
 			#ifdef VERBOSE
 				std::cerr << "Removing edge " << edges[index]->from << " and " << edges[index]->to << std::endl;
 			#endif
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			worker->Delete(edges[index]);
+			if (latency != NULL) latency->record(engine, "delete", op_begin);
 			// Remove from vector
 			edges[index] = edges.back();
 			edges.pop_back();
 		break;}
 		case QUERY: {
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			auto result = worker->Double_edge_connected(op.vertex_a, op.vertex_b);
+			if (latency != NULL) latency->record(engine, "query", op_begin);
 			#ifdef VERBOSE
 				std::cerr << "Query of " << op.vertex_a << " and " << op.vertex_b << ": " << result << std::endl;
 			#endif
@@ -124,6 +134,10 @@ std::tuple<double, double, double> run(DoubleConnectivity *worker, uint N, uint
 
 
 int main(int argc, char const *argv[]) {
+	if (argc < 5) {
+		std::cerr << "Usage: " << argv[0] << " <seed> <N> <M> <K> [latency=<file.json>]" << std::endl;
+		return 1;
+	}
 	// Init random generator
 	auto seed = strtoull(argv[1], NULL, 16);
 	srand(seed);
@@ -132,31 +146,58 @@ int main(int argc, char const *argv[]) {
 	int M = atoi(argv[3]);
 	int K = atoi(argv[4]);
 
+	// Options (as in experiment_edge_weight)
+	const char* latency_path = NULL;
+	for (int i = 5; i < argc; i++) {
+		if (strncmp(argv[i], "latency=", 8) == 0) latency_path = argv[i] + 8;
+		else {
+			std::cerr << "ERROR: Unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
 	// Generate tree and list of operations
 	// a) original graph = each vertex is connected to one with lower number
 	for (int i = 0; i < M; i++) initial_edges.push_back(std::pair<int,int>(rand() % N, rand() % N));
 	// b) operations (type and two vertices)
 	for (int i = 0; i < K; i++) operations.push_back(getRandomOp(N));
 
+	// Latency of single operations in the first part (insert, delete, query)
+	if (latency_path != NULL) {
+		latency = new LatencyRecorder();
+		latency->set("seed", seed);
+		latency->set("vertices", N);
+		latency->set("edges", M);
+		latency->set("operations", K);
+	}
+
 	// Run both implementations
+	auto st_top_tree = [](std::shared_ptr<TopTree::IUserFunctions> functions) { return std::make_shared<TopTree::STTopTree>(functions); };
+	auto topology_top_tree = [](std::shared_ptr<TopTree::IUserFunctions> functions) { return std::make_shared<TopTree::TopologyTopTree>(functions); };
+
 	auto time_top_tree = std::tuple<double,double,double>(0, 0, 0);
-	time_top_tree = run(new DoubleConnectivity(std::make_shared<TopTree::STTopTree>()), N, M);
+	time_top_tree = run(new DoubleConnectivity(st_top_tree), N, M, "ST");
 
 	auto time_topology_top_tree = std::tuple<double,double,double>(0, 0, 0);
-	time_topology_top_tree = run(new DoubleConnectivity(std::make_shared<TopTree::TopologyTopTree>()), N, M);
+	time_topology_top_tree = run(new DoubleConnectivity(topology_top_tree), N, M, "Topology");
 
 	auto time_topology_top_tree_quick = std::tuple<double,double,double>(0, 0, 0);
-	time_topology_top_tree_quick = run(new DoubleConnectivity(std::make_shared<TopTree::TopologyTopTree>(), true), N, M);
+	time_topology_top_tree_quick = run(new DoubleConnectivity(topology_top_tree, true), N, M, "Topology quick");
 
 	std::cout << std::get<0>(time_top_tree) << " " << std::get<1>(time_top_tree) << " " << std::get<2>(time_top_tree) << " "
 		<< std::get<0>(time_topology_top_tree) << " " << std::get<1>(time_topology_top_tree) << " " << std::get<2>(time_topology_top_tree) << " "
 		<< std::get<0>(time_topology_top_tree_quick) << " " << std::get<1>(time_topology_top_tree_quick) << " " << std::get<2>(time_topology_top_tree_quick) << std::endl;
 
+	if (latency != NULL) {
+		latency->write_json(latency_path);
+		delete latency;
+	}
+
 
 	/* Manual testing:
 
-	auto dc = new DoubleConnectivity(std::make_shared<TopTree::STTopTree>());
-	//auto dc = new DoubleConnectivity(std::make_shared<TopTree::TopologyTopTree>());
+	auto dc = new DoubleConnectivity(st_top_tree);
+	//auto dc = new DoubleConnectivity(topology_top_tree);
 
 	auto a = dc->Insert(0,1);
 	auto e = dc->Insert(1,2);
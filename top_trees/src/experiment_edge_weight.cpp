@@ -1,11 +1,19 @@
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <ctime>
+#include <tuple>
+#include <functional>
 
 #include "examples/maximum_edge_weight.hpp"
+#include "experiments/latency.hpp"
+#include "experiments/workloads.hpp"
 
 #include "STTopTree.hpp"
 #include "TopologyTopTree.hpp"
+#include "Statistics.hpp"
 
 #define MAX_WEIGHT 10000
 #define OPS_COUNT 4
@@ -17,24 +25,26 @@ struct operation {
 	opType op;
 	int vertex_a;
 	int vertex_b;
-	int param; // used as weight when creating or as index into vector when deleting edges
+	int param; // used as weight when creating or as index into vector when deleting edges (-1 = delete edge vertex_a-vertex_b)
 };
 
-std::vector<std::pair<int, int>> vertices; // pair(edge to, edge weight)
+std::vector<std::tuple<int, int, int>> initial_edges; // (vertex, vertex, weight)
 std::vector<struct operation> operations;
+LatencyRecorder *latency = NULL; // only when the output file for latencies is given
 
-std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
+std::pair<double, double> run(MaximumEdgeWeight *worker, int N, const std::string& engine) {
 	// Vector for indexing edges
 	std::vector<std::pair<int, int>> edges;
 
+	TopTree::statistics.Reset();
+
 	// Init tree
 	clock_t begin = clock();
 	std::vector<int> vertex_index;
-	vertex_index.push_back(worker->add_vertex(std::to_string(0)));
-	for (uint i = 1; i < vertices.size(); i++) {
-		vertex_index.push_back(worker->add_vertex(std::to_string(i)));
-		worker->add_edge(vertex_index[i], vertex_index[vertices[i].first], vertices[i].second);
-		edges.push_back(std::pair<int,int>(i, vertices[i].first));
+	for (int i = 0; i < N; i++) vertex_index.push_back(worker->add_vertex(std::to_string(i)));
+	for (auto &e: initial_edges) {
+		worker->add_edge(vertex_index[std::get<0>(e)], vertex_index[std::get<1>(e)], std::get<2>(e));
+		edges.push_back(std::pair<int,int>(std::get<0>(e), std::get<1>(e)));
 	}
 	worker->initialize();
 	clock_t end = clock();
@@ -43,6 +53,7 @@ std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
 	// Start measure time and perform all operations
 	begin = clock();
 	int op_skipped = 0;
+	LatencyRecorder::clock::time_point op_begin;
 	for (auto op: operations) {
 		switch (op.op) {
 		case ADD_EDGE: {
@@ -50,17 +61,32 @@ std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
 			#ifdef VERBOSE
 				std::cerr << "Adding edge " << vertex_index[op.vertex_a] << " and " << vertex_index[op.vertex_b] << " with weight " << weight << std::endl;
 			#endif
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			int result = worker->add_edge(vertex_index[op.vertex_a], vertex_index[op.vertex_b], weight);
+			if (latency != NULL) latency->record(engine, "link", op_begin);
 			if (result >= 0) edges.push_back(std::pair<int,int>(op.vertex_a,op.vertex_b));
 		break;}
 		case REMOVE_EDGE: {
 			// Get edge
-			if (edges.size() < N * 7/10) {
+			if (edges.size() < N * 7/10 && op.param >= 0) {
 				op_skipped++;
 				continue;
 			}
-			int index = op.param % edges.size();
+			int index = 0;
+			if (op.param >= 0) index = op.param % edges.size();
+			else {
+				// Edge given by its endpoints (from a trace)
+				for (index = 0; index < (int) edges.size(); index++) {
+					if ((edges[index].first == op.vertex_a && edges[index].second == op.vertex_b) || (edges[index].first == op.vertex_b && edges[index].second == op.vertex_a)) break;
+				}
+				if (index == (int) edges.size()) {
+					op_skipped++;
+					continue;
+				}
+			}
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			bool result = worker->remove_edge(vertex_index[edges[index].first], vertex_index[edges[index].second]);
+			if (latency != NULL) latency->record(engine, "cut", op_begin);
 			#ifdef VERBOSE
 				std::cerr << "Removing edge " << vertex_index[edges[index].first] << " and " << vertex_index[edges[index].second] << ": " << result << std::endl;
 			#endif
@@ -77,10 +103,14 @@ std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
 			#ifdef VERBOSE
 				std::cerr << "Adding weight between " << vertex_index[op.vertex_a] << " and " << vertex_index[op.vertex_b] << ": " << weight << std::endl;
 			#endif
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			worker->add_weight_on_path(vertex_index[op.vertex_a], vertex_index[op.vertex_b], weight);
+			if (latency != NULL) latency->record(engine, "update", op_begin);
 		break;}
 		case GET_WEIGHT: {
+			if (latency != NULL) op_begin = LatencyRecorder::now();
 			auto result = worker->get_max_weight_on_path(vertex_index[op.vertex_a], vertex_index[op.vertex_b]);
+			if (latency != NULL) latency->record(engine, "query", op_begin);
 			#ifdef VERBOSE
 				std::cerr << "Getting max weight on path " << vertex_index[op.vertex_a] << " and " << vertex_index[op.vertex_b] << ": [" << result.exists << "] " << result.max_weight << std::endl;
 			#endif
@@ -89,6 +119,12 @@ std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
 	}
 	end = clock();
 
+	// Counters of the hot paths (only in build with STATS=1)
+	if (TopTree::statistics_enabled) {
+		std::cerr << "Statistics of " << engine << ":" << std::endl;
+		TopTree::statistics.Print(std::cerr);
+	}
+
 	// Cleaning
 	delete(worker);
 
@@ -97,7 +133,75 @@ std::pair<double, double> run(MaximumEdgeWeight *worker, int N) {
 	return std::make_pair(init_time / N, execution_time / op_count);
 }
 
+// Reads trace of operations, text file with lines:
+//   n <N>          number of vertices (0..N-1), it must be the first line
+//   e <a> <b> <w>  edge of the initial forest with weight w
+//   l <a> <b> <w>  link a-b with weight w
+//   c <a> <b>      cut a-b
+//   u <a> <b> <w>  add w on the path a..b
+//   q <a> <b>      get maximum weight on the path a..b
+// Empty lines and lines starting with '#' are ignored. Vertices out of 0..N-1 and initial edges that do not form
+// a forest are errors.
+int load_trace(const char* path) {
+	std::ifstream input(path);
+	if (!input) {
+		std::cerr << "ERROR: Cannot open trace " << path << std::endl;
+		exit(1);
+	}
+	int N = -1;
+	std::vector<int> components; // union-find of initial edges (to check that they form a forest)
+	std::function<int(int)> find = [&](int v) { return components[v] == v ? v : components[v] = find(components[v]); };
+
+	std::string line;
+	int line_number = 0;
+	while (std::getline(input, line)) {
+		line_number++;
+		auto invalid = [&](const std::string& reason) {
+			std::cerr << "ERROR: Invalid line " << line_number << " of trace (" << reason << "): " << line << std::endl;
+			exit(1);
+		};
+		std::istringstream fields(line);
+		std::string type;
+		int a = 0, b = 0, w = 0;
+		if (!(fields >> type) || type[0] == '#') continue;
+		if (type == "n") {
+			if (N >= 0) invalid("more lines with number of vertices");
+			if (!(fields >> N) || N <= 0) invalid("number of vertices must be positive");
+			components.resize(N);
+			for (int i = 0; i < N; i++) components[i] = i;
+		} else {
+			if (N < 0) invalid("the first line must be the number of vertices");
+			bool has_weight = (type == "e" || type == "l" || type == "u");
+			if (type != "e" && type != "l" && type != "c" && type != "u" && type != "q") invalid("unknown operation");
+			if (!(fields >> a >> b) || (has_weight && !(fields >> w))) invalid("missing number");
+			if (a < 0 || a >= N || b < 0 || b >= N) invalid("vertex out of range");
+
+			if (type == "e") {
+				if (a == b || find(a) == find(b)) invalid("initial edges must form a forest");
+				components[find(a)] = find(b);
+				initial_edges.push_back(std::tuple<int,int,int>{a, b, w});
+			}
+			else if (type == "l") operations.push_back(operation{ADD_EDGE, a, b, w});
+			else if (type == "c") operations.push_back(operation{REMOVE_EDGE, a, b, -1});
+			else if (type == "u") operations.push_back(operation{ADD_WEIGHT, a, b, w});
+			else operations.push_back(operation{GET_WEIGHT, a, b, 0});
+		}
+		std::string rest;
+		if (fields >> rest && rest[0] != '#') invalid("unexpected '" + rest + "'");
+	}
+	if (N < 0) {
+		std::cerr << "ERROR: Trace " << path << " does not contain number of vertices" << std::endl;
+		exit(1);
+	}
+	return N;
+}
+
 int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		std::cerr << "Usage: " << argv[0] << " <seed> <N> <K> [tree=random|path|caterpillar|star[:hubs]|binary|preferential] [zipf=<s>] [trace=<file>] [latency=<file.json>]" << std::endl;
+		std::cerr << "  zipf: skewed locality of queries and path updates, trace: replay operations from the file (N and K are ignored)" << std::endl;
+		return 1;
+	}
 	// Init random generator
 	auto seed = strtoull(argv[1], NULL, 16);
 	srand(seed);
@@ -105,28 +209,76 @@ int main(int argc, char *argv[]) {
 	int N = atoi(argv[2]);
 	int K = atoi(argv[3]);
 
-	// Generate tree and list of operations
-	// a) original graph = each vertex is connected to one with lower number
-	vertices.push_back(std::pair<int,int>(0,0));
-	for (int i = 1; i < N; i++) vertices.push_back(std::pair<int,int>(rand() % i, rand() % MAX_WEIGHT));
-	// b) operations (type and two vertices)
-	for (int i = 0; i < K; i++) {
-		struct operation op{
-			static_cast<opType>(rand() % OPS_COUNT),
-			rand() % N,
-			rand() % N,
-			rand()
+	// Options
+	std::string tree = "random";
+	double zipf = 0;
+	const char* trace = NULL;
+	const char* latency_path = NULL;
+	for (int i = 4; i < argc; i++) {
+		if (strncmp(argv[i], "tree=", 5) == 0) tree = argv[i] + 5;
+		else if (strncmp(argv[i], "zipf=", 5) == 0) zipf = atof(argv[i] + 5);
+		else if (strncmp(argv[i], "trace=", 6) == 0) trace = argv[i] + 6;
+		else if (strncmp(argv[i], "latency=", 8) == 0) latency_path = argv[i] + 8;
+		else {
+			std::cerr << "ERROR: Unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	if (trace != NULL) {
+		N = load_trace(trace);
+		K = operations.size();
+	} else {
+		// Generate tree and list of operations
+		// a) original graph = each vertex is connected to one with lower number (or tree of the given type)
+		if (tree == "random") {
+			for (int i = 1; i < N; i++) {
+				int parent = rand() % i;
+				initial_edges.push_back(std::tuple<int,int,int>{i, parent, rand() % MAX_WEIGHT});
+			}
+		} else {
+			auto parent = generate_tree(tree, N);
+			for (int i = 1; i < N; i++) initial_edges.push_back(std::tuple<int,int,int>{i, parent[i], rand() % MAX_WEIGHT});
+		}
+		// b) operations (type and two vertices), with zipf the endpoints of queries and updates are skewed
+		ZipfSampler* sampler = (zipf > 0 ? new ZipfSampler(N, zipf) : NULL);
+		for (int i = 0; i < K; i++) {
+			struct operation op{
+				static_cast<opType>(rand() % OPS_COUNT),
+				rand() % N,
+				rand() % N,
+				rand()
+			};
+			if (sampler != NULL && (op.op == GET_WEIGHT || op.op == ADD_WEIGHT)) {
+				op.vertex_a = (*sampler)();
+				op.vertex_b = (*sampler)();
+			}
+			operations.push_back(op);
 		};
-		operations.push_back(op);
-	};
+		delete sampler;
+	}
 
 	//std::cerr << "Generating of operations ended" << std::endl;
 
+	// Latency of single operations (link, cut, update = add weight on path, query = get max weight on path)
+	if (latency_path != NULL) {
+		latency = new LatencyRecorder();
+		latency->set("seed", seed);
+		latency->set("size", N);
+		latency->set("operations", K);
+	}
+
 	// Run both implementations
-	auto time_top_tree = run(new MaximumEdgeWeight(new TopTree::STTopTree()), N);
+	auto functions = std::make_shared<TopTree::PolicyFunctions<MaximumEdgeWeightPolicy>>();
+	auto time_top_tree = run(new MaximumEdgeWeight(new TopTree::STTopTree(functions)), N, "ST");
 	//auto time_top_tree = std::make_pair(0, 0);
-	auto time_topology_top_tree = run(new MaximumEdgeWeight(new TopTree::TopologyTopTree()), N);
+	auto time_topology_top_tree = run(new MaximumEdgeWeight(new TopTree::TopologyTopTree(functions)), N, "Topology");
 	//auto time_topology_top_tree = std::make_pair(0, 0);
 
+	if (latency != NULL) {
+		latency->write_json(latency_path);
+		delete latency;
+	}
+
 	std::cout << time_top_tree.first << " " << time_top_tree.second << " " << time_topology_top_tree.first << " " << time_topology_top_tree.second << std::endl;
 }
@@ -1,9 +1,19 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <atomic>
 
 #include "STTopTree.hpp"
 #include "TopologyTopTree.hpp"
+#include "ComponentCache.hpp"
+#include "ThreadPool.hpp"
+#include "ShardedTopTree.hpp"
 
 //#define DEBUG
 
@@ -37,65 +47,519 @@ public:
 	}
 };
 
-void TopTree::Join(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent) {
-	auto left_data = std::dynamic_pointer_cast<MyClusterData>(leftChild->data);
-	auto right_data = std::dynamic_pointer_cast<MyClusterData>(rightChild->data);
-	auto parent_data = std::dynamic_pointer_cast<MyClusterData>(parent->data);
+struct TestPolicy {
+	typedef MyClusterData ClusterData;
+
+	static void Join(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
+		auto left_data = leftChild.getData<MyClusterData>();
+		auto right_data = rightChild.getData<MyClusterData>();
+		auto parent_data = parent.getData<MyClusterData>();
+
+		if (isLeftRake(leftChild, rightChild, parent)) {
+			parent_data->weight = right_data->weight;
+			parent_data->label = right_data->label;
+		} else if (isRightRake(leftChild, rightChild, parent)) {
+			parent_data->weight = left_data->weight;
+			parent_data->label = left_data->label;
+		} else {
+			parent_data->weight = left_data->weight + right_data->weight;
+			parent_data->label = left_data->label + "," + right_data->label;
+		}
+
+		parent_data->total_weight = left_data->total_weight + right_data->total_weight;
+		parent_data->total_label = left_data->total_label + "," + right_data->total_label;
+
+		#ifdef DEBUG
+			std::cerr << "Joining " << left_data->total_weight << "(" << left_data->label << "/" << left_data->total_label << ") + " << right_data->total_weight << "(" << right_data->label << "/" << right_data->total_label << ")" << std::endl;
+		#endif
+	}
+	static void Split(TopTree::ICluster& leftChild, TopTree::ICluster& rightChild, TopTree::ICluster& parent) {
+		// Nothing
+	}
+
+	// Creating and destroying Base clusters:
+	static void Create(TopTree::ICluster& cluster, const std::shared_ptr<TopTree::EdgeData>& edge) {
+		auto data = cluster.getData<MyClusterData>();
+		auto edge_data = static_cast<MyEdgeData*>(edge.get());
+		data->weight = 10;
+		data->total_weight = 10;
+		data->label = edge_data->label;
+		data->total_label = edge_data->label;
+	}
+	static void Destroy(TopTree::ICluster& cluster, const std::shared_ptr<TopTree::EdgeData>& edge) {
+		// Nothing
+	}
+
+	static void CopyClusterData(TopTree::ICluster& from, TopTree::ICluster& to) {
+		auto fromData = from.getData<MyClusterData>();
+		auto toData = to.getData<MyClusterData>();
+
+		toData->weight = fromData->weight;
+		toData->total_weight = fromData->total_weight;
+		toData->label = fromData->label;
+		toData->total_label = fromData->total_label;
+	}
+};
+
+void print_node(std::shared_ptr<TopTree::ICluster> node) {
+	if (node != NULL) {
+		auto data = node->getData<MyClusterData>();
+		std::cerr << "[weight: " << data->weight << ", total_weight:" << data->total_weight << "]: " << data->label << std::endl;
+	}
+}
+
+// Saves and loads all labels and weights (for checking of Save and Load)
+class TestSerializer: public TopTree::IDataSerializer {
+public:
+	void SaveVertexData(std::ostream& o, const std::shared_ptr<TopTree::VertexData>& data) {
+		auto vertex_data = dynamic_cast<MyVertexData*>(data.get()); // (vertices added by AddVertices have no label)
+		TopTree::writeString(o, vertex_data != NULL ? vertex_data->label : "");
+	}
+	std::shared_ptr<TopTree::VertexData> LoadVertexData(std::istream& i) {
+		return std::make_shared<MyVertexData>(TopTree::readString(i));
+	}
+
+	void SaveEdgeData(std::ostream& o, const std::shared_ptr<TopTree::EdgeData>& data) {
+		TopTree::writeString(o, static_cast<MyEdgeData*>(data.get())->label);
+	}
+	std::shared_ptr<TopTree::EdgeData> LoadEdgeData(std::istream& i) {
+		return std::make_shared<MyEdgeData>(TopTree::readString(i));
+	}
+
+	void SaveClusterData(std::ostream& o, const TopTree::ICluster& cluster) {
+		auto data = cluster.getData<MyClusterData>();
+		TopTree::writeValue<int>(o, data->weight);
+		TopTree::writeValue<int>(o, data->total_weight);
+		TopTree::writeString(o, data->label);
+		TopTree::writeString(o, data->total_label);
+	}
+	void LoadClusterData(std::istream& i, TopTree::ICluster& cluster) {
+		auto data = cluster.getData<MyClusterData>();
+		data->weight = TopTree::readValue<int>(i);
+		data->total_weight = TopTree::readValue<int>(i);
+		data->label = TopTree::readString(i);
+		data->total_label = TopTree::readString(i);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Checks of the operations (results are compared with brute force computation on the plain forest)
+
+int failed_checks = 0;
+
+void check(bool condition, const std::string& message) {
+	if (condition) return;
+	std::cerr << "FAILED: " << message << std::endl;
+	failed_checks++;
+}
+
+// Plain forest for brute force answers
+class Forest {
+public:
+	Forest(int n): neighbours(n) {}
+
+	bool has_edge(int v, int w) const { return neighbours[v].count(w) > 0; }
+	void link(int v, int w) { neighbours[v].insert(w); neighbours[w].insert(v); }
+	void cut(int v, int w) { neighbours[v].erase(w); neighbours[w].erase(v); }
+
+	// Returns number of edges on the path or -1 when vertices are not connected
+	int distance(int v, int w) const {
+		std::vector<int> distances(neighbours.size(), -1);
+		std::vector<int> queue{v};
+		distances[v] = 0;
+		for (size_t i = 0; i < queue.size(); i++) {
+			for (int x: neighbours[queue[i]]) {
+				if (distances[x] >= 0) continue;
+				distances[x] = distances[queue[i]] + 1;
+				queue.push_back(x);
+			}
+		}
+		return distances[w];
+	}
+
+	std::vector<std::set<int>> neighbours;
+};
+
+// Random forest on n vertices (each vertex is connected to some previous one with probability 3/4)
+std::shared_ptr<TopTree::BaseTree> random_forest(int n, Forest& forest) {
+	auto base_tree = std::make_shared<TopTree::BaseTree>();
+	base_tree->AddVertices(n);
+	for (int i = 1; i < n; i++) {
+		if (rand() % 4 == 0) continue;
+		int p = rand() % i;
+		base_tree->AddEdge(i, p, std::make_shared<MyEdgeData>("e"));
+		forest.link(i, p);
+	}
+	return base_tree;
+}
+
+std::shared_ptr<TopTree::ITopTree> make_top_tree(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions, std::shared_ptr<TopTree::BaseTree> base_tree) {
+	if (topology) return std::make_shared<TopTree::TopologyTopTree>(functions, base_tree);
+	return std::make_shared<TopTree::STTopTree>(functions, base_tree);
+}
+
+// Exposes random paths and compares their weights (every edge has weight 10) with the forest
+void check_paths(TopTree::ITopTree& TT, const Forest& forest, const std::string& name) {
+	int n = forest.neighbours.size();
+	for (int k = 0; k < 20; k++) {
+		int v = rand() % n, w = rand() % n;
+		if (v == w) continue;
+		auto cluster = TT.Expose(v, w);
+		int distance = forest.distance(v, w);
+		int weight = (cluster != NULL ? cluster->getData<MyClusterData>()->weight : -10);
+		check(weight == 10 * distance, name + ": path " + std::to_string(v) + "-" + std::to_string(w) + " has weight " + std::to_string(weight) + " instead of " + std::to_string(10 * distance));
+		TT.Restore();
+	}
+}
+
+// BatchUpdate must give the same forest as cuts and links applied one by one (big batches change many clusters of the
+// same levels at once)
+void check_batch_update(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " BatchUpdate";
+	const int n = 60;
+	srand(2);
+	Forest forest(n);
+	auto TT = make_top_tree(topology, functions, random_forest(n, forest));
+
+	for (int round = 0; round < 40; round++) {
+		std::vector<std::pair<int, int>> cuts;
+		std::vector<TopTree::LinkUpdate> links;
+		int batch = (round % 2 == 0 ? 5 : 40);
+		for (int k = 0; k < batch; k++) {
+			int v = rand() % n;
+			if (forest.neighbours[v].empty()) continue;
+			int w = *std::next(forest.neighbours[v].begin(), rand() % forest.neighbours[v].size());
+			bool duplicate = false;
+			for (auto &c: cuts) duplicate |= (c == std::make_pair(v, w) || c == std::make_pair(w, v));
+			if (!duplicate) cuts.push_back(std::make_pair(v, w));
+		}
+		for (int k = 0; k < batch; k++) links.push_back(TopTree::LinkUpdate{rand() % n, rand() % n, std::make_shared<MyEdgeData>("b")});
+
+		int expected = 0;
+		for (auto &c: cuts) if (forest.has_edge(c.first, c.second)) { forest.cut(c.first, c.second); expected++; }
+		for (auto &l: links) if (forest.distance(l.v, l.w) < 0) { forest.link(l.v, l.w); expected++; }
+
+		int applied = TT->BatchUpdate(cuts, links);
+		check(applied == expected, name + ": applied " + std::to_string(applied) + " updates instead of " + std::to_string(expected));
+		check_paths(*TT, forest, name);
+	}
+}
 
-	if (isLeftRake(leftChild, rightChild, parent)) {
-		parent_data->weight = right_data->weight;
-		parent_data->label = right_data->label;
-	} else if (isRightRake(leftChild, rightChild, parent)) {
-		parent_data->weight = left_data->weight;
-		parent_data->label = left_data->label;
-	} else {
-		parent_data->weight = left_data->weight + right_data->weight;
-		parent_data->label = left_data->label + "," + right_data->label;
+// QueryPaths must answer every query (also duplicates and swapped endpoints) as a separate Expose
+void check_query_paths(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " QueryPaths";
+	const int n = 60;
+	srand(3);
+	Forest forest(n);
+	auto TT = make_top_tree(topology, functions, random_forest(n, forest));
+
+	std::vector<std::pair<int, int>> paths;
+	for (int k = 0; k < 100; k++) {
+		int v = rand() % n, w = rand() % n;
+		if (v == w) continue;
+		paths.push_back(std::make_pair(v, w));
+		if (k % 10 == 0) paths.push_back(std::make_pair(w, v));
+	}
+	std::vector<int> answered(paths.size(), 0);
+	TT->QueryPaths(paths, [&](size_t i, std::shared_ptr<TopTree::ICluster> cluster) {
+		answered[i]++;
+		int distance = forest.distance(paths[i].first, paths[i].second);
+		int weight = (cluster != NULL ? cluster->getData<MyClusterData>()->weight : -10);
+		check(weight == 10 * distance, name + ": path " + std::to_string(paths[i].first) + "-" + std::to_string(paths[i].second) + " has weight " + std::to_string(weight) + " instead of " + std::to_string(10 * distance));
+	});
+	for (size_t i = 0; i < paths.size(); i++) check(answered[i] == 1, name + ": query " + std::to_string(i) + " answered " + std::to_string(answered[i]) + " times");
+
+	// Tree must stay usable after read-only restores
+	check_paths(*TT, forest, name);
+
+	// Small batches with queries without path (single vertex or different trees) between updates
+	for (int k = 0; k < 30; k++) {
+		int v = rand() % n, w = rand() % n;
+		if (forest.has_edge(v, w)) {
+			TT->Cut(v, w);
+			forest.cut(v, w);
+		} else if (v != w && forest.distance(v, w) < 0) {
+			TT->Link(v, w, std::make_shared<MyEdgeData>("q"));
+			forest.link(v, w);
+		}
+		std::vector<std::pair<int, int>> batch{std::make_pair(rand() % n, rand() % n), std::make_pair(v, v), std::make_pair(v, w)};
+		TT->QueryPaths(batch, [&](size_t i, std::shared_ptr<TopTree::ICluster> cluster) {
+			int distance = (batch[i].first == batch[i].second ? -1 : forest.distance(batch[i].first, batch[i].second));
+			int weight = (cluster != NULL ? cluster->getData<MyClusterData>()->weight : -10);
+			check(weight == 10 * distance, name + ": path " + std::to_string(batch[i].first) + "-" + std::to_string(batch[i].second) + " has weight " + std::to_string(weight) + " instead of " + std::to_string(10 * distance));
+		});
+		check_paths(*TT, forest, name + " (after small batch)");
 	}
+}
 
-	parent_data->total_weight = left_data->total_weight + right_data->total_weight;
-	parent_data->total_label = left_data->total_label + "," + right_data->total_label;
+// Clusters returned to the user stay valid after the top tree (and its cluster pool) is destroyed
+void check_clusters_outlive_tree(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " clusters after destruction";
+	const int n = 40;
+	srand(8);
+	std::vector<std::shared_ptr<TopTree::ICluster>> clusters;
+	{
+		Forest forest(n);
+		auto TT = make_top_tree(topology, functions, random_forest(n, forest));
+		for (int k = 0; k < 20; k++) {
+			clusters.push_back(TT->Expose(rand() % n, rand() % n));
+			clusters.push_back(TT->FindRoot(rand() % n));
+		}
+	}
+	for (auto &c: clusters) {
+		if (c != NULL) check(c->getData<MyClusterData>()->total_weight >= 0, name + ": wrong data");
+	}
+	clusters.clear(); // frees the last chunks of the pool
+}
+
+// Tree built by AddEdges (edges indexed lazily) must allow cutting any edge, also around a high degree vertex
+void check_add_edges(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " AddEdges";
+	const int n = 60;
+	srand(9);
+	Forest forest(n);
+	std::vector<std::pair<int, int>> edges;
+	for (int i = 1; i < n; i++) {
+		int p = (rand() % 3 == 0 ? 0 : rand() % i);
+		edges.push_back(std::make_pair(i, p));
+		forest.link(i, p);
+	}
+	auto base_tree = std::make_shared<TopTree::BaseTree>();
+	base_tree->AddVertices(n);
+	base_tree->AddEdges(edges, [](int) { return std::make_shared<MyEdgeData>("e"); });
+	auto TT = make_top_tree(topology, functions, base_tree);
+	check_paths(*TT, forest, name);
+
+	for (int k = 0; k < 20; k++) {
+		auto &e = edges[rand() % edges.size()];
+		if (!forest.has_edge(e.first, e.second)) continue;
+		check(std::get<2>(TT->Cut(e.second, e.first)) != NULL, name + ": edge " + std::to_string(e.first) + "-" + std::to_string(e.second) + " not found");
+		forest.cut(e.first, e.second);
+	}
+	check_paths(*TT, forest, name);
+}
 
-	#ifdef DEBUG
-		std::cerr << "Joining " << left_data->total_weight << "(" << left_data->label << "/" << left_data->total_label << ") + " << right_data->total_weight << "(" << right_data->label << "/" << right_data->total_label << ")" << std::endl;
-	#endif
+// Every task of every run is done exactly once, also when runs follow each other quickly (workers are reused)
+void check_thread_pool() {
+	TopTree::ThreadPool pool(4);
+	const int tasks = 1000, runs = 50;
+	std::vector<std::atomic<int>> done(tasks);
+	for (auto &d: done) d = 0;
+	for (int r = 0; r < runs; r++) pool.run(tasks, [&](size_t t) { done[t]++; });
+	pool.run(0, [&](size_t t) { done[t]++; });
+	for (int t = 0; t < tasks; t++) check(done[t] == runs, "ThreadPool: task " + std::to_string(t) + " done " + std::to_string(done[t]) + " times");
 }
-void TopTree::Split(std::shared_ptr<ICluster> leftChild, std::shared_ptr<ICluster> rightChild, std::shared_ptr<ICluster> parent) {
-	// Nothing
+
+// Apply must give the same results as the operations done one by one, also when links between shards move trees
+void check_sharded_apply(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " ShardedTopTree::Apply";
+	const int n = 60;
+	srand(10);
+	Forest forest(n);
+	TopTree::ShardedTopTree sharded([&]() -> std::shared_ptr<TopTree::ITopTree> {
+		if (topology) return std::make_shared<TopTree::TopologyTopTree>(functions);
+		return std::make_shared<TopTree::STTopTree>(functions);
+	}, 4, 3);
+	for (int i = 0; i < n; i++) sharded.AddVertex();
+
+	typedef TopTree::ShardedTopTree::Operation Operation;
+	for (int round = 0; round < 30; round++) {
+		std::vector<Operation> operations;
+		std::vector<int> expected; // weight of the exposed path (-10 if there is none)
+		int updates = 0;
+		for (int k = 0; k < 20; k++) {
+			int v = rand() % n, w = rand() % n;
+			if (v == w) continue;
+			if (rand() % 3 == 0 && forest.distance(v, w) < 0) {
+				operations.push_back(Operation{Operation::LINK, v, w, std::make_shared<MyEdgeData>("s")});
+				forest.link(v, w);
+				updates++;
+			} else if (forest.has_edge(v, w)) {
+				operations.push_back(Operation{Operation::CUT, v, w, NULL});
+				forest.cut(v, w);
+				updates++;
+			} else operations.push_back(Operation{Operation::EXPOSE, v, w, NULL});
+			expected.push_back(10 * forest.distance(v, w));
+		}
+
+		std::vector<int> weights(operations.size(), -20); // every callback writes only its own item
+		int applied = sharded.Apply(operations, [&](size_t i, std::shared_ptr<TopTree::ICluster> cluster) {
+			weights[i] = (cluster != NULL ? cluster->getData<MyClusterData>()->weight : -10);
+		});
+		check(applied == updates, name + ": " + std::to_string(applied) + " updates applied instead of " + std::to_string(updates));
+		for (size_t i = 0; i < operations.size(); i++) {
+			if (operations[i].type != Operation::EXPOSE) continue;
+			check(weights[i] == expected[i], name + ": path " + std::to_string(operations[i].v) + "-" + std::to_string(operations[i].w) + " has weight " + std::to_string(weights[i]) + " instead of " + std::to_string(expected[i]));
+		}
+	}
 }
 
-// Creating and destroying Base clusters:
-void TopTree::Create(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge) {
-	auto data = std::dynamic_pointer_cast<MyClusterData>(cluster->data);
-	auto edge_data = std::dynamic_pointer_cast<MyEdgeData>(edge);
-	data->weight = 10;
-	data->total_weight = 10;
-	data->label = edge_data->label;
-	data->total_label = edge_data->label;
+// Labels of edges in the path label (their order depends on orientation of clusters, so they are sorted)
+std::vector<std::string> sorted_labels(const std::string& label) {
+	std::vector<std::string> labels;
+	size_t start = 0;
+	while (start <= label.size()) {
+		size_t end = label.find(',', start);
+		if (end == std::string::npos) end = label.size();
+		labels.push_back(label.substr(start, end - start));
+		start = end + 1;
+	}
+	std::sort(labels.begin(), labels.end());
+	return labels;
 }
-void TopTree::Destroy(std::shared_ptr<ICluster> cluster, std::shared_ptr<EdgeData> edge) {
-	// Nothing
+
+// Loaded tree must give the same paths as the saved one and must stay usable for updates
+void check_save_load(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " Save/Load";
+	const int n = 60;
+	const std::string path = "top_trees_test.bin";
+	srand(5);
+	Forest forest(n);
+	auto TT = make_top_tree(topology, functions, random_forest(n, forest));
+	auto random_updates = [&](std::vector<TopTree::ITopTree*> trees) {
+		for (int k = 0; k < 30; k++) {
+			int v = rand() % n, w = rand() % n;
+			if (forest.has_edge(v, w)) {
+				for (auto t: trees) t->Cut(v, w);
+				forest.cut(v, w);
+			} else if (v != w && forest.distance(v, w) < 0) {
+				for (auto t: trees) t->Link(v, w, std::make_shared<MyEdgeData>(std::to_string(v) + "-" + std::to_string(w)));
+				forest.link(v, w);
+			}
+		}
+	};
+	random_updates({TT.get()});
+
+	TestSerializer serializer;
+	TT->Save(path, serializer);
+	std::shared_ptr<TopTree::ITopTree> loaded;
+	if (topology) loaded = std::make_shared<TopTree::TopologyTopTree>(functions);
+	else loaded = std::make_shared<TopTree::STTopTree>(functions);
+	loaded->Load(path, serializer);
+	std::remove(path.c_str());
+
+	for (int k = 0; k < 30; k++) {
+		int v = rand() % n, w = rand() % n;
+		if (v == w) continue;
+		auto original = TT->Expose(v, w);
+		auto copy = loaded->Expose(v, w);
+		check((original == NULL) == (copy == NULL), name + ": path " + std::to_string(v) + "-" + std::to_string(w) + " exists only in one tree");
+		if (original != NULL && copy != NULL) {
+			auto a = original->getData<MyClusterData>(), b = copy->getData<MyClusterData>();
+			check(a->weight == b->weight && sorted_labels(a->label) == sorted_labels(b->label), name + ": path " + std::to_string(v) + "-" + std::to_string(w) + " is '" + b->label + "' instead of '" + a->label + "'");
+		}
+		TT->Restore();
+		loaded->Restore();
+	}
+
+	random_updates({TT.get(), loaded.get()});
+	check_paths(*loaded, forest, name);
 }
 
-void TopTree::CopyClusterData(std::shared_ptr<ICluster> from, std::shared_ptr<ICluster> to) {
-	auto fromData = std::dynamic_pointer_cast<MyClusterData>(from->data);
-	auto toData = std::dynamic_pointer_cast<MyClusterData>(to->data);
+// Connected and FindRoot must agree with components of the forest after random links and cuts
+void check_connectivity(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " Connected/FindRoot";
+	const int n = 60;
+	srand(6);
+	Forest forest(n);
+	auto TT = make_top_tree(topology, functions, random_forest(n, forest));
+
+	for (int round = 0; round < 20; round++) {
+		for (int k = 0; k < 10; k++) {
+			int v = rand() % n, w = rand() % n;
+			if (forest.has_edge(v, w)) {
+				TT->Cut(v, w);
+				forest.cut(v, w);
+			} else if (v != w && forest.distance(v, w) < 0) {
+				TT->Link(v, w, std::make_shared<MyEdgeData>("c"));
+				forest.link(v, w);
+			}
+		}
+		for (int k = 0; k < 20; k++) {
+			int v = rand() % n, w = rand() % n;
+			bool connected = (forest.distance(v, w) >= 0);
+			check(TT->Connected(v, w) == connected, name + ": wrong connectivity of " + std::to_string(v) + "-" + std::to_string(w));
+			if (v == w) continue;
+			auto root_v = TT->FindRoot(v), root_w = TT->FindRoot(w);
+			check(TT->FindRoot(v) == root_v, name + ": root of " + std::to_string(v) + " changed by FindRoot");
+			if (connected) check(root_v != NULL && root_v == root_w, name + ": connected " + std::to_string(v) + "-" + std::to_string(w) + " have different roots");
+			else check(root_v == NULL || root_v != root_w, name + ": disconnected " + std::to_string(v) + "-" + std::to_string(w) + " have the same root");
+		}
+		// (it must not break following operations)
+		check_paths(*TT, forest, name);
+	}
+}
 
-	toData->weight = fromData->weight;
-	toData->total_weight = fromData->total_weight;
-	toData->label = fromData->label;
-	toData->total_label = fromData->total_label;
+// Connectivity answered by the ComponentCache must match the forest after any mix of operations done through it
+void check_component_cache(bool topology, std::shared_ptr<TopTree::IUserFunctions> functions) {
+	std::string name = std::string(topology ? "Topology" : "ST") + " ComponentCache";
+	const int n = 60;
+	srand(7);
+	Forest forest(n);
+	auto TT = make_top_tree(topology, functions, random_forest(n, forest));
+	TopTree::ComponentCache cache(TT);
+
+	auto check_pair = [&](int v, int w) {
+		bool connected = (forest.distance(v, w) >= 0);
+		check(cache.Connected(v, w) == connected, name + ": wrong connectivity of " + std::to_string(v) + "-" + std::to_string(w));
+		check((cache.ComponentId(v) == cache.ComponentId(w)) == connected, name + ": wrong labels of " + std::to_string(v) + "-" + std::to_string(w));
+	};
+
+	for (int round = 0; round < 300; round++) {
+		int v = rand() % n, w = rand() % n;
+		int operation = rand() % 4;
+		if (operation == 0 && !forest.neighbours[v].empty()) {
+			w = *std::next(forest.neighbours[v].begin(), rand() % forest.neighbours[v].size());
+			cache.Cut(v, w);
+			forest.cut(v, w);
+		} else if (operation == 1 && v != w && forest.distance(v, w) < 0) {
+			cache.Link(v, w, std::make_shared<MyEdgeData>("c"));
+			forest.link(v, w);
+		} else if (operation == 2) {
+			// Left exposed for the following queries (Link and Cut restore it)
+			cache.Expose(v, w);
+		} else if (operation == 3) {
+			cache.Restore();
+		}
+		// Endpoints of the update (their labels were cached before it) and a few random vertices
+		check_pair(v, w);
+		for (int k = 0; k < 5; k++) check_pair(rand() % n, rand() % n);
+
+		if (round % 100 == 99) {
+			// Direct use of the wrapped tree is allowed when followed by Invalidate
+			cache.Restore();
+			check_paths(*TT, forest, name);
+			cache.Invalidate();
+		}
+	}
 }
 
-std::shared_ptr<TopTree::ClusterData> TopTree::InitClusterData() {
-	return std::make_shared<MyClusterData>();
+// Access to internals of TopologyTopTree (friend of it)
+namespace TopTree {
+struct TopologyTopTreeTest {
+	static int SubvertexTreeDiameter(const TopologyTopTree& TT, int v) { return TT.SubvertexTreeDiameter(v); }
+};
 }
 
-void print_node(std::shared_ptr<TopTree::ICluster> node) {
-	if (node != NULL) {
-		auto data = std::dynamic_pointer_cast<MyClusterData>(node->data);
-		std::cerr << "[weight: " << data->weight << ", total_weight:" << data->total_weight << "]: " << data->label << std::endl;
+// Subvertices of a high degree vertex must form a tree with O(log degree) diameter also after many links and cuts
+void check_subvertex_trees(std::shared_ptr<TopTree::IUserFunctions> functions) {
+	const int degree = 1024;
+	auto base_tree = std::make_shared<TopTree::BaseTree>();
+	base_tree->AddVertices(degree + 1);
+	auto TT = std::make_shared<TopTree::TopologyTopTree>(functions, base_tree);
+
+	std::vector<bool> linked(degree + 1, true);
+	for (int i = 1; i <= degree; i++) TT->Link(0, i, std::make_shared<MyEdgeData>("hub"));
+	srand(1);
+	for (int k = 0; k < 10 * degree; k++) {
+		int i = 1 + rand() % degree;
+		if (linked[i]) TT->Cut(0, i);
+		else TT->Link(0, i, std::make_shared<MyEdgeData>("hub"));
+		linked[i] = !linked[i];
 	}
+
+	int diameter = TopTree::TopologyTopTreeTest::SubvertexTreeDiameter(*TT, 0);
+	check(diameter <= 4 * std::log2(degree) + 4, "diameter of subvertices of the hub is " + std::to_string(diameter));
 }
 
 int main(int argc, char const *argv[]) {
@@ -146,8 +610,9 @@ int main(int argc, char const *argv[]) {
 
 	////////////////
 
-	auto TT = std::make_shared<TopTree::TopologyTopTree>(baseTree);
-	//auto TT = std::make_shared<TopTree::STTopTree>(baseTree);
+	auto functions = std::make_shared<TopTree::PolicyFunctions<TestPolicy>>();
+	auto TT = std::make_shared<TopTree::TopologyTopTree>(functions, baseTree);
+	//auto TT = std::make_shared<TopTree::STTopTree>(functions, baseTree);
 	std::cerr << "Top Tree builded" << std::endl;
 
 	auto result = TT->Cut(c, w);
@@ -166,8 +631,26 @@ int main(int argc, char const *argv[]) {
 	print_node(result2);
 	TT->Restore();
 
+	check_thread_pool();
+	check_subvertex_trees(functions);
+	for (bool topology: {false, true}) {
+		check_batch_update(topology, functions);
+		check_query_paths(topology, functions);
+		check_add_edges(topology, functions);
+		check_save_load(topology, functions);
+		check_connectivity(topology, functions);
+		check_component_cache(topology, functions);
+		check_clusters_outlive_tree(topology, functions);
+		check_sharded_apply(topology, functions);
+	}
+	if (failed_checks > 0) {
+		std::cerr << failed_checks << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cerr << "All checks passed" << std::endl;
+
 	/*
-	auto T = std::make_shared<TopTree::STTopTree>(baseTree);
+	auto T = std::make_shared<TopTree::STTopTree>(functions, baseTree);
 
 	for (auto root : T->GetTopTrees()) T->PrintGraphviz(root, "Initial Top Tree");
 	auto node = T->Expose(s, e);